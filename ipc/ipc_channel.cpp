@@ -4,12 +4,14 @@
 
 #include "ipc/ipc_channel.h"
 
-#include <windows.h>
-
 #include "ipc/ipc_listener.h"
 #include "ipc/ipc_utils.h"
 #include "ipc/ipc_message.h"
+#include "ipc/ipc_session.h"
 #include <assert.h>
+#include <stdio.h>
+#include <algorithm>
+#include <limits>
 //#include "ipc/ipc_logging.h"
 //#include "ipc/ipc_message_utils.h"
 
@@ -19,6 +21,14 @@ namespace {
 	// Global atomic used to guarantee channel IDs are unique.
 	StaticAtomicSequenceNumber g_last_id;
 
+	// Index of the priority queue |m| goes to.
+	int PriorityIndex(const IPC::Message* m) {
+		int priority = m->priority();
+		if (priority < IPC::Message::PRIORITY_LOW)
+			priority = IPC::Message::PRIORITY_NORMAL;
+		return priority - IPC::Message::PRIORITY_LOW;
+	}
+
 }  // namespace
 
 namespace IPC {
@@ -32,69 +42,33 @@ namespace IPC {
 		// component. The strong random component prevents other processes from
 		// hijacking or squatting on predictable channel names.
 		char buffer[64] = { 0 }; //10*3 + 2 + 1
-		int process_id = ::GetCurrentProcessId();
+		int process_id = GetCurrentProcId();
 		sprintf(buffer, "%d.%u.%d", process_id, g_last_id.GetNext(), RandInt(0, (std::numeric_limits<int32>::max)()));
 		return std::string(buffer);
 	}
 
-	Channel::State::State(Channel* channel) : is_pending(false) {
-  memset(&context.overlapped, 0, sizeof(context.overlapped));
-  context.handler = channel;
-}
-
-Channel::State::~State() {
-  //COMPILE_ASSERT(!offsetof(Channel::State, context),
-  //               starts_with_io_context);
+Channel::OutputLimits::OutputLimits()
+    : high_bytes(4 * 1024 * 1024),
+      low_bytes(1024 * 1024),
+      high_messages(4096),
+      low_messages(1024) {
 }
 
-Channel::Channel(const IPC::ChannelHandle &channel_handle,
-	Listener* listener, Thread* thread)
-    : ChannelReader(listener),
-      input_state_(this),
-      output_state_(this),
-      pipe_(INVALID_HANDLE_VALUE),
-      peer_pid_(0),
-      waiting_connect_(true),
-      processing_incoming_(false),
-      client_secret_(0),
-	  thread_(thread),
-      validate_client_(false) {
-  CreatePipe(channel_handle);
+Channel::Capabilities::Capabilities()
+    : version(kCapabilitiesVersion),
+      header_version(kHeaderVersion),
+      max_message_size(kMaximumMessageSize),
+      max_batch_size(kMaximumWriteSize),
+      codecs(0),
+      features(0) {
 }
 
-Channel::~Channel() {
-  Close();
-}
-
-void Channel::Close() {
-//   if (thread_check_.get()) {
-//     assert(thread_check_->CalledOnValidThread());
-//   }
-
-  if (input_state_.is_pending || output_state_.is_pending)
-    CancelIo(pipe_);
-
-  // Closing the handle at this point prevents us from issuing more requests
-  // form OnIOCompleted().
-  if (pipe_ != INVALID_HANDLE_VALUE) {
-    CloseHandle(pipe_);
-    pipe_ = INVALID_HANDLE_VALUE;
-  }
-
-  // Make sure all IO has completed.
-  //base::Time start = base::Time::Now();
-  while (input_state_.is_pending || output_state_.is_pending) {
-    thread_->WaitForIOCompletion(INFINITE, this);
-  }
-
-  while (!output_queue_.empty()) {
-    Message* m = output_queue_.front();
-    output_queue_.pop();
-	m->Release();
-  }
+bool Channel::Send(Message* message) {
+  Enqueue(message);
+  return Flush();
 }
 
-bool Channel::Send(Message* message) {
+void Channel::Enqueue(Message* message) {
 //   DCHECK(thread_check_->CalledOnValidThread());
 //   DVLOG(2) << "sending message @" << message << " on channel @" << this
 //            << " with type " << message->type()
@@ -105,7 +79,37 @@ bool Channel::Send(Message* message) {
 #endif
   message->AddRef();
   //message->TraceMessageBegin();
-  output_queue_.push(message);
+  QueueMessage(message, false);
+}
+
+void Channel::QueueMessage(Message* message, bool front) {
+  int priority = PriorityIndex(message);
+  QueuedMessage queued = { message, MonotonicMicroseconds() };
+  if (front)
+    priority_queues_[priority].push_front(queued);
+  else
+    priority_queues_[priority].push_back(queued);
+  priority_queued_messages_++;
+  PriorityStats& stats = output_stats_.priorities[priority];
+  if (++stats.queued > stats.max_queued)
+    stats.max_queued = stats.queued;
+  DidQueueMessage(message);
+}
+
+void Channel::DidQueueMessage(Message* message) {
+  queued_bytes_ += message->size();
+  queued_messages_++;
+  if (!output_blocked_ &&
+      ((output_limits_.high_bytes &&
+        queued_bytes_ >= output_limits_.high_bytes) ||
+       (output_limits_.high_messages &&
+        queued_messages_ >= output_limits_.high_messages))) {
+    output_blocked_ = true;
+    listener()->OnChannelOutputBlocked(true);
+  }
+}
+
+bool Channel::Flush() {
   // ensure waiting to write
   if (!waiting_connect_) {
     if (!output_state_.is_pending) {
@@ -117,362 +121,401 @@ bool Channel::Send(Message* message) {
   return true;
 }
 
+void Channel::DidWriteOutput(size_t bytes_written) {
+  output_stats_.writes++;
+  output_stats_.bytes += bytes_written;
+  assert(bytes_written <= output_queue_bytes_);
+  output_queue_bytes_ -= bytes_written;
+
+  // The write may end anywhere, even in the middle of a message.
+  uint32 completed = 0;
+  while (bytes_written) {
+    assert(!output_queue_.empty());
+    Message* m = output_queue_.front();
+    size_t remaining = m->size() - message_send_bytes_written_;
+    if (bytes_written < remaining) {
+      message_send_bytes_written_ += bytes_written;
+      break;
+    }
+    bytes_written -= remaining;
+
+    // Message was sent.
+    message_send_bytes_written_ = 0;
+    output_queue_.pop_front();
+#if defined(OS_POSIX)
+    if (m->routing_id() == MSG_ROUTING_NONE &&
+        m->type() == SHARED_MEMORY_MESSAGE_TYPE)
+      output_ring_active_ = true;
+#endif
+    DidSendMessage(m);
+    m->Release();
+    completed++;
+  }
 
+  output_stats_.messages += completed;
+  if (completed > output_stats_.max_messages_per_write)
+    output_stats_.max_messages_per_write = completed;
+}
 
-Channel::ReadState Channel::ReadData(
-    char* buffer,
-    int buffer_len,
-    int* /* bytes_read */) {
-  if (INVALID_HANDLE_VALUE == pipe_)
-    return READ_FAILED;
+void Channel::DidSendMessage(Message* message) {
+  if (IsInternalMessage(message))
+    return;
+  queued_bytes_ -= message->size();
+  queued_messages_--;
+  if (output_blocked_ && queued_bytes_ <= output_limits_.low_bytes &&
+      queued_messages_ <= output_limits_.low_messages) {
+    output_blocked_ = false;
+    // The listener may well send again, which must not happen from within
+    // the write that is going on.
+    thread_->ResumeIO(this, &writable_context_);
+  }
+}
 
-  DWORD bytes_read = 0;
-  BOOL ok = ReadFile(pipe_, buffer, buffer_len,
-                     &bytes_read, &input_state_.context.overlapped);
-  if (!ok) {
-    DWORD err = GetLastError();
-    if (err == ERROR_IO_PENDING) {
-      input_state_.is_pending = true;
-      return READ_PENDING;
+bool Channel::ScheduleOutput() {
+  uint64 now = 0;
+  // Without credit the messages wait here, where they still can be passed
+  // by a higher priority.
+  bool flow_control = !!(active_features_ & FEATURE_FLOW_CONTROL);
+  bool reliable = !!(active_features_ & FEATURE_RELIABLE);
+  // Messages sent before the hello of the peer may have to wait for the
+  // ones it missed from the channel before.
+  if ((features_ & FEATURE_RELIABLE) && !hello_received_)
+    return !output_queue_.empty();
+  // The acknowledgement rides along with the messages written anyway.
+  if (reliable && priority_queued_messages_ &&
+      session_->received() != acked_received_)
+    QueueAck();
+  while (priority_queued_messages_ &&
+         output_queue_bytes_ < capabilities_.max_batch_size &&
+         (!flow_control || send_credit_ > 0)) {
+    int priority;
+    if (output_scheduling_ == SCHEDULE_STRICT) {
+      priority = kPriorityCount - 1;
+      while (priority_queues_[priority].empty())
+        --priority;
+    } else {
+      priority = scheduling_priority_;
+      const std::deque<QueuedMessage>& queue = priority_queues_[priority];
+      if (queue.empty() ||
+          queue.front().message->size() > scheduling_deficit_[priority]) {
+        // An idle priority does not save up its share.
+        if (queue.empty())
+          scheduling_deficit_[priority] = 0;
+
+        // Turn goes from high to low, then back to high.
+        priority = priority ? priority - 1 : kPriorityCount - 1;
+        scheduling_priority_ = priority;
+        if (!priority_queues_[priority].empty())
+          scheduling_deficit_[priority] += kSchedulingQuantum << priority;
+        continue;
+      }
+      scheduling_deficit_[priority] -= queue.front().message->size();
     }
-    //LOG(ERROR) << "pipe error: " << err;
-    return READ_FAILED;
+
+    QueuedMessage queued = priority_queues_[priority].front();
+    priority_queues_[priority].pop_front();
+    priority_queued_messages_--;
+    output_queue_.push_back(queued.message);
+    output_queue_bytes_ += queued.message->size();
+    if (flow_control)
+      send_credit_ -= queued.message->size();
+    if (reliable)
+      session_->DidSend(queued.message);
+
+    if (!now)
+      now = MonotonicMicroseconds();
+    uint64 delay = now > queued.queued_time ? now - queued.queued_time : 0;
+    PriorityStats& stats = output_stats_.priorities[priority];
+    stats.queued--;
+    stats.dequeued++;
+    stats.total_delay += delay;
+    if (delay > stats.max_delay)
+      stats.max_delay = delay;
   }
+  return !output_queue_.empty();
+}
 
-  // We could return READ_SUCCEEDED here. But the way that this code is
-  // structured we instead go back to the message loop. Our completion port
-  // will be signalled even in the "synchronously completed" state.
-  //
-  // This allows us to potentially process some outgoing messages and
-  // interleave other work on this thread when we're getting hammered with
-  // input messages. Potentially, this could be tuned to be more efficient
-  // with some testing.
-  input_state_.is_pending = true;
-  return READ_PENDING;
+void Channel::ClearOutputQueues() {
+  while (!output_queue_.empty()) {
+    Message* m = output_queue_.front();
+    output_queue_.pop_front();
+    m->Release();
+  }
+  message_send_bytes_written_ = 0;
+  output_queue_bytes_ = 0;
+
+  // With FEATURE_RELIABLE the next channel writes what this one could not.
+  // Before the hello of the peer it is not known yet whether it takes part.
+  // Never written, these are not part of the stream yet, and do not count
+  // against the limits of the Session.
+  bool reliable = session_ && (hello_received_ ?
+      (active_features_ & FEATURE_RELIABLE) : (features_ & FEATURE_RELIABLE));
+  for (int i = kPriorityCount - 1; i >= 0; --i) {
+    while (!priority_queues_[i].empty()) {
+      if (reliable)
+        session_->KeepUnsent(priority_queues_[i].front().message);
+      priority_queues_[i].front().message->Release();
+      priority_queues_[i].pop_front();
+    }
+    output_stats_.priorities[i].queued = 0;
+    scheduling_deficit_[i] = 0;
+  }
+  priority_queued_messages_ = 0;
+  queued_bytes_ = 0;
+  queued_messages_ = 0;
+  output_blocked_ = false;
 }
 
 bool Channel::WillDispatchInputMessage(Message* msg) {
   // Make sure we get a hello when client validation is required.
   if (validate_client_)
     return IsHelloMessage(msg);
+
+  if (IsInternalMessage(msg))
+    return true;
+  if (active_features_ & FEATURE_FLOW_CONTROL) {
+    consumed_bytes_ += msg->size();
+    if (consumed_bytes_ >= kFlowControlWindow / 4 && !GrantCredit())
+      return false;
+  }
+  if (active_features_ & FEATURE_RELIABLE) {
+    // Make sure the peer can let go of its messages even when nothing is
+    // written back.
+    if (session_->received() - acked_received_ >= kAckInterval) {
+      QueueAck();
+      if (!output_state_.is_pending && !waiting_connect_ &&
+          !ProcessOutgoingMessages(NULL, 0))
+        return false;
+    }
+    // Counted last, a message that is not dispatched is written again by
+    // the peer on the next channel.
+    session_->DidReceive();
+    if (!ack_timer_.IsRunning())
+      ack_timer_.Start(thread_, kAckDelay,
+                       std::bind(&Channel::OnAckTimer, this));
+  }
   return true;
 }
 
-void Channel::HandleHelloMessage(Message* msg) {
-  // The hello message contains one parameter containing the PID.
-	MessageReader it(msg);
-	int32 claimed_pid;
-	bool failed = !it.ReadInt(&claimed_pid);
-
-	if (!failed && validate_client_) {
-		int32 secret;
-		failed = it.ReadInt(&secret) ? (secret != client_secret_) : true;
-	}
-
-	if (failed) {
-		assert(0);
-		Close();
-		listener()->OnChannelError();
-		return;
-	}
-
-	peer_pid_ = claimed_pid;
-	// Validation completed.
-	validate_client_ = false;
-	listener()->OnChannelConnected(claimed_pid);
+bool Channel::GrantCredit() {
+  Message* m = new Message(MSG_ROUTING_NONE,
+                           CREDIT_MESSAGE_TYPE,
+                           IPC::Message::PRIORITY_NORMAL);
+  m->AddRef();
+  m->WriteUInt32(static_cast<uint32>(consumed_bytes_));
+  consumed_bytes_ = 0;
+  return SendInternalMessage(m);
 }
 
-bool Channel::DidEmptyInputBuffers() {
-  // We don't need to do anything here.
+bool Channel::SendInternalMessage(Message* message) {
+  output_queue_.push_back(message);
+  output_queue_bytes_ += message->size();
+  if (!output_state_.is_pending && !waiting_connect_)
+    return ProcessOutgoingMessages(NULL, 0);
   return true;
 }
 
-// static
-const std::wstring Channel::PipeName(
-    const std::string& channel_id, int32* secret) {
-  std::string name("\\\\.\\pipe\\ipc.");
-
-  // Prevent the shared secret from ending up in the pipe name.
-  size_t index = channel_id.find_first_of('\\');
-  if (index != std::string::npos) {
-	  if (secret) {  // Retrieve the secret if asked for.
-		  *secret = atoi(channel_id.substr(index + 1).c_str());
-	  }
-    return ASCIIToWide(name.append(channel_id.substr(0, index - 1)));
-  }
+bool Channel::HandleCreditMessage(Message* msg) {
+  MessageReader it(msg);
+  uint32 granted;
+  if (!(active_features_ & FEATURE_FLOW_CONTROL) || !it.ReadUInt32(&granted))
+    return false;
 
-  // This case is here to support predictable named pipes in tests.
-  if (secret)
-    *secret = 0;
-  return ASCIIToWide(name.append(channel_id));
+  bool stalled = send_credit_ <= 0;
+  send_credit_ += granted;
+  if (stalled && priority_queued_messages_ && !output_state_.is_pending &&
+      !waiting_connect_)
+    return ProcessOutgoingMessages(NULL, 0);
+  return true;
 }
 
-bool Channel::CreatePipe(const IPC::ChannelHandle &channel_handle) {
-  assert(INVALID_HANDLE_VALUE == pipe_);
-  std::wstring pipe_name;
-  // If we already have a valid pipe for channel just copy it.
-  if (channel_handle.pipe.handle) {
-    assert(channel_handle.name.empty());
-    pipe_name = L"Not Available";  // Just used for LOG
-    // Check that the given pipe confirms to the specified mode.  We can
-    // only check for PIPE_TYPE_MESSAGE & PIPE_SERVER_END flags since the
-    // other flags (PIPE_TYPE_BYTE, and PIPE_CLIENT_END) are defined as 0.
-    DWORD flags = 0;
-    GetNamedPipeInfo(channel_handle.pipe.handle, &flags, NULL, NULL, NULL);
-    assert(!(flags & PIPE_TYPE_MESSAGE));
-    if (!DuplicateHandle(GetCurrentProcess(),
-                         channel_handle.pipe.handle,
-                         GetCurrentProcess(),
-                         &pipe_,
-                         0,
-                         FALSE,
-                         DUPLICATE_SAME_ACCESS)) {
-      //LOG(WARNING) << "DuplicateHandle failed. Error :" << GetLastError();
-      return false;
-    }
-  } else {
-	assert(!channel_handle.pipe.handle);
-	pipe_name = PipeName(channel_handle.name, &client_secret_);
-
-	//ȳԴ
-    const DWORD open_mode = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED |
-                            FILE_FLAG_FIRST_PIPE_INSTANCE;
-    validate_client_ = !!client_secret_;
-    pipe_ = CreateNamedPipeW(pipe_name.c_str(),
-                             open_mode,
-                             PIPE_TYPE_BYTE | PIPE_READMODE_BYTE,
-                             1,
-                             kReadBufferSize,
-                             kReadBufferSize,
-                             5000,
-                             NULL);
-	if (pipe_ == INVALID_HANDLE_VALUE)
-	{
-		pipe_ = CreateFileW(pipe_name.c_str(),
-			GENERIC_READ | GENERIC_WRITE,
-			0,
-			NULL,
-			OPEN_EXISTING,
-			SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION |
-			FILE_FLAG_OVERLAPPED,
-			NULL);
-
-		waiting_connect_ = false;
-	}
-  } 
+void Channel::WriteCapabilities(Message* hello) {
+  Capabilities caps;
+  hello->WriteUInt32(caps.version);
+  hello->WriteUInt32(4);
+  hello->WriteUInt32(caps.header_version);
+  hello->WriteUInt32(caps.max_message_size);
+  hello->WriteUInt32(caps.max_batch_size);
+  hello->WriteUInt32(caps.codecs);
+}
 
-  if (pipe_ == INVALID_HANDLE_VALUE) {
-    // If this process is being closed, the pipe may be gone already.
-    //LOG(WARNING) << "Unable to create pipe \"" << pipe_name <<
-    //                "\" in " << (mode & MODE_SERVER_FLAG ? "server" : "client")
-    //                << " mode. Error :" << GetLastError();
-    return false;
-  }
+// static
+bool Channel::ReadCapabilities(MessageReader* it, Capabilities* caps) {
+  uint32 version;
+  if (!it->ReadUInt32(&version))
+    return true;
 
-  // Create the Hello message to be sent when Connect is called
-  Message* m = new Message(MSG_ROUTING_NONE,
-                                    HELLO_MESSAGE_TYPE,
-                                    IPC::Message::PRIORITY_NORMAL);
-  m->AddRef();
-  // Don't send the secret to the untrusted process, and don't send a secret
-  // if the value is zero (for IPC backwards compatability).
-  int32 secret = validate_client_ ? 0 : client_secret_;
-  if (!m->WriteInt(GetCurrentProcessId()) ||
-      (secret && !m->WriteUInt32(secret))) {
-    CloseHandle(pipe_);
-    pipe_ = INVALID_HANDLE_VALUE;
-	m->Release();
+  uint32 count;
+  if (!it->ReadUInt32(&count))
     return false;
+  uint32 fields[4];
+  for (uint32 i = 0; i < count; ++i) {
+    uint32 value;
+    if (!it->ReadUInt32(&value))
+      return false;
+    if (i < 4)
+      fields[i] = value;
   }
-
-  output_queue_.push(m);
+  // Every version so far has at least the fields of version 1.
+  if (!version || count < 4 || !fields[1] || !fields[2])
+    return false;
+  caps->version = version;
+  caps->header_version = fields[0];
+  caps->max_message_size = fields[1];
+  caps->max_batch_size = fields[2];
+  caps->codecs = fields[3];
   return true;
 }
 
-bool Channel::Connect() {
-  //DLOG_IF(WARNING, thread_check_.get()) << "Connect called more than once";
-
-  //if (!thread_check_.get())
-  //  thread_check_.reset(new base::ThreadChecker());
+void Channel::WriteSessionState(Message* hello) {
+  session_->WillConnect();
+  hello->WriteUInt64(session_->id());
+  hello->WriteUInt64(session_->received());
+  hello->WriteUInt64(session_->peer_id());
+}
 
-  if (pipe_ == INVALID_HANDLE_VALUE)
+bool Channel::ResumeSession(uint64 peer_id, uint64 peer_received,
+                            uint64 echoed_id) {
+  acked_received_ = session_->received();
+  std::vector<Message*> replay;
+  if (!session_->Resume(peer_id, peer_received, echoed_id, &replay))
     return false;
 
-  thread_->RegisterIOHandler(pipe_, this);
-
-  // Check to see if there is a client connected to our pipe...
-  if (waiting_connect_)
-    ProcessConnection();
-
-  if (!input_state_.is_pending) {
-    // Complete setup asynchronously. By not setting input_state_.is_pending
-    // to true, we indicate to OnIOCompleted that this is the special
-    // initialization signal.
-	  thread_->PostTask(
-        std::bind(&Channel::OnIOCompleted,
-                   this,
-                   &input_state_.context,
-                   0,
-                   0));
+  // Ahead of anything sent from now on, and counted like queued messages
+  // until written. They use up credit like any other.
+  for (size_t i = 0; i < replay.size(); ++i) {
+    output_queue_.push_back(replay[i]);
+    output_queue_bytes_ += replay[i]->size();
+    if (active_features_ & FEATURE_FLOW_CONTROL)
+      send_credit_ -= replay[i]->size();
+    DidQueueMessage(replay[i]);
   }
-
-  if (!waiting_connect_)
-    ProcessOutgoingMessages(NULL, 0);
   return true;
 }
 
-bool Channel::ProcessConnection() {
-  //DCHECK(thread_check_->CalledOnValidThread());
-  if (input_state_.is_pending)
-    input_state_.is_pending = false;
-
-  // Do we have a client connected to our pipe?
-  if (INVALID_HANDLE_VALUE == pipe_)
-    return false;
+void Channel::QueueUnsentMessages() {
+  // Older than anything queued since, they go ahead of it.
+  std::vector<Message*> unsent;
+  session_->TakeUnsent(&unsent);
+  for (size_t i = unsent.size(); i > 0; --i)
+    QueueMessage(unsent[i - 1], true);
+}
 
-  BOOL ok = ConnectNamedPipe(pipe_, &input_state_.context.overlapped);
+void Channel::QueueAck() {
+  Message* m = new Message(MSG_ROUTING_NONE,
+                           ACK_MESSAGE_TYPE,
+                           IPC::Message::PRIORITY_NORMAL);
+  m->AddRef();
+  m->WriteUInt64(session_->received());
+  acked_received_ = session_->received();
+  output_queue_.push_back(m);
+  output_queue_bytes_ += m->size();
+}
 
-  DWORD err = GetLastError();
-  if (ok) {
-    // Uhm, the API documentation says that this function should never
-    // return success when used in overlapped mode.
-    assert(0);
-    return false;
-  }
+void Channel::OnAckTimer() {
+  if (session_->received() == acked_received_)
+    return;
+  QueueAck();
+  // A write error shows on the read side as well.
+  Flush();
+}
 
-  switch (err) {
-  case ERROR_IO_PENDING:
-    input_state_.is_pending = true;
-    break;
-  case ERROR_PIPE_CONNECTED:
-    waiting_connect_ = false;
-    break;
-  case ERROR_NO_DATA:
-    // The pipe is being closed.
-    return false;
-  default:
-    assert(0);
+bool Channel::HandleAckMessage(Message* msg) {
+  MessageReader it(msg);
+  uint64 received;
+  if (!(active_features_ & FEATURE_RELIABLE) || !it.ReadUInt64(&received))
     return false;
-  }
-
+  session_->Acknowledge(received);
   return true;
 }
 
-bool Channel::ProcessOutgoingMessages(
-    Thread::IOContext* context,
-    DWORD bytes_written) {
-  assert(!waiting_connect_);  // Why are we trying to send messages if there's
-                              // no connection?
-  //DCHECK(thread_check_->CalledOnValidThread());
-
-  if (output_state_.is_pending) {
-    assert(context);
-    output_state_.is_pending = false;
-    if (!context || bytes_written == 0) {
-      DWORD err = GetLastError();
-      //LOG(ERROR) << "pipe error: " << err;
-      return false;
-    }
-    // Message was sent.
-	assert(!output_queue_.empty());
-    Message* m = output_queue_.front();
-    output_queue_.pop();
-	m->Release();
-  }
+bool Channel::HandleHelloMessage(Message* msg) {
+  // The hello message contains one parameter containing the PID.
+	MessageReader it(msg);
+	int32 claimed_pid;
+	bool failed = !it.ReadInt(&claimed_pid);
 
-  if (output_queue_.empty())
-    return true;
+	if (!failed && validate_client_) {
+		int32 secret;
+		failed = it.ReadInt(&secret) ? (secret != client_secret_) : true;
+	}
 
-  if (INVALID_HANDLE_VALUE == pipe_)
-    return false;
+	// Peers that predate feature negotiation end the hello here.
+	uint32 peer_features;
+	if (failed || !it.ReadUInt32(&peer_features))
+		peer_features = 0;
+
+	// The session comes whenever the peer offered FEATURE_RELIABLE, it is
+	// only used if both did.
+	uint64 peer_stream = 0, peer_received = 0, echoed_stream = 0;
+	if (!failed && (peer_features & FEATURE_RELIABLE)) {
+		failed = !it.ReadUInt64(&peer_stream) ||
+			!it.ReadUInt64(&peer_received) ||
+			!it.ReadUInt64(&echoed_stream);
+	}
 
-  // Write to pipe...
-  Message* m = output_queue_.front();
-  assert(m->size() <= INT_MAX);
-  BOOL ok = WriteFile(pipe_,
-                      m->data(),
-                      static_cast<int>(m->size()),
-                      &bytes_written,
-                      &output_state_.context.overlapped);
-  if (!ok) {
-    DWORD err = GetLastError();
-    if (err == ERROR_IO_PENDING) {
-      output_state_.is_pending = true;
-
-      //DVLOG(2) << "sent pending message @" << m << " on channel @" << this
-      //         << " with type " << m->type();
-
-      return true;
-    }
-    //LOG(ERROR) << "pipe error: " << err;
-    return false;
-  }
+	// Peers that predate the capability block end the hello here.
+	Capabilities peer_caps;
+	peer_caps.version = 0;
+	if (!failed && !ReadCapabilities(&it, &peer_caps))
+		failed = true;
 
-  //DVLOG(2) << "sent message @" << m << " on channel @" << this
-  //         << " with type " << m->type();
+	if (failed) {
+		assert(0);
+		return false;
+	}
 
-  output_state_.is_pending = true;
-  return true;
+	peer_pid_ = claimed_pid;
+	hello_received_ = true;
+	// Validation completed.
+	validate_client_ = false;
+	// Whatever the features do first may already need credit.
+	send_credit_ = kFlowControlWindow;
+	consumed_bytes_ = 0;
+	if (!ActivateFeatures(peer_features))
+		return false;
+	Capabilities& caps = capabilities_;
+	caps.version = (std::min)(caps.version, peer_caps.version);
+	caps.header_version = (std::min)(caps.header_version,
+		peer_caps.header_version);
+	caps.max_message_size = (std::min)(caps.max_message_size,
+		peer_caps.max_message_size);
+	caps.max_batch_size = (std::min)(caps.max_batch_size,
+		peer_caps.max_batch_size);
+	caps.codecs &= peer_caps.codecs;
+	caps.features = active_features_;
+	if ((active_features_ & FEATURE_RELIABLE) &&
+		!ResumeSession(peer_stream, peer_received, echoed_stream))
+		return false;
+	if (session_)
+		QueueUnsentMessages();
+
+	// Also writes what was held back for the hello, see ScheduleOutput().
+	if ((!output_queue_.empty() || priority_queued_messages_) &&
+		!output_state_.is_pending && !waiting_connect_ &&
+		!ProcessOutgoingMessages(NULL, 0))
+		return false;
+	if (session_ && session_->TakeStreamReset())
+		listener()->OnChannelStreamReset();
+	listener()->OnChannelConnected(claimed_pid);
+	return true;
 }
 
-void Channel::OnIOCompleted(
-    Thread::IOContext* context,
-    DWORD bytes_transfered,
-    DWORD error) {
-  bool ok = true;
-  //assert(thread_check_->CalledOnValidThread());
-  if (context == &input_state_.context) {
-    if (waiting_connect_) {
-      if (!ProcessConnection())
-        return;
-      // We may have some messages queued up to send...
-      if (!output_queue_.empty() && !output_state_.is_pending)
-        ProcessOutgoingMessages(NULL, 0);
-      if (input_state_.is_pending)
-        return;
-      // else, fall-through and look for incoming messages...
-    }
-
-    // We don't support recursion through OnMessageReceived yet!
-	assert(!processing_incoming_);
-	processing_incoming_ = true;
-
-    // Process the new data.
-    if (input_state_.is_pending) {
-      // This is the normal case for everything except the initialization step.
-      input_state_.is_pending = false;
-      if (!bytes_transfered)
-        ok = false;
-      else if (pipe_ != INVALID_HANDLE_VALUE)
-        ok = AsyncReadComplete(bytes_transfered);
-    } else {
-      assert(!bytes_transfered);
-    }
-
-    // Request more data.
-    if (ok)
-      ok = ProcessIncomingMessages();
+bool Channel::DidEmptyInputBuffers() {
+  // We don't need to do anything here.
+  return true;
+}
 
-	processing_incoming_ = false;
-  } else {
-	  assert(context == &output_state_.context);
-    ok = ProcessOutgoingMessages(context, bytes_transfered);
-  }
-  if (!ok && INVALID_HANDLE_VALUE != pipe_) {
-    // We don't want to re-enter Close().
-    Close();
-    listener()->OnChannelError();
-  }
+void Channel::ResumeReadingLater() {
+  // OnIOCompleted() treats this like the initial signal posted by Connect()
+  // and goes on reading.
+  thread_->ResumeIO(this, &input_state_.context);
 }
 
-// static
-bool Channel::IsNamedServerInitialized(
-	const std::string& channel_id) {
-	if (WaitNamedPipe(PipeName(channel_id, NULL).c_str(), 1))
-		return true;
-	// If ERROR_SEM_TIMEOUT occurred, the pipe exists but is handling another
-	// connection.
-	return GetLastError() == ERROR_SEM_TIMEOUT;
+bool Channel::KeepsInputOrder() const {
+  // The messages the session counts as received have to be the first ones
+  // of the stream, whatever broke off the dispatch.
+  return !!(active_features_ & FEATURE_RELIABLE);
 }
 
 // static
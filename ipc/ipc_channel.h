@@ -5,8 +5,9 @@
 #ifndef IPC_IPC_CHANNEL_WIN_H_
 #define IPC_IPC_CHANNEL_WIN_H_
 
-#include <queue>
+#include <deque>
 #include <string>
+#include <vector>
 
 #include "ipc/ipc_common.h"
 #include "ipc/ipc_thread.h"
@@ -14,8 +15,18 @@
 #include "ipc/ipc_channel_handle.h"
 #include "ipc/ipc_channel_reader.h"
 
+#if defined(OS_POSIX)
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "ipc/ipc_shared_ring.h"
+#endif
+
 namespace IPC 
 {
+	class MessageReader;
+	class Session;
+
 	class Channel
 		: public Sender
 		, public internal::ChannelReader
@@ -23,26 +34,207 @@ namespace IPC
 	{
 	public:
 		enum {
-			HELLO_MESSAGE_TYPE = kuint16max  // Maximum value of message type (uint16),
+			HELLO_MESSAGE_TYPE = kuint16max,  // Maximum value of message type (uint16),
 			// to avoid conflicting with normal
 			// message types, which are enumeration
 			// constants starting from 0.
+
+			// Last message a side sends over the pipe before it moves its output
+			// to the shared memory ring.
+			SHARED_MEMORY_MESSAGE_TYPE = HELLO_MESSAGE_TYPE - 1,
+
+			// Grants the peer more bytes to send, see FEATURE_FLOW_CONTROL.
+			CREDIT_MESSAGE_TYPE = SHARED_MEMORY_MESSAGE_TYPE - 1,
+
+			// Acknowledges the messages received, see FEATURE_RELIABLE.
+			ACK_MESSAGE_TYPE = CREDIT_MESSAGE_TYPE - 1,
+
+			// Messages routed to MSG_ROUTING_NONE with a type from here up to
+			// HELLO_MESSAGE_TYPE are handled by the channel itself.
+			FIRST_INTERNAL_MESSAGE_TYPE = ACK_MESSAGE_TYPE
 		};
 
+		// Optional features a channel offers to its peer in the hello message.
+		// A feature is only used when both sides offer it.
+		enum Feature {
+			// Carry messages through a pair of rings in shared memory instead of
+			// the pipe once the hello exchange completed. POSIX only.
+			FEATURE_SHARED_MEMORY = 1 << 0,
+			// Credit based flow control. A side only writes messages while
+			// the peer granted it room for them, the peer grants more as it
+			// dispatches what it received. Bounds the data in transit to
+			// about kFlowControlWindow bytes per direction, what does not fit
+			// waits in the output queue, see OutputLimits.
+			FEATURE_FLOW_CONTROL = 1 << 1,
+			// Messages lost with a broken channel are written again by the
+			// next channel of the same Session, see ipc_session.h. Only offered by
+			// channels created with a session. PRIORITY_HIGH messages are then
+			// dispatched in the order they arrived, like the rest.
+			FEATURE_RELIABLE = 1 << 2,
+		};
+
+		// With FEATURE_RELIABLE, a side acknowledges the messages it received
+		// along with the next messages it writes, or by themselves once this
+		// many are waiting, or kAckDelay milliseconds after the first of them
+		// arrived.
+		static const uint64 kAckInterval = 64;
+		static const DWORD kAckDelay = 5;
+
+		// Bytes a side may send ahead of what the peer dispatched, with
+		// FEATURE_FLOW_CONTROL. The peer grants them again in steps of a
+		// quarter of the window.
+		static const size_t kFlowControlWindow = 1024 * 1024;
+
 		// The maximum message size in bytes. Attempting to receive a message of this
 		// size or bigger results in a channel error.
 		static const size_t kMaximumMessageSize = 128 * 1024 * 1024;
 
+		// Queued messages are written together until a write reaches this many
+		// bytes, or the lower limit of the peer, see Capabilities. A single
+		// message bigger than this is still written at once.
+		static const size_t kMaximumWriteSize = 64 * 1024;
+
+		// Version of the capability block this build puts into the hello, and
+		// of the message header format.
+		static const uint32 kCapabilitiesVersion = 1;
+		static const uint32 kHeaderVersion = 1;
+
+		// What a side can do, exchanged in the hello after the features. Once
+		// the hello arrived, capabilities() holds what both sides agreed on:
+		// the lower of the versions and sizes, the codecs both know and the
+		// features both offered. A peer that predates the block counts as
+		// version 0 with the limits of this build.
+		//
+		// The block is a version, a count and that many uint32 fields. Later
+		// versions only append fields, and put further hello data into the
+		// block, so older peers skip what they do not know.
+		struct Capabilities {
+			// The values of this build.
+			Capabilities();
+
+			uint32 version;
+			uint32 header_version;
+			// Largest message the side takes, see kMaximumMessageSize.
+			uint32 max_message_size;
+			// Most bytes of small messages coalesced into a single write, see
+			// kMaximumWriteSize.
+			uint32 max_batch_size;
+			// Compression codecs the side can decode, one bit each. There are
+			// none yet, so this is 0 for now.
+			uint32 codecs;
+			// Feature values, only filled in by the agreement.
+			uint32 features;
+		};
+
+		// Outgoing messages wait in one queue per Message::PriorityValue, the
+		// queue of PRIORITY_LOW comes first. Messages of the same priority are
+		// written in the order they were sent.
+		enum { kPriorityCount = 3 };
+
+		// How the priorities share the pipe.
+		enum OutputScheduling {
+			// A message is only written when no message of a higher priority is
+			// waiting.
+			SCHEDULE_STRICT,
+			// Deficit round robin over the bytes written. PRIORITY_NORMAL gets
+			// twice and PRIORITY_HIGH four times the share of PRIORITY_LOW, so no
+			// priority is starved.
+			SCHEDULE_WEIGHTED,
+		};
+
+		// Share of PRIORITY_LOW per round of SCHEDULE_WEIGHTED, in bytes.
+		static const size_t kSchedulingQuantum = 16 * 1024;
+
+		struct PriorityStats {
+			// Messages waiting now, and the most that ever waited.
+			uint32 queued;
+			uint32 max_queued;
+			// Messages that left the queue to be written, and the time they
+			// spent in it in microseconds.
+			uint64 dequeued;
+			uint64 total_delay;
+			uint64 max_delay;
+		};
+
+		// Watermarks of the messages sent and not written yet. The channel
+		// reports its output blocked once they reach |high_bytes| or
+		// |high_messages|, and unblocked when they are down to |low_bytes|
+		// and |low_messages| again, see Listener::OnChannelOutputBlocked().
+		// A high watermark of 0 means no limit. Send() takes messages either
+		// way, it is up to the caller to hold back.
+		struct OutputLimits {
+			// 4 MB and 4096 messages, and a quarter of that to unblock.
+			OutputLimits();
+
+			size_t high_bytes;
+			size_t low_bytes;
+			size_t high_messages;
+			size_t low_messages;
+		};
+
+		// Counters of the output path. Averages per write are |messages| or
+		// |bytes| divided by |writes|.
+		struct OutputStats {
+			// Write calls that moved data.
+			uint64 writes;
+			// Messages completely written.
+			uint64 messages;
+			// Bytes written.
+			uint64 bytes;
+			// Most messages completed by a single write.
+			uint32 max_messages_per_write;
+			// Queues of the priorities, PRIORITY_LOW first.
+			PriorityStats priorities[kPriorityCount];
+		};
+
 		// Mirror methods of Channel, see ipc_channel.h for description.
+		// |features| is a combination of Feature values to offer to the peer.
+		// Features not supported on this platform are ignored. |session|, if
+		// set, must outlive the channel.
 		Channel(const IPC::ChannelHandle &channel_handle,
-			Listener* listener, Thread* thread);
+			Listener* listener, Thread* thread, uint32 features = 0,
+			Session* session = NULL);
 		~Channel();
 		bool Connect();
 		void Close();
 		virtual bool Send(Message* message) override;
+
+		// Queues |message| like Send() without writing it yet, so a batch of
+		// messages goes out with the writes of a single Flush().
+		void Enqueue(Message* message);
+		// Writes what Enqueue() queued. Returns false on a write error.
+		bool Flush();
+
 		DWORD peer_pid() const { return peer_pid_; }
 
+		// True while a server-mode channel waits for its client. What is
+		// queued meanwhile is written once the client connects.
+		bool waiting_connect() const { return waiting_connect_; }
+
+		// Features in use on this channel, valid once the hello arrived.
+		uint32 active_features() const { return active_features_; }
+
+		// The capabilities both sides agreed on, valid once the hello
+		// arrived.
+		const Capabilities& capabilities() const { return capabilities_; }
+
+		const OutputStats& output_stats() const { return output_stats_; }
+
+		void set_output_scheduling(OutputScheduling scheduling) {
+			output_scheduling_ = scheduling;
+		}
+
+		void set_output_limits(const OutputLimits& limits) {
+			output_limits_ = limits;
+		}
+
+		// True from the time the output reached a high watermark until it
+		// drained to the low watermarks.
+		bool output_blocked() const { return output_blocked_; }
+
 	private:
+		friend class Server;
+
 		// Returns true if a named server channel is initialized on the given channel
 		// ID. Even if true, the server may have already accepted a connection.
 		static bool IsNamedServerInitialized(const std::string& channel_id);
@@ -62,21 +254,146 @@ namespace IPC
 			int* bytes_read) override;
 		virtual bool WillDispatchInputMessage(Message* msg) override;
 		bool DidEmptyInputBuffers() override;
-		virtual void HandleHelloMessage(Message* msg) override;
+		virtual bool HandleHelloMessage(Message* msg) override;
+		virtual bool HandleInternalMessage(Message* msg) override;
+		virtual void ResumeReadingLater() override;
+		virtual bool KeepsInputOrder() const override;
+
+		// Turns on the features both sides offered. Returns false on failure.
+		bool ActivateFeatures(uint32 peer_features);
 
+		// Puts the capabilities of this build into the hello, and reads those
+		// of the peer. Returns false on a malformed block, |caps| is left
+		// alone if the peer sent none.
+		void WriteCapabilities(Message* hello);
+		static bool ReadCapabilities(MessageReader* it, Capabilities* caps);
+
+#if defined(OS_WIN)
 		static const std::wstring PipeName(const std::string& channel_id,
 			int32* secret);
+
+		// Creates a server instance of the pipe of |channel_id| for Server,
+		// which accepts any number of instances. Unless it is the |first|, the
+		// name must already exist. Returns INVALID_HANDLE_VALUE on failure.
+		static HANDLE CreateServerInstance(const std::string& channel_id,
+			bool first);
+#else
+		// Returns the name of the socket in the abstract namespace, without the
+		// leading NUL byte.
+		static const std::string PipeName(const std::string& channel_id,
+			int32* secret);
+
+		// Binds a socket to the name of |channel_id| and listens on it with
+		// room for |backlog| connections, for Server. Returns -1 on failure.
+		static int CreateListeningSocket(const std::string& channel_id,
+			int backlog);
+#endif
 		bool CreatePipe(const IPC::ChannelHandle &channel_handle);
 
 		bool ProcessConnection();
 		bool ProcessOutgoingMessages(Thread::IOContext* context,
 			DWORD bytes_written);
 
+#if defined(OS_WIN)
+		// Copies the queued messages into |output_buffer_| for a single write,
+		// up to the agreed max_batch_size. Returns false if the first message is
+		// better written by itself.
+		bool GatherSmallMessages(const char** data, size_t* size);
+#endif
+
+		// Accounts for |bytes_written| bytes of the queued messages having been
+		// written and releases the messages they completed.
+		void DidWriteOutput(size_t bytes_written);
+
+		// Moves messages from the priority queues to |output_queue_|, in the
+		// order given by |output_scheduling_|, until the agreed max_batch_size
+		// is ready to be written. Messages stay in their priority queue as
+		// long as possible, so that a later message of a higher priority can
+		// still pass them. Returns false if there is nothing to write.
+		bool ScheduleOutput();
+
+		// Releases all messages waiting to be written.
+		void ClearOutputQueues();
+		// Puts |message|, whose reference it takes, at the end of its
+		// priority queue, or at the front if |front|.
+		void QueueMessage(Message* message, bool front);
+
+		// Accounts for |message| entering the output, reports the output
+		// blocked if that took it to a high watermark.
+		void DidQueueMessage(Message* message);
+		// Accounts for |message| leaving the output, reports the output
+		// unblocked if that brought it down to the low watermarks.
+		void DidSendMessage(Message* message);
+
+		// Sends the peer a CREDIT_MESSAGE_TYPE message for the bytes
+		// dispatched since the last one. Returns false on a write error.
+		bool GrantCredit();
+		bool HandleCreditMessage(Message* msg);
+
+		// Puts the state of |session_| into the hello.
+		void WriteSessionState(Message* hello);
+		// Queues the messages the peer missed, as its hello told. Returns
+		// false if some of them were given up.
+		bool ResumeSession(uint64 peer_id, uint64 peer_received,
+			uint64 echoed_id);
+		// Queues again what the channel before could not write.
+		void QueueUnsentMessages();
+		// Queues an ACK_MESSAGE_TYPE message for what was received so far.
+		void QueueAck();
+		// Writes the acknowledgement nothing else took along, see kAckDelay.
+		void OnAckTimer();
+		bool HandleAckMessage(Message* msg);
+
+		// Puts |message| straight into |output_queue_|, so it never waits
+		// for credit of its own or behind messages that do, and writes it
+		// unless a write is going on. Returns false on a write error.
+		bool SendInternalMessage(Message* message);
+
 		// MessageLoop::IOHandler implementation.
 		virtual void OnIOCompleted(Thread::IOContext* context,
 			DWORD bytes_transfered,
 			DWORD error);
 
+#if defined(OS_POSIX)
+		ReadState ReadSharedMemory(char* buffer, int buffer_len, int* bytes_read);
+
+		// Gather-write |iov| to the socket, along with the descriptors of the
+		// output ring if the hello is being sent. Returns what send() does.
+		ssize_t WriteToSocket(const struct iovec* iov, size_t iov_count);
+
+		// Puts the descriptors of the output ring into |msg|, using |control|,
+		// which must have room for them.
+		void AttachHelloDescriptors(struct msghdr* msg, char* control);
+
+		// Hands the queued output to the thread for a background send, see
+		// Thread::SubmitSend(). Returns false on failure.
+		bool SubmitOutput();
+
+		// Points |iov| at the unsent part of the queued messages, up to the
+		// agreed max_batch_size. Returns the number of entries used.
+		size_t GatherOutput(struct iovec* iov, size_t max_iov);
+
+		// Copies as much of |iov| into the output ring as fits.
+		size_t WriteToSharedMemory(const struct iovec* iov, size_t iov_count);
+		void CloseSharedMemory();
+
+		// Forwards the eventfd doorbell of a shared ring to the channel as if the
+		// socket became readable or writable.
+		class Doorbell : public Thread::IOHandler {
+		public:
+			Doorbell(Channel* channel, Thread::IOContext* target)
+				: channel_(channel), target_(target), fd_(-1) {}
+			void Register(Thread* thread, int fd);
+			void Unregister(Thread* thread);
+			virtual void OnIOCompleted(Thread::IOContext* context,
+				DWORD bytes_transfered, DWORD error) override;
+		private:
+			Channel* channel_;
+			Thread::IOContext* target_;
+			int fd_;
+		};
+#endif
+
 	private:
 		struct State {
 			explicit State(Channel* channel);
@@ -88,12 +405,111 @@ namespace IPC
 		State input_state_;
 		State output_state_;
 
+#if defined(OS_WIN)
 		HANDLE pipe_;
 
+		// FILE_SKIP_COMPLETION_PORT_ON_SUCCESS is set on |pipe_|, reads and
+		// writes that finish right away are handled inline.
+		bool skip_completion_port_;
+
+		// Small messages copied together for a single write, see
+		// GatherSmallMessages(). Must not change while the write is pending.
+		std::vector<char> output_buffer_;
+#else
+		// The connected socket, or the listening socket while waiting_connect_.
+		int pipe_;
+#endif
+
+		// Number of bytes of the front message of output_queue_ that have
+		// already been written to the pipe.
+		size_t message_send_bytes_written_;
+
+#if defined(OS_POSIX)
+		// Descriptors received along with the data being dispatched. They are
+		// only collected until the hello arrives.
+		std::vector<int> input_fds_;
+		bool receive_fds_;
+
+		// The descriptors of output_ring_ still have to go out with the hello.
+		bool send_hello_fds_;
+
+		// Shared memory transport, see FEATURE_SHARED_MEMORY. Each side creates
+		// the ring it writes to and passes it to the peer with the hello. A ring
+		// is used once the SHARED_MEMORY_MESSAGE_TYPE message in front of it has
+		// gone through the pipe.
+		SharedRing output_ring_;
+		SharedRing input_ring_;
+		bool output_ring_active_;
+		bool input_ring_active_;
+		Doorbell input_doorbell_;
+		Doorbell output_doorbell_;
+
+		// Background send on threads that support it, see SubmitOutput().
+		// The message header and what it points to belong to the kernel
+		// while |send_in_flight_|.
+		Thread::IOContext send_context_;
+		struct msghdr send_msg_;
+		std::vector<struct iovec> send_iov_;
+		std::vector<char> send_control_;
+		bool send_in_flight_;
+#endif
+
 		DWORD peer_pid_;
+		// Set once the hello of the peer was handled.
+		bool hello_received_;
+
+		// Features offered to the peer, and those both sides agreed on.
+		uint32 features_;
+		uint32 active_features_;
+		Capabilities capabilities_;
+
+		// Messages being written, in the order they go out. Internal messages
+		// are put here directly, the others come from |priority_queues_|.
+		std::deque<Message*> output_queue_;
+
+		// Bytes of |output_queue_| not written yet.
+		size_t output_queue_bytes_;
+
+		struct QueuedMessage {
+			Message* message;
+			// MonotonicMicroseconds() when the message was sent.
+			uint64 queued_time;
+		};
+
+		// Messages sent but not scheduled for writing yet, by priority.
+		std::deque<QueuedMessage> priority_queues_[kPriorityCount];
+		size_t priority_queued_messages_;
+
+		OutputScheduling output_scheduling_;
+
+		// Round robin state of SCHEDULE_WEIGHTED, the priority whose turn it is
+		// and the bytes each priority may still write in its turn.
+		int scheduling_priority_;
+		size_t scheduling_deficit_[kPriorityCount];
+
+		OutputStats output_stats_;
+
+		// Messages sent and not written yet, and their size, see
+		// OutputLimits.
+		OutputLimits output_limits_;
+		size_t queued_bytes_;
+		size_t queued_messages_;
+		bool output_blocked_;
+		// Resumed through to report the output unblocked from the message
+		// loop rather than from within a write.
+		Thread::IOContext writable_context_;
+
+		// With FEATURE_FLOW_CONTROL, the bytes the peer still accepts and
+		// the bytes dispatched that were not granted back to the peer yet.
+		// The last message sent may take |send_credit_| below zero.
+		int64 send_credit_;
+		size_t consumed_bytes_;
 
-		// Messages to be sent are queued here.
-		std::queue<Message*> output_queue_;
+		// See FEATURE_RELIABLE, and the number of received messages the
+		// last acknowledgement covered.
+		Session* session_;
+		uint64 acked_received_;
+		Thread::Timer ack_timer_;
 
 		// In server-mode, we have to wait for the client to connect before we
 		// can begin reading.  We make use of the input_state_ when performing
@@ -6,7 +6,8 @@
 #define IPC_IPC_CHANNEL_HANDLE_H_
 
 #include <string>
-#include <windows.h>
+
+#include "ipc/ipc_common.h"
 
 // On Windows, any process can create an IPC channel and others can fetch
 // it by name.  We pass around the channel names over IPC.
@@ -34,9 +35,14 @@ struct ChannelHandle {
   // processes with different working directories.
   ChannelHandle(const std::string& n) : name(n) {}
   ChannelHandle(const char* n) : name(n) {}
+#if defined(OS_WIN)
   explicit ChannelHandle(HANDLE h) : pipe(h) {}
+#else
+  explicit ChannelHandle(int fd) : socket(fd) {}
+#endif
 
   std::string name;
+#if defined(OS_WIN)
   // A simple container to automatically initialize pipe handle
   struct PipeHandle {
     PipeHandle() : handle(NULL) {}
@@ -44,6 +50,15 @@ struct ChannelHandle {
     HANDLE handle;
   };
   PipeHandle pipe;
+#else
+  // A connected socket, initialized to -1 when the channel is named.
+  struct SocketHandle {
+    SocketHandle() : fd(-1) {}
+    SocketHandle(int f) : fd(f) {}
+    int fd;
+  };
+  SocketHandle socket;
+#endif
 };
 
 }  // namespace IPC
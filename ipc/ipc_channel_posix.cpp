@@ -0,0 +1,718 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "ipc/ipc_channel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ipc/ipc_listener.h"
+#include "ipc/ipc_utils.h"
+#include "ipc/ipc_message.h"
+#include <assert.h>
+
+#define HANDLE_EINTR(x) ({ \
+  __typeof__(x) eintr_wrapper_result; \
+  do { \
+    eintr_wrapper_result = (x); \
+  } while (eintr_wrapper_result == -1 && errno == EINTR); \
+  eintr_wrapper_result; \
+})
+
+namespace {
+
+// Fills |addr| with the abstract socket address for |name| and returns the
+// length to pass to bind() and connect().
+bool MakeSocketAddress(const std::string& name, sockaddr_un* addr,
+                       socklen_t* addr_len) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  // sun_path[0] stays NUL, which places the name in the abstract namespace.
+  // The name goes away with the last socket bound to it, so a crashed server
+  // never leaves a stale file behind.
+  if (name.size() + 1 > sizeof(addr->sun_path))
+    return false;
+  memcpy(addr->sun_path + 1, name.data(), name.size());
+  *addr_len = static_cast<socklen_t>(
+      offsetof(sockaddr_un, sun_path) + 1 + name.size());
+  return true;
+}
+
+// Features the POSIX channel knows how to use.
+const uint32 kSupportedFeatures = IPC::Channel::FEATURE_SHARED_MEMORY |
+                                  IPC::Channel::FEATURE_FLOW_CONTROL |
+                                  IPC::Channel::FEATURE_RELIABLE;
+
+// Memory, data doorbell and space doorbell of a SharedRing.
+const size_t kSharedRingDescriptors = 3;
+
+// Upper bound on the descriptors accepted with a single read.
+const size_t kMaxReceivedDescriptors = 8;
+
+// Upper bound on the segments handed to a single gather write.
+const size_t kMaxIovecs = 64;
+
+// Points |iov| at the segments of |m| past its first |offset| bytes. Returns
+// the number of entries used.
+size_t GetUnsentSegments(const IPC::Message* m, size_t offset,
+                         struct iovec* iov, size_t max_iov) {
+  size_t count = 0;
+  for (size_t i = 0; i < m->segment_count() && count < max_iov; ++i) {
+    const char* data;
+    size_t size;
+    m->GetSegment(i, &data, &size);
+    if (offset >= size) {
+      offset -= size;
+      continue;
+    }
+    iov[count].iov_base = const_cast<char*>(data + offset);
+    iov[count].iov_len = size - offset;
+    offset = 0;
+    ++count;
+  }
+  return count;
+}
+
+}  // namespace
+
+namespace IPC {
+
+void Channel::Doorbell::Register(Thread* thread, int fd) {
+  assert(fd_ == -1);
+  fd_ = fd;
+  thread->RegisterIOHandler(fd_, this);
+}
+
+void Channel::Doorbell::Unregister(Thread* thread) {
+  if (fd_ != -1) {
+    thread->UnregisterIOHandler(fd_);
+    fd_ = -1;
+  }
+}
+
+void Channel::Doorbell::OnIOCompleted(Thread::IOContext* context,
+                                      DWORD bytes_transfered,
+                                      DWORD error) {
+  // An eventfd is always writable, only the readable edge means a ring.
+  if (!(context->events & EPOLLIN))
+    return;
+  SharedRing::DrainDoorbell(fd_);
+  channel_->OnIOCompleted(target_, 0, 0);
+}
+
+Channel::State::State(Channel* channel) : is_pending(false) {
+  context.handler = channel;
+  context.events = 0;
+}
+
+Channel::State::~State() {
+}
+
+Channel::Channel(const IPC::ChannelHandle &channel_handle,
+                 Listener* listener, Thread* thread, uint32 features,
+                 Session* session)
+    : ChannelReader(listener),
+      input_state_(this),
+      output_state_(this),
+      pipe_(-1),
+      message_send_bytes_written_(0),
+      receive_fds_(false),
+      send_hello_fds_(false),
+      output_ring_active_(false),
+      input_ring_active_(false),
+      input_doorbell_(this, &input_state_.context),
+      output_doorbell_(this, &output_state_.context),
+      send_iov_(kMaxIovecs),
+      send_control_(CMSG_SPACE(sizeof(int) * kSharedRingDescriptors)),
+      send_in_flight_(false),
+      peer_pid_(0),
+      hello_received_(false),
+      features_(features & kSupportedFeatures),
+      active_features_(0),
+      output_queue_bytes_(0),
+      priority_queued_messages_(0),
+      output_scheduling_(SCHEDULE_STRICT),
+      scheduling_priority_(0),
+      queued_bytes_(0),
+      queued_messages_(0),
+      output_blocked_(false),
+      send_credit_(0),
+      consumed_bytes_(0),
+      session_(session),
+      acked_received_(0),
+      waiting_connect_(true),
+      processing_incoming_(false),
+      validate_client_(false),
+      client_secret_(0),
+      thread_(thread) {
+  input_state_.context.events = EPOLLIN;
+  output_state_.context.events = EPOLLOUT;
+  send_context_.handler = this;
+  send_context_.events = 0;
+  writable_context_.handler = this;
+  writable_context_.events = 0;
+  memset(&send_msg_, 0, sizeof(send_msg_));
+  memset(&output_stats_, 0, sizeof(output_stats_));
+  memset(scheduling_deficit_, 0, sizeof(scheduling_deficit_));
+  if (!session_)
+    features_ &= ~FEATURE_RELIABLE;
+  CreatePipe(channel_handle);
+}
+
+Channel::~Channel() {
+  Close();
+}
+
+void Channel::Close() {
+  // Unregistering the socket is enough to make sure readiness is not
+  // reported again. A background send still refers to the output queue and
+  // has to finish first.
+  if (pipe_ != -1) {
+    thread_->UnregisterIOHandler(pipe_);
+    close(pipe_);
+    pipe_ = -1;
+  }
+  if (send_in_flight_) {
+    thread_->CancelIO(&send_context_);
+    while (send_in_flight_)
+      thread_->WaitForIOCompletion(INFINITE, this);
+  }
+  thread_->CancelResumedIO(this);
+  ack_timer_.Stop();
+  CloseSharedMemory();
+  input_state_.is_pending = false;
+  output_state_.is_pending = false;
+  ClearOutputQueues();
+}
+
+void Channel::CloseSharedMemory() {
+  input_doorbell_.Unregister(thread_);
+  output_doorbell_.Unregister(thread_);
+  input_ring_.Close();
+  output_ring_.Close();
+  input_ring_active_ = false;
+  output_ring_active_ = false;
+  send_hello_fds_ = false;
+  receive_fds_ = false;
+  for (size_t i = 0; i < input_fds_.size(); ++i)
+    close(input_fds_[i]);
+  input_fds_.clear();
+}
+
+Channel::ReadState Channel::ReadData(
+    char* buffer,
+    int buffer_len,
+    int* bytes_read) {
+  if (pipe_ == -1)
+    return READ_FAILED;
+
+  if (input_ring_active_)
+    return ReadSharedMemory(buffer, buffer_len, bytes_read);
+
+  // The socket is registered edge-triggered, so ProcessIncomingMessages keeps
+  // calling us until the kernel buffer is drained and we report READ_PENDING.
+  ssize_t len;
+  if (!receive_fds_) {
+    len = HANDLE_EINTR(recv(pipe_, buffer, buffer_len, MSG_DONTWAIT));
+  } else {
+    // The peer's hello may come with the descriptors of its shared ring.
+    char control[CMSG_SPACE(sizeof(int) * kMaxReceivedDescriptors)];
+    struct iovec iov = { buffer, static_cast<size_t>(buffer_len) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    len = HANDLE_EINTR(recvmsg(pipe_, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC));
+    if (len > 0 && msg.msg_controllen > 0) {
+      for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+           cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+          continue;
+        const int* fds = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        input_fds_.insert(input_fds_.end(), fds, fds + count);
+      }
+      if (msg.msg_flags & MSG_CTRUNC)
+        return READ_FAILED;
+    }
+  }
+  if (len > 0) {
+    *bytes_read = static_cast<int>(len);
+    return READ_SUCCEEDED;
+  }
+  if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    input_state_.is_pending = true;
+    return READ_PENDING;
+  }
+  // Zero means the peer closed the connection.
+  return READ_FAILED;
+}
+
+Channel::ReadState Channel::ReadSharedMemory(
+    char* buffer,
+    int buffer_len,
+    int* bytes_read) {
+  for (;;) {
+    int len = input_ring_.Read(buffer, buffer_len);
+    if (len < 0)
+      return READ_FAILED;
+    if (len > 0) {
+      input_ring_.WakeWriter();
+      *bytes_read = len;
+      return READ_SUCCEEDED;
+    }
+    if (input_ring_.PrepareReaderSleep())
+      break;
+  }
+
+  // Nothing is sent over the pipe after the switch to shared memory, so the
+  // socket only becomes readable when the peer goes away.
+  char c;
+  ssize_t len = HANDLE_EINTR(recv(pipe_, &c, 1, MSG_PEEK | MSG_DONTWAIT));
+  if (len >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    return READ_FAILED;
+
+  input_state_.is_pending = true;
+  return READ_PENDING;
+}
+
+ssize_t Channel::WriteToSocket(const struct iovec* iov, size_t iov_count) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = const_cast<struct iovec*>(iov);
+  msg.msg_iovlen = iov_count;
+
+  char control[CMSG_SPACE(sizeof(int) * kSharedRingDescriptors)];
+  if (send_hello_fds_)
+    AttachHelloDescriptors(&msg, control);
+
+  ssize_t written = HANDLE_EINTR(sendmsg(pipe_, &msg,
+                                         MSG_DONTWAIT | MSG_NOSIGNAL));
+  // The descriptors travel with the first byte that makes it out.
+  if (written > 0)
+    send_hello_fds_ = false;
+  return written;
+}
+
+void Channel::AttachHelloDescriptors(struct msghdr* msg, char* control) {
+  int fds[kSharedRingDescriptors] = {
+    output_ring_.memory_fd(), output_ring_.data_fd(), output_ring_.space_fd()
+  };
+  memset(control, 0, CMSG_SPACE(sizeof(fds)));
+  msg->msg_control = control;
+  msg->msg_controllen = CMSG_SPACE(sizeof(fds));
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+}
+
+bool Channel::SubmitOutput() {
+  memset(&send_msg_, 0, sizeof(send_msg_));
+  send_msg_.msg_iov = &send_iov_[0];
+  send_msg_.msg_iovlen = GatherOutput(&send_iov_[0], send_iov_.size());
+  if (send_hello_fds_)
+    AttachHelloDescriptors(&send_msg_, &send_control_[0]);
+  if (!thread_->SubmitSend(pipe_, &send_msg_, &send_context_))
+    return false;
+  // Further output waits for the completion, which picks it up.
+  send_in_flight_ = true;
+  output_state_.is_pending = true;
+  return true;
+}
+
+size_t Channel::GatherOutput(struct iovec* iov, size_t max_iov) {
+  size_t count = 0;
+  size_t bytes = 0;
+  size_t offset = message_send_bytes_written_;
+  for (std::deque<Message*>::const_iterator it = output_queue_.begin();
+       it != output_queue_.end() && count < max_iov &&
+       bytes < capabilities_.max_batch_size; ++it) {
+    const Message* m = *it;
+    size_t added = GetUnsentSegments(m, offset, iov + count, max_iov - count);
+    size_t message_bytes = offset;
+    for (size_t i = count; i < count + added; ++i)
+      message_bytes += iov[i].iov_len;
+    count += added;
+    bytes += message_bytes - offset;
+    offset = 0;
+
+    // Ran out of entries in the middle of the message.
+    if (message_bytes < m->size())
+      break;
+
+    // Whatever follows goes through the ring, see DidWriteOutput().
+    if (m->routing_id() == MSG_ROUTING_NONE &&
+        m->type() == SHARED_MEMORY_MESSAGE_TYPE)
+      break;
+  }
+  return count;
+}
+
+size_t Channel::WriteToSharedMemory(const struct iovec* iov,
+                                    size_t iov_count) {
+  size_t total = 0;
+  for (size_t i = 0; i < iov_count; ++i) {
+    size_t written = output_ring_.Write(
+        static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+    total += written;
+    if (written < iov[i].iov_len)
+      break;
+  }
+  return total;
+}
+
+bool Channel::HandleInternalMessage(Message* msg) {
+  if (msg->type() == CREDIT_MESSAGE_TYPE)
+    return HandleCreditMessage(msg);
+  if (msg->type() == ACK_MESSAGE_TYPE)
+    return HandleAckMessage(msg);
+  if (msg->type() == SHARED_MEMORY_MESSAGE_TYPE) {
+    // The rest of the peer's output is in the ring.
+    if (!(active_features_ & FEATURE_SHARED_MEMORY) || input_ring_active_)
+      return false;
+    input_ring_active_ = true;
+    return true;
+  }
+  return false;
+}
+
+bool Channel::ActivateFeatures(uint32 peer_features) {
+  active_features_ = features_ & peer_features;
+  receive_fds_ = false;
+  std::vector<int> fds;
+  fds.swap(input_fds_);
+
+  bool ok = true;
+  if (active_features_ & FEATURE_SHARED_MEMORY) {
+    ok = fds.size() == kSharedRingDescriptors &&
+         input_ring_.Attach(fds[0], fds[1], fds[2]);
+    if (ok) {
+      fds.clear();
+      input_doorbell_.Register(thread_, input_ring_.data_fd());
+      output_doorbell_.Register(thread_, output_ring_.space_fd());
+
+      // Everything queued so far still goes through the pipe. This message
+      // tells the peer where that output ends. HandleHelloMessage() writes
+      // it, once the session queued what the peer missed ahead of the
+      // messages held back for the hello.
+      Message* m = new Message(MSG_ROUTING_NONE,
+                               SHARED_MEMORY_MESSAGE_TYPE,
+                               IPC::Message::PRIORITY_NORMAL);
+      m->AddRef();
+      output_queue_.push_back(m);
+      output_queue_bytes_ += m->size();
+    }
+  } else {
+    output_ring_.Close();
+  }
+
+  for (size_t i = 0; i < fds.size(); ++i)
+    close(fds[i]);
+  return ok;
+}
+
+// static
+const std::string Channel::PipeName(
+    const std::string& channel_id, int32* secret) {
+  std::string name("ipc.");
+
+  // Prevent the shared secret from ending up in the socket name.
+  size_t index = channel_id.find_first_of('\\');
+  if (index != std::string::npos) {
+    if (secret)  // Retrieve the secret if asked for.
+      *secret = atoi(channel_id.substr(index + 1).c_str());
+    return name.append(channel_id.substr(0, index));
+  }
+
+  if (secret)
+    *secret = 0;
+  return name.append(channel_id);
+}
+
+// static
+int Channel::CreateListeningSocket(const std::string& channel_id,
+                                   int backlog) {
+  sockaddr_un addr;
+  socklen_t addr_len;
+  if (!MakeSocketAddress(PipeName(channel_id, NULL), &addr, &addr_len))
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), addr_len) != 0 ||
+      listen(fd, backlog) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool Channel::CreatePipe(const IPC::ChannelHandle &channel_handle) {
+  assert(pipe_ == -1);
+  if (channel_handle.socket.fd != -1) {
+    // If we already have a connected socket for the channel just copy it.
+    assert(channel_handle.name.empty());
+    pipe_ = fcntl(channel_handle.socket.fd, F_DUPFD_CLOEXEC, 0);
+    if (pipe_ == -1)
+      return false;
+    if (fcntl(pipe_, F_SETFL, fcntl(pipe_, F_GETFL) | O_NONBLOCK) == -1) {
+      close(pipe_);
+      pipe_ = -1;
+      return false;
+    }
+    waiting_connect_ = false;
+  } else {
+    sockaddr_un addr;
+    socklen_t addr_len;
+    if (!MakeSocketAddress(PipeName(channel_handle.name, &client_secret_),
+                           &addr, &addr_len))
+      return false;
+
+    // Try to become the server first, the name can only be bound once.
+    pipe_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (pipe_ == -1)
+      return false;
+    if (bind(pipe_, reinterpret_cast<sockaddr*>(&addr), addr_len) == 0 &&
+        listen(pipe_, 1) == 0) {
+      validate_client_ = !!client_secret_;
+    } else if (errno == EADDRINUSE &&
+               HANDLE_EINTR(connect(pipe_, reinterpret_cast<sockaddr*>(&addr),
+                                    addr_len)) == 0) {
+      // The bind attempt failed without binding, so the same socket can
+      // connect to the existing server.
+      waiting_connect_ = false;
+    } else {
+      close(pipe_);
+      pipe_ = -1;
+    }
+  }
+
+  if (pipe_ == -1)
+    return false;
+
+  // Create the Hello message to be sent when Connect is called
+  Message* m = new Message(MSG_ROUTING_NONE,
+                           HELLO_MESSAGE_TYPE,
+                           IPC::Message::PRIORITY_NORMAL);
+  m->AddRef();
+  // Don't send the secret to the untrusted process, and don't send a secret
+  // if the value is zero (for IPC backwards compatability).
+  int32 secret = validate_client_ ? 0 : client_secret_;
+  if (!m->WriteInt(GetCurrentProcId()) ||
+      (secret && !m->WriteUInt32(secret))) {
+    close(pipe_);
+    pipe_ = -1;
+    m->Release();
+    return false;
+  }
+
+  // Offer the shared memory transport by sending the ring we are going to
+  // write to along with the hello.
+  if ((features_ & FEATURE_SHARED_MEMORY) &&
+      !output_ring_.Create(SharedRing::kDefaultCapacity))
+    features_ &= ~FEATURE_SHARED_MEMORY;
+  m->WriteUInt32(features_);
+  send_hello_fds_ = output_ring_.is_valid();
+  receive_fds_ = !!(features_ & FEATURE_SHARED_MEMORY);
+  if (features_ & FEATURE_RELIABLE)
+    WriteSessionState(m);
+  WriteCapabilities(m);
+
+  output_queue_.push_back(m);
+  output_queue_bytes_ += m->size();
+  return true;
+}
+
+bool Channel::Connect() {
+  if (pipe_ == -1)
+    return false;
+
+  thread_->RegisterIOHandler(pipe_, this);
+
+  // A listening socket reports the pending connection as readable, see
+  // ProcessConnection().
+  if (waiting_connect_)
+    return true;
+
+  // Complete setup asynchronously, some data may have arrived before the
+  // socket was registered.
+  thread_->PostTask(
+      std::bind(&Channel::OnIOCompleted,
+                this,
+                &input_state_.context,
+                0,
+                0));
+
+  ProcessOutgoingMessages(NULL, 0);
+  return true;
+}
+
+bool Channel::ProcessConnection() {
+  if (pipe_ == -1)
+    return false;
+
+  // The socket is edge-triggered, a connection still pending after this
+  // one is not reported again.
+  int fd;
+  for (;;) {
+    fd = HANDLE_EINTR(accept4(pipe_, NULL, NULL,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC));
+    if (fd != -1)
+      break;
+    // Somebody connected and gave up again, try the next one.
+    if (errno == ECONNABORTED)
+      continue;
+    // Nobody is left, keep listening. Anything else is fatal.
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+
+  // Only one client is served, dropping the listening socket releases the
+  // name.
+  thread_->UnregisterIOHandler(pipe_);
+  close(pipe_);
+  pipe_ = fd;
+  waiting_connect_ = false;
+  thread_->RegisterIOHandler(pipe_, this);
+  return true;
+}
+
+bool Channel::ProcessOutgoingMessages(
+    Thread::IOContext* context,
+    DWORD bytes_written) {
+  assert(!waiting_connect_);  // Why are we trying to send messages if there's
+                              // no connection?
+  if (send_in_flight_)
+    return true;
+  output_state_.is_pending = false;
+  if (pipe_ == -1)
+    return false;
+
+  // Write until the queue is empty or the socket buffer is full, in which
+  // case the thread tells us through EPOLLOUT when to continue.
+  while (ScheduleOutput()) {
+    // The kernel sends in the background and waits for room by itself.
+    if (!output_ring_active_ && thread_->SupportsAsyncSend())
+      return SubmitOutput();
+
+    struct iovec iov[kMaxIovecs];
+    size_t iov_count = GatherOutput(iov, kMaxIovecs);
+    ssize_t written;
+    if (output_ring_active_) {
+      written = WriteToSharedMemory(iov, iov_count);
+      if (!written) {
+        // The ring is full. Make sure the peer is draining it and wait for
+        // the space doorbell, unless space showed up in the meantime.
+        output_ring_.WakeReader();
+        if (output_ring_.PrepareWriterSleep()) {
+          output_state_.is_pending = true;
+          return true;
+        }
+        continue;
+      }
+    } else {
+      written = WriteToSocket(iov, iov_count);
+      if (written < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          output_state_.is_pending = true;
+          return true;
+        }
+        return false;
+      }
+    }
+
+    DidWriteOutput(written);
+  }
+
+  if (output_ring_active_)
+    output_ring_.WakeReader();
+  return true;
+}
+
+void Channel::OnIOCompleted(
+    Thread::IOContext* context,
+    DWORD bytes_transfered,
+    DWORD error) {
+  bool ok = true;
+  if (context == &writable_context_) {
+    if (!output_blocked_)
+      listener()->OnChannelOutputBlocked(false);
+    return;
+  }
+  if (context == &send_context_) {
+    send_in_flight_ = false;
+    if (error || !bytes_transfered) {
+      ok = false;
+    } else {
+      // The descriptors travel with the first byte that makes it out.
+      send_hello_fds_ = false;
+      DidWriteOutput(bytes_transfered);
+      ok = ProcessOutgoingMessages(context, bytes_transfered);
+    }
+  } else if (context->events & EPOLLIN) {
+    if (waiting_connect_) {
+      ok = ProcessConnection();
+      if (ok && waiting_connect_)
+        return;
+      // We may have some messages queued up to send...
+      if (ok && !output_state_.is_pending)
+        ok = ProcessOutgoingMessages(NULL, 0);
+    }
+
+    // We don't support recursion through OnMessageReceived yet!
+    assert(!processing_incoming_);
+    processing_incoming_ = true;
+
+    input_state_.is_pending = false;
+    if (ok)
+      ok = ProcessIncomingMessages();
+
+    processing_incoming_ = false;
+  } else {
+    assert(context->events & EPOLLOUT);
+    // The socket is writable again. Only interesting if a write stalled.
+    if (output_state_.is_pending && !waiting_connect_)
+      ok = ProcessOutgoingMessages(context, bytes_transfered);
+  }
+  if (!ok && pipe_ != -1) {
+    // We don't want to re-enter Close().
+    Close();
+    listener()->OnChannelError();
+  }
+}
+
+// static
+bool Channel::IsNamedServerInitialized(
+    const std::string& channel_id) {
+  // Abstract sockets have no file to look for, they are listed in
+  // /proc/net/unix with a leading '@' instead.
+  FILE* file = fopen("/proc/net/unix", "r");
+  if (!file)
+    return false;
+  std::string wanted = "@" + PipeName(channel_id, NULL);
+  bool found = false;
+  char line[512];
+  while (!found && fgets(line, sizeof(line), file)) {
+    const char* path = strrchr(line, ' ');
+    if (!path)
+      continue;
+    std::string name(path + 1);
+    while (!name.empty() && (name[name.size() - 1] == '\n'))
+      name.erase(name.size() - 1);
+    found = name == wanted;
+  }
+  fclose(file);
+  return found;
+}
+
+}  // namespace IPC
@@ -13,31 +13,65 @@
 namespace IPC {
 namespace internal {
 
-ChannelReader::ChannelReader(Listener* listener) : listener_(listener) {
-  memset(input_buf_, 0, sizeof(input_buf_));
+ChannelReader::ChannelReader(Listener* listener)
+    : listener_(listener),
+      read_buffer_(NULL),
+      read_start_(0),
+      read_end_(0),
+      read_buffer_size_(kReadBufferSize),
+      reads_since_resize_(0),
+      messages_dispatched_(0),
+      reading_paused_(false) {
 }
 
 ChannelReader::~ChannelReader() {
+  if (read_buffer_)
+    read_buffer_->Release();
 }
 
 bool ChannelReader::ProcessIncomingMessages() {
+  size_t bytes_dispatched = 0;
+  messages_dispatched_ = 0;
   while (true) {
+    // Checked first, so no ResumeReadingLater() is pending while paused.
+    if (reading_paused_)
+      return true;
+
+    if (bytes_dispatched >= kMaxReadBytesPerWakeup ||
+        messages_dispatched_ >= kMaxMessagesPerWakeup) {
+      ResumeReadingLater();
+      return true;
+    }
+
+    if (!PrepareReadBuffer())
+      return false;
+
     int bytes_read = 0;
-    ReadState read_state = ReadData(input_buf_, kReadBufferSize,
-                                    &bytes_read);
+    ReadState read_state = ReadData(
+        read_buffer_->data() + read_end_,
+        static_cast<int>(read_buffer_->capacity() - read_end_),
+        &bytes_read);
     if (read_state == READ_FAILED)
       return false;
     if (read_state == READ_PENDING)
       return true;
 
     assert(bytes_read > 0);
-    if (!DispatchInputData(input_buf_, bytes_read))
+    if (!DispatchInputData(bytes_read))
       return false;
+    bytes_dispatched += bytes_read;
   }
 }
 
+void ChannelReader::ResumeReading() {
+  if (!reading_paused_)
+    return;
+  reading_paused_ = false;
+  ResumeReadingLater();
+}
+
 bool ChannelReader::AsyncReadComplete(int bytes_read) {
-  return DispatchInputData(input_buf_, bytes_read);
+  return DispatchInputData(bytes_read);
 }
 
 bool ChannelReader::IsHelloMessage(Message* m) const {
@@ -45,67 +79,181 @@ bool ChannelReader::IsHelloMessage(Message* m) const {
          m->type() == Channel::HELLO_MESSAGE_TYPE;
 }
 
-bool ChannelReader::DispatchInputData(const char* input_data,
-                                      int input_data_len) {
-  const char* p;
-  const char* end;
+bool ChannelReader::IsInternalMessage(Message* m) const {
+  // Replies and logging messages use ids above HELLO_MESSAGE_TYPE, and
+  // keep the routing id of the request, which may be MSG_ROUTING_NONE.
+  return m->routing_id() == MSG_ROUTING_NONE &&
+         m->type() >= Channel::FIRST_INTERNAL_MESSAGE_TYPE &&
+         m->type() <= Channel::HELLO_MESSAGE_TYPE;
+}
 
-  // Possibly combine with the overflow buffer to make a larger buffer.
-  if (input_overflow_buf_.empty()) {
-    p = input_data;
-    end = input_data + input_data_len;
+bool ChannelReader::PrepareReadBuffer() {
+  size_t pending = read_end_ - read_start_;
+  if (read_buffer_ && !pending && read_buffer_->HasOneRef()) {
+    // Nobody looks at the data anymore, start over. A buffer that grew for
+    // a message bigger than usual is given back right away.
+    read_start_ = read_end_ = 0;
+    if (read_buffer_->capacity() >= read_buffer_size_ * 2) {
+      read_buffer_->Release();
+      read_buffer_ = NULL;
+    }
+  }
+
+  // Once the header of a partial message is in, all of the message is made
+  // to fit instead of growing the buffer step by step.
+  const char* start = read_buffer_ ? read_buffer_->data() + read_start_ : NULL;
+  size_t message_size = Message::PeekMessageSize(start, start + pending);
+  if (message_size > Channel::kMaximumMessageSize) {
+    //assert(ERROR) << "IPC message is too big";
+    return false;
+  }
+
+  if (read_buffer_) {
+    if (message_size ? read_start_ + message_size <= read_buffer_->capacity()
+                     : read_buffer_->capacity() - read_end_ >= kMinReadSize)
+      return true;
+  }
+
+  size_t wanted = message_size ? message_size : pending + kMinReadSize;
+  size_t capacity = wanted < read_buffer_size_ ? read_buffer_size_ : wanted;
+  if (read_buffer_ && read_buffer_->HasOneRef() &&
+      read_buffer_->capacity() >= wanted) {
+    memmove(read_buffer_->data(), read_buffer_->data() + read_start_, pending);
   } else {
-    if (input_overflow_buf_.size() + input_data_len >
-        Channel::kMaximumMessageSize) {
-      input_overflow_buf_.clear();
-      //assert(ERROR) << "IPC message is too big";
+    MessageBuffer* buffer = MessageBuffer::Create(capacity);
+    if (!buffer)
       return false;
+    if (read_buffer_) {
+      memcpy(buffer->data(), read_buffer_->data() + read_start_, pending);
+      read_buffer_->Release();
     }
-    input_overflow_buf_.append(input_data, input_data_len);
-    p = input_overflow_buf_.data();
-    end = p + input_overflow_buf_.size();
+    read_buffer_ = buffer;
   }
+  read_start_ = 0;
+  read_end_ = pending;
+  return true;
+}
 
-  // Dispatch all complete messages in the data buffer.
+bool ChannelReader::DispatchInputData(int bytes_read) {
+  read_end_ += bytes_read;
+  assert(read_end_ <= read_buffer_->capacity());
+
+  const char* p = read_buffer_->data() + read_start_;
+  const char* end = read_buffer_->data() + read_end_;
+
+  // Collect all complete messages in the data buffer.
+  size_t largest_message = 0;
   while (p < end) {
     const char* message_tail = Message::FindNext(p, end);
-    if (message_tail) {
-      int len = static_cast<int>(message_tail - p);
-      Message* m = new Message(p, len);
-	  m->AddRef();
-      if (!WillDispatchInputMessage(m))
-        return false;
-
-#ifdef IPC_MESSAGE_LOG_ENABLED
-      Logging* logger = Logging::GetInstance();
-      std::string name;
-      logger->GetMessageText(m.type(), &name, &m, NULL);
-      TRACE_EVENT1("ipc", "ChannelReader::DispatchInputData", "name", name);
-#else
-      //TRACE_EVENT2("ipc", "ChannelReader::DispatchInputData",
-      //             "class", IPC_MESSAGE_ID_CLASS(m.type()),
-      //             "line", IPC_MESSAGE_ID_LINE(m.type()));
-#endif
-      //m.TraceMessageEnd();
-      if (IsHelloMessage(m))
-        HandleHelloMessage(m);
-      else
-        listener_->OnMessageReceived(m);
-      p = message_tail;
-    } else {
+    if (!message_tail) {
       // Last message is partial.
       break;
     }
+    int len = static_cast<int>(message_tail - p);
+    if (static_cast<size_t>(len) > largest_message)
+      largest_message = len;
+    Message* m = new Message(p, len, read_buffer_);
+    m->AddRef();
+    batch_.push_back(m);
+    p = message_tail;
   }
 
-  // Save any partial data in the overflow buffer.
-  input_overflow_buf_.assign(p, end - p);
+  // Keep any partial data where it is, PrepareReadBuffer() makes room for
+  // the rest.
+  read_start_ = p - read_buffer_->data();
+  AdjustReadBufferSize(largest_message);
 
-  if (input_overflow_buf_.empty() && !DidEmptyInputBuffers())
+  bool ok = DispatchBatch();
+  for (size_t i = 0; i < batch_.size(); ++i)
+    batch_[i]->Release();
+  batch_.clear();
+  if (!ok)
+    return false;
+
+  if (read_start_ == read_end_ && !DidEmptyInputBuffers())
     return false;
   return true;
 }
 
+bool ChannelReader::DispatchBatch() {
+  // PRIORITY_HIGH messages go ahead of the rest of the batch, but never
+  // past an internal message, which may change how the messages after it
+  // have to be handled.
+  size_t reorder_end = 0;
+  bool has_high_priority = false;
+  bool reorder = !KeepsInputOrder();
+  for (; reorder && reorder_end < batch_.size(); ++reorder_end) {
+    Message* m = batch_[reorder_end];
+    if (IsInternalMessage(m))
+      break;
+    if (m->priority() == Message::PRIORITY_HIGH)
+      has_high_priority = true;
+  }
+
+  if (has_high_priority) {
+    for (size_t i = 0; i < reorder_end; ++i) {
+      if (batch_[i]->priority() == Message::PRIORITY_HIGH &&
+          !DispatchInputMessage(batch_[i]))
+        return false;
+    }
+  }
+  for (size_t i = 0; i < batch_.size(); ++i) {
+    if (has_high_priority && i < reorder_end &&
+        batch_[i]->priority() == Message::PRIORITY_HIGH)
+      continue;
+    if (!DispatchInputMessage(batch_[i]))
+      return false;
+  }
+  return true;
+}
+
+bool ChannelReader::DispatchInputMessage(Message* m) {
+  if (!WillDispatchInputMessage(m))
+    return false;
+
+#ifdef IPC_MESSAGE_LOG_ENABLED
+  Logging* logger = Logging::GetInstance();
+  std::string name;
+  logger->GetMessageText(m->type(), &name, m, NULL);
+  TRACE_EVENT1("ipc", "ChannelReader::DispatchInputData", "name", name);
+#else
+  //TRACE_EVENT2("ipc", "ChannelReader::DispatchInputData",
+  //             "class", IPC_MESSAGE_ID_CLASS(m->type()),
+  //             "line", IPC_MESSAGE_ID_LINE(m->type()));
+#endif
+  //m->TraceMessageEnd();
+  if (IsHelloMessage(m)) {
+    if (!HandleHelloMessage(m))
+      return false;
+  } else if (IsInternalMessage(m)) {
+    if (!HandleInternalMessage(m))
+      return false;
+  } else {
+    listener_->OnMessageReceived(m);
+  }
+  messages_dispatched_++;
+  return true;
+}
+
+void ChannelReader::AdjustReadBufferSize(size_t message_size) {
+  size_t wanted = kMaxReadBufferSize;
+  if (message_size < kMaxReadBufferSize / kMessagesPerReadBuffer)
+    wanted = message_size * kMessagesPerReadBuffer;
+
+  if (wanted > read_buffer_size_) {
+    // Grow right away, the next buffer takes a few of these at once.
+    read_buffer_size_ = wanted;
+    reads_since_resize_ = 0;
+  } else if (wanted * 2 > read_buffer_size_) {
+    // The current size is still needed.
+    reads_since_resize_ = 0;
+  } else if (++reads_since_resize_ >= kReadsBeforeShrink &&
+             read_buffer_size_ > kReadBufferSize) {
+    read_buffer_size_ /= 2;
+    reads_since_resize_ = 0;
+  }
+}
+
 
 }  // namespace internal
 }  // namespace IPC
@@ -5,10 +5,15 @@
 #ifndef IPC_IPC_CHANNEL_READER_H_
 #define IPC_IPC_CHANNEL_READER_H_
 
+#include <vector>
+
 #include "ipc/ipc_listener.h"
 #include "ipc/ipc_common.h"
 
 namespace IPC {
+
+class MessageBuffer;
+
 namespace internal {
 
 // This class provides common pipe reading functionality for the
@@ -25,8 +30,29 @@ namespace internal {
 // here (and rename appropriately) rather than writing a different class.
 class ChannelReader {
  public:
-	 // Amount of data to read at once from the pipe.
-	 static const size_t kReadBufferSize = 4 * 1024;
+  // Amount of data to read at once from the pipe. The read buffer grows up
+  // to kMaxReadBufferSize while large messages come in and shrinks back once
+  // they stop. A message bigger than that gets a buffer of its own size.
+  static const size_t kReadBufferSize = 4 * 1024;
+  static const size_t kMaxReadBufferSize = 64 * 1024;
+
+  // The read buffer is sized to hold this many messages of the largest size
+  // seen recently.
+  static const size_t kMessagesPerReadBuffer = 4;
+
+  // The read buffer shrinks by half after this many reads without a message
+  // that needed the larger size.
+  static const size_t kReadsBeforeShrink = 64;
+
+  // A read is never issued for less than this, the rest of the buffer is
+  // moved to a new one first.
+  static const size_t kMinReadSize = 1024;
+
+  // ProcessIncomingMessages() stops after reading this many bytes or
+  // dispatching this many messages, even if more data is ready, and lets the
+  // other work on the thread run first. See ResumeReadingLater().
+  static const size_t kMaxReadBytesPerWakeup = 256 * 1024;
+  static const size_t kMaxMessagesPerWakeup = 1024;
 
   explicit ChannelReader(Listener* listener);
   virtual ~ChannelReader();
@@ -38,6 +64,13 @@ class ChannelReader {
   // succeeded, although there may not have been any messages processed.
   bool ProcessIncomingMessages();
 
+  // Stops ProcessIncomingMessages() from reading more data, for a listener
+  // that cannot keep up. The messages of the data already read are still
+  // dispatched. ResumeReading() picks up through ResumeReadingLater().
+  void PauseReading() { reading_paused_ = true; }
+  void ResumeReading();
+  bool reading_paused() const { return reading_paused_; }
+
   // Handles asynchronously read data.
   //
   // Optionally call this after returning READ_PENDING from ReadData to
@@ -49,6 +82,10 @@ class ChannelReader {
   // set-up.
   bool IsHelloMessage(Message* m) const;
 
+  // Returns true if the given message is internal to the IPC implementation,
+  // like the "hello" message sent on channel set-up.
+  bool IsInternalMessage(Message* m) const;
+
  protected:
   enum ReadState { READ_SUCCEEDED, READ_FAILED, READ_PENDING };
 
@@ -80,24 +117,67 @@ class ChannelReader {
   virtual bool DidEmptyInputBuffers() = 0;
 
   // Handles the first message sent over the pipe which contains setup info.
-  virtual void HandleHelloMessage(Message* msg) = 0;
+  // Returns false on a fatal error, which closes the channel once the
+  // dispatch is over.
+  virtual bool HandleHelloMessage(Message* msg) = 0;
+
+  // Handles internal messages other than the hello. Returns false on a fatal
+  // channel error.
+  virtual bool HandleInternalMessage(Message* msg) = 0;
+
+  // Called when ProcessIncomingMessages() ran out of its budget while more
+  // data may be ready. The implementation must call ProcessIncomingMessages()
+  // again once other pending work had a chance to run.
+  virtual void ResumeReadingLater() = 0;
+
+  // Returns true if the messages have to be dispatched in the order they
+  // arrived, PRIORITY_HIGH ones included.
+  virtual bool KeepsInputOrder() const = 0;
 
  private:
-  // Takes the given data received from the IPC channel and dispatches any
+  // Makes sure there are at least kMinReadSize bytes free at the end of
+  // |read_buffer_|, or room for all of a partial message whose header has
+  // arrived, moving the partial message to a new buffer if needed. Returns
+  // false if the partial message is too big.
+  bool PrepareReadBuffer();
+
+  // Adapts |read_buffer_size_| to |message_size|, the largest message
+  // dispatched by the last read.
+  void AdjustReadBufferSize(size_t message_size);
+
+  // Takes |bytes_read| bytes just read into |read_buffer_| and dispatches any
   // fully completed messages.
   //
   // Returns true on success. False means channel error.
-  bool DispatchInputData(const char* input_data, int input_data_len);
+  bool DispatchInputData(int bytes_read);
+
+  // Dispatches the messages in |batch_|, PRIORITY_HIGH ones first where
+  // that is safe. Returns false on channel error.
+  bool DispatchBatch();
+  bool DispatchInputMessage(Message* m);
 
   Listener* listener_;
 
-  // We read from the pipe into this buffer. Managed by DispatchInputData, do
-  // not access directly outside that function.
-  char input_buf_[kReadBufferSize];
+  // We read from the pipe into this buffer, complete messages are dispatched
+  // straight out of it. [read_start_, read_end_) holds a partial message
+  // waiting for more data. Messages still alive keep the buffer from being
+  // reused.
+  MessageBuffer* read_buffer_;
+  size_t read_start_;
+  size_t read_end_;
+
+  // Capacity asked for when a new read buffer is needed, see
+  // AdjustReadBufferSize().
+  size_t read_buffer_size_;
+  size_t reads_since_resize_;
+
+  // Complete messages found by the last read, reused to avoid allocations.
+  std::vector<Message*> batch_;
+
+  // Messages dispatched since ProcessIncomingMessages() was entered.
+  size_t messages_dispatched_;
 
-  // Large messages that span multiple pipe buffers, get built-up using
-  // this buffer.
-  std::string input_overflow_buf_;
+  bool reading_paused_;
 
   DISALLOW_COPY_AND_ASSIGN(ChannelReader);
 };
@@ -0,0 +1,529 @@
+// Copyright (c) 2012 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "ipc/ipc_channel.h"
+
+#include <windows.h>
+
+#include "ipc/ipc_listener.h"
+#include "ipc/ipc_utils.h"
+#include "ipc/ipc_message.h"
+#include <assert.h>
+//#include "ipc/ipc_logging.h"
+//#include "ipc/ipc_message_utils.h"
+
+
+namespace IPC {
+
+namespace {
+
+#ifndef FILE_SKIP_COMPLETION_PORT_ON_SUCCESS
+#define FILE_SKIP_COMPLETION_PORT_ON_SUCCESS 0x1
+#endif
+
+typedef BOOL (WINAPI *SetFileCompletionNotificationModesFunction)(HANDLE,
+                                                                  UCHAR);
+
+// Stops the completion port from being signalled for IO on |file| that
+// completes synchronously. The call only exists since Vista, so it is looked
+// up at runtime to keep running on XP, where every completion still goes
+// through the port.
+// Features the Windows channel knows how to use.
+const uint32 kSupportedFeatures = Channel::FEATURE_FLOW_CONTROL |
+                                  Channel::FEATURE_RELIABLE;
+
+bool SkipCompletionPortOnSuccess(HANDLE file) {
+  static SetFileCompletionNotificationModesFunction set_modes =
+      reinterpret_cast<SetFileCompletionNotificationModesFunction>(
+          GetProcAddress(GetModuleHandleW(L"kernel32.dll"),
+                         "SetFileCompletionNotificationModes"));
+  return set_modes &&
+         set_modes(file, FILE_SKIP_COMPLETION_PORT_ON_SUCCESS) != FALSE;
+}
+
+}  // namespace
+
+	Channel::State::State(Channel* channel) : is_pending(false) {
+  memset(&context.overlapped, 0, sizeof(context.overlapped));
+  context.handler = channel;
+}
+
+Channel::State::~State() {
+  //COMPILE_ASSERT(!offsetof(Channel::State, context),
+  //               starts_with_io_context);
+}
+
+Channel::Channel(const IPC::ChannelHandle &channel_handle,
+	Listener* listener, Thread* thread, uint32 features, Session* session)
+    : ChannelReader(listener),
+      input_state_(this),
+      output_state_(this),
+      pipe_(INVALID_HANDLE_VALUE),
+      skip_completion_port_(false),
+      message_send_bytes_written_(0),
+      peer_pid_(0),
+      hello_received_(false),
+      features_(features & kSupportedFeatures),
+      active_features_(0),
+      output_queue_bytes_(0),
+      priority_queued_messages_(0),
+      output_scheduling_(SCHEDULE_STRICT),
+      scheduling_priority_(0),
+      queued_bytes_(0),
+      queued_messages_(0),
+      output_blocked_(false),
+      send_credit_(0),
+      consumed_bytes_(0),
+      session_(session),
+      acked_received_(0),
+      waiting_connect_(true),
+      processing_incoming_(false),
+      client_secret_(0),
+	  thread_(thread),
+      validate_client_(false) {
+  memset(&output_stats_, 0, sizeof(output_stats_));
+  memset(scheduling_deficit_, 0, sizeof(scheduling_deficit_));
+  memset(&writable_context_.overlapped, 0, sizeof(writable_context_.overlapped));
+  writable_context_.handler = this;
+  if (!session_)
+    features_ &= ~FEATURE_RELIABLE;
+  CreatePipe(channel_handle);
+}
+
+Channel::~Channel() {
+  Close();
+}
+
+void Channel::Close() {
+//   if (thread_check_.get()) {
+//     assert(thread_check_->CalledOnValidThread());
+//   }
+
+  if (input_state_.is_pending || output_state_.is_pending)
+    CancelIo(pipe_);
+
+  // Closing the handle at this point prevents us from issuing more requests
+  // form OnIOCompleted().
+  if (pipe_ != INVALID_HANDLE_VALUE) {
+    CloseHandle(pipe_);
+    pipe_ = INVALID_HANDLE_VALUE;
+  }
+  skip_completion_port_ = false;
+  thread_->CancelResumedIO(this);
+  ack_timer_.Stop();
+
+  // Make sure all IO has completed.
+  //base::Time start = base::Time::Now();
+  while (input_state_.is_pending || output_state_.is_pending) {
+    thread_->WaitForIOCompletion(INFINITE, this);
+  }
+
+  ClearOutputQueues();
+}
+
+Channel::ReadState Channel::ReadData(
+    char* buffer,
+    int buffer_len,
+    int* bytes_read) {
+  if (INVALID_HANDLE_VALUE == pipe_)
+    return READ_FAILED;
+
+  DWORD bytes_read_now = 0;
+  BOOL ok = ReadFile(pipe_, buffer, buffer_len,
+                     &bytes_read_now, &input_state_.context.overlapped);
+  if (!ok) {
+    DWORD err = GetLastError();
+    if (err == ERROR_IO_PENDING) {
+      input_state_.is_pending = true;
+      return READ_PENDING;
+    }
+    //LOG(ERROR) << "pipe error: " << err;
+    return READ_FAILED;
+  }
+
+  // Unless the completion port is skipped, it will be signalled even in the
+  // "synchronously completed" state, so we go back to the message loop to
+  // pick up the data. Otherwise the data is consumed right here and
+  // ProcessIncomingMessages() keeps reading until its budget runs out, which
+  // still leaves room for the other work on this thread.
+  if (!skip_completion_port_) {
+    input_state_.is_pending = true;
+    return READ_PENDING;
+  }
+  if (!bytes_read_now)
+    return READ_FAILED;
+  *bytes_read = static_cast<int>(bytes_read_now);
+  return READ_SUCCEEDED;
+}
+
+// static
+const std::wstring Channel::PipeName(
+    const std::string& channel_id, int32* secret) {
+  std::string name("\\\\.\\pipe\\ipc.");
+
+  // Prevent the shared secret from ending up in the pipe name.
+  size_t index = channel_id.find_first_of('\\');
+  if (index != std::string::npos) {
+	  if (secret) {  // Retrieve the secret if asked for.
+		  *secret = atoi(channel_id.substr(index + 1).c_str());
+	  }
+    return ASCIIToWide(name.append(channel_id.substr(0, index - 1)));
+  }
+
+  // This case is here to support predictable named pipes in tests.
+  if (secret)
+    *secret = 0;
+  return ASCIIToWide(name.append(channel_id));
+}
+
+// static
+HANDLE Channel::CreateServerInstance(const std::string& channel_id,
+                                     bool first) {
+  DWORD open_mode = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED;
+  if (first)
+    open_mode |= FILE_FLAG_FIRST_PIPE_INSTANCE;
+  return CreateNamedPipeW(PipeName(channel_id, NULL).c_str(),
+                          open_mode,
+                          PIPE_TYPE_BYTE | PIPE_READMODE_BYTE,
+                          PIPE_UNLIMITED_INSTANCES,
+                          kReadBufferSize,
+                          kReadBufferSize,
+                          5000,
+                          NULL);
+}
+
+bool Channel::CreatePipe(const IPC::ChannelHandle &channel_handle) {
+  assert(INVALID_HANDLE_VALUE == pipe_);
+  std::wstring pipe_name;
+  // If we already have a valid pipe for channel just copy it.
+  if (channel_handle.pipe.handle) {
+    assert(channel_handle.name.empty());
+    pipe_name = L"Not Available";  // Just used for LOG
+    // Check that the given pipe confirms to the specified mode.  We can
+    // only check for PIPE_TYPE_MESSAGE & PIPE_SERVER_END flags since the
+    // other flags (PIPE_TYPE_BYTE, and PIPE_CLIENT_END) are defined as 0.
+    DWORD flags = 0;
+    GetNamedPipeInfo(channel_handle.pipe.handle, &flags, NULL, NULL, NULL);
+    assert(!(flags & PIPE_TYPE_MESSAGE));
+    if (!DuplicateHandle(GetCurrentProcess(),
+                         channel_handle.pipe.handle,
+                         GetCurrentProcess(),
+                         &pipe_,
+                         0,
+                         FALSE,
+                         DUPLICATE_SAME_ACCESS)) {
+      //LOG(WARNING) << "DuplicateHandle failed. Error :" << GetLastError();
+      return false;
+    }
+  } else {
+	assert(!channel_handle.pipe.handle);
+	pipe_name = PipeName(channel_handle.name, &client_secret_);
+
+	//ȳԴ
+    const DWORD open_mode = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED |
+                            FILE_FLAG_FIRST_PIPE_INSTANCE;
+    validate_client_ = !!client_secret_;
+    pipe_ = CreateNamedPipeW(pipe_name.c_str(),
+                             open_mode,
+                             PIPE_TYPE_BYTE | PIPE_READMODE_BYTE,
+                             1,
+                             kReadBufferSize,
+                             kReadBufferSize,
+                             5000,
+                             NULL);
+	if (pipe_ == INVALID_HANDLE_VALUE)
+	{
+		pipe_ = CreateFileW(pipe_name.c_str(),
+			GENERIC_READ | GENERIC_WRITE,
+			0,
+			NULL,
+			OPEN_EXISTING,
+			SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION |
+			FILE_FLAG_OVERLAPPED,
+			NULL);
+
+		waiting_connect_ = false;
+	}
+  } 
+
+  if (pipe_ == INVALID_HANDLE_VALUE) {
+    // If this process is being closed, the pipe may be gone already.
+    //LOG(WARNING) << "Unable to create pipe \"" << pipe_name <<
+    //                "\" in " << (mode & MODE_SERVER_FLAG ? "server" : "client")
+    //                << " mode. Error :" << GetLastError();
+    return false;
+  }
+
+  // Create the Hello message to be sent when Connect is called
+  Message* m = new Message(MSG_ROUTING_NONE,
+                                    HELLO_MESSAGE_TYPE,
+                                    IPC::Message::PRIORITY_NORMAL);
+  m->AddRef();
+  // Don't send the secret to the untrusted process, and don't send a secret
+  // if the value is zero (for IPC backwards compatability).
+  int32 secret = validate_client_ ? 0 : client_secret_;
+  if (!m->WriteInt(GetCurrentProcessId()) ||
+      (secret && !m->WriteUInt32(secret))) {
+    CloseHandle(pipe_);
+    pipe_ = INVALID_HANDLE_VALUE;
+	m->Release();
+    return false;
+  }
+  m->WriteUInt32(features_);
+  if (features_ & FEATURE_RELIABLE)
+    WriteSessionState(m);
+  WriteCapabilities(m);
+
+  output_queue_.push_back(m);
+  output_queue_bytes_ += m->size();
+  return true;
+}
+
+bool Channel::Connect() {
+  //DLOG_IF(WARNING, thread_check_.get()) << "Connect called more than once";
+
+  //if (!thread_check_.get())
+  //  thread_check_.reset(new base::ThreadChecker());
+
+  if (pipe_ == INVALID_HANDLE_VALUE)
+    return false;
+
+  thread_->RegisterIOHandler(pipe_, this);
+  skip_completion_port_ = SkipCompletionPortOnSuccess(pipe_);
+
+  // Check to see if there is a client connected to our pipe...
+  if (waiting_connect_)
+    ProcessConnection();
+
+  if (!input_state_.is_pending) {
+    // Complete setup asynchronously. By not setting input_state_.is_pending
+    // to true, we indicate to OnIOCompleted that this is the special
+    // initialization signal.
+	  thread_->PostTask(
+        std::bind(&Channel::OnIOCompleted,
+                   this,
+                   &input_state_.context,
+                   0,
+                   0));
+  }
+
+  if (!waiting_connect_)
+    ProcessOutgoingMessages(NULL, 0);
+  return true;
+}
+
+bool Channel::HandleInternalMessage(Message* msg) {
+  if (msg->type() == CREDIT_MESSAGE_TYPE)
+    return HandleCreditMessage(msg);
+  if (msg->type() == ACK_MESSAGE_TYPE)
+    return HandleAckMessage(msg);
+  return false;
+}
+
+bool Channel::ActivateFeatures(uint32 peer_features) {
+  active_features_ = features_ & peer_features;
+  return true;
+}
+
+bool Channel::ProcessConnection() {
+  //DCHECK(thread_check_->CalledOnValidThread());
+  if (input_state_.is_pending)
+    input_state_.is_pending = false;
+
+  // Do we have a client connected to our pipe?
+  if (INVALID_HANDLE_VALUE == pipe_)
+    return false;
+
+  BOOL ok = ConnectNamedPipe(pipe_, &input_state_.context.overlapped);
+
+  DWORD err = GetLastError();
+  if (ok) {
+    // Uhm, the API documentation says that this function should never
+    // return success when used in overlapped mode.
+    assert(0);
+    return false;
+  }
+
+  switch (err) {
+  case ERROR_IO_PENDING:
+    input_state_.is_pending = true;
+    break;
+  case ERROR_PIPE_CONNECTED:
+    waiting_connect_ = false;
+    break;
+  case ERROR_NO_DATA:
+    // The pipe is being closed.
+    return false;
+  default:
+    assert(0);
+    return false;
+  }
+
+  return true;
+}
+
+bool Channel::ProcessOutgoingMessages(
+    Thread::IOContext* context,
+    DWORD bytes_written) {
+  assert(!waiting_connect_);  // Why are we trying to send messages if there's
+                              // no connection?
+  //DCHECK(thread_check_->CalledOnValidThread());
+
+  if (output_state_.is_pending) {
+    assert(context);
+    output_state_.is_pending = false;
+    if (!context || bytes_written == 0) {
+      DWORD err = GetLastError();
+      //LOG(ERROR) << "pipe error: " << err;
+      return false;
+    }
+    DidWriteOutput(bytes_written);
+  }
+
+  while (ScheduleOutput()) {
+    if (INVALID_HANDLE_VALUE == pipe_)
+      return false;
+
+    // Write to pipe... Named pipes do not support gather writes. Runs of
+    // small messages are copied together into one write, while a message
+    // with external segments goes out with one write per segment instead of
+    // being copied together first.
+    const char* out_bytes = NULL;
+    size_t amt_to_write = 0;
+    if (!GatherSmallMessages(&out_bytes, &amt_to_write)) {
+      Message* m = output_queue_.front();
+      size_t offset = message_send_bytes_written_;
+      for (size_t i = 0; i < m->segment_count(); ++i) {
+        m->GetSegment(i, &out_bytes, &amt_to_write);
+        if (offset < amt_to_write)
+          break;
+        offset -= amt_to_write;
+      }
+      out_bytes += offset;
+      amt_to_write -= offset;
+    }
+    assert(amt_to_write <= INT_MAX);
+    BOOL ok = WriteFile(pipe_,
+                        out_bytes,
+                        static_cast<int>(amt_to_write),
+                        &bytes_written,
+                        &output_state_.context.overlapped);
+    if (!ok) {
+      DWORD err = GetLastError();
+      if (err == ERROR_IO_PENDING) {
+        output_state_.is_pending = true;
+
+        //DVLOG(2) << "sent pending message @" << m << " on channel @" << this
+        //         << " with type " << m->type();
+
+        return true;
+      }
+      //LOG(ERROR) << "pipe error: " << err;
+      return false;
+    }
+
+    //DVLOG(2) << "sent message @" << m << " on channel @" << this
+    //         << " with type " << m->type();
+
+    if (!skip_completion_port_) {
+      // The completion port will be signalled anyway.
+      output_state_.is_pending = true;
+      return true;
+    }
+
+    // No completion is coming for a write that finished right away, go on
+    // with the next one.
+    DidWriteOutput(bytes_written);
+  }
+  return true;
+}
+
+bool Channel::GatherSmallMessages(const char** data, size_t* size) {
+  if (message_send_bytes_written_ || output_queue_.size() < 2)
+    return false;
+
+  output_buffer_.clear();
+  for (std::deque<Message*>::const_iterator it = output_queue_.begin();
+       it != output_queue_.end(); ++it) {
+    const Message* m = *it;
+    if (m->has_external_segments() ||
+        output_buffer_.size() + m->size() > capabilities_.max_batch_size)
+      break;
+    const char* bytes = static_cast<const char*>(m->data());
+    output_buffer_.insert(output_buffer_.end(), bytes, bytes + m->size());
+  }
+  if (output_buffer_.size() <= output_queue_.front()->size())
+    return false;  // Nothing to gain over writing the first message alone.
+
+  *data = &output_buffer_[0];
+  *size = output_buffer_.size();
+  return true;
+}
+
+void Channel::OnIOCompleted(
+    Thread::IOContext* context,
+    DWORD bytes_transfered,
+    DWORD error) {
+  bool ok = true;
+  //assert(thread_check_->CalledOnValidThread());
+  if (context == &writable_context_) {
+    if (!output_blocked_)
+      listener()->OnChannelOutputBlocked(false);
+    return;
+  }
+  if (context == &input_state_.context) {
+    if (waiting_connect_) {
+      if (!ProcessConnection())
+        return;
+      // We may have some messages queued up to send...
+      if (!output_state_.is_pending)
+        ProcessOutgoingMessages(NULL, 0);
+      if (input_state_.is_pending)
+        return;
+      // else, fall-through and look for incoming messages...
+    }
+
+    // We don't support recursion through OnMessageReceived yet!
+	assert(!processing_incoming_);
+	processing_incoming_ = true;
+
+    // Process the new data.
+    if (input_state_.is_pending) {
+      // This is the normal case for everything except the initialization step.
+      input_state_.is_pending = false;
+      if (!bytes_transfered)
+        ok = false;
+      else if (pipe_ != INVALID_HANDLE_VALUE)
+        ok = AsyncReadComplete(bytes_transfered);
+    } else {
+      assert(!bytes_transfered);
+    }
+
+    // Request more data.
+    if (ok)
+      ok = ProcessIncomingMessages();
+
+	processing_incoming_ = false;
+  } else {
+	  assert(context == &output_state_.context);
+    ok = ProcessOutgoingMessages(context, bytes_transfered);
+  }
+  if (!ok && INVALID_HANDLE_VALUE != pipe_) {
+    // We don't want to re-enter Close().
+    Close();
+    listener()->OnChannelError();
+  }
+}
+
+// static
+bool Channel::IsNamedServerInitialized(
+	const std::string& channel_id) {
+	if (WaitNamedPipe(PipeName(channel_id, NULL).c_str(), 1))
+		return true;
+	// If ERROR_SEM_TIMEOUT occurred, the pipe exists but is handling another
+	// connection.
+	return GetLastError() == ERROR_SEM_TIMEOUT;
+}
+
+}  // namespace IPC
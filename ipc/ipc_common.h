@@ -1,25 +1,78 @@
-#pragma once
-#include <windows.h>
-#include <string>
-
-typedef signed char         schar;
-typedef signed char         int8;
-typedef short               int16;
-typedef int                 int32;
-
-typedef long long           int64;
-
-typedef unsigned char      uint8;
-typedef unsigned short     uint16;
-typedef unsigned int       uint32;
-
-typedef unsigned long long uint64;
-
-const uint16 kuint16max = ((uint16)0xFFFF);
-const int32 kint32max = ((int32)0x7FFFFFFF);
-
-// A macro to disallow the copy constructor and operator= functions
-// This should be used in the private: declarations for a class
-#define DISALLOW_COPY_AND_ASSIGN(TypeName) \
-  TypeName(const TypeName&);               \
-  void operator=(const TypeName&)
+#pragma once
+
+#if defined(_WIN32)
+#define OS_WIN 1
+#else
+#define OS_POSIX 1
+#endif
+
+#if defined(OS_WIN)
+#include <windows.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#endif
+#include <string>
+
+typedef signed char         schar;
+typedef signed char         int8;
+typedef short               int16;
+typedef int                 int32;
+
+typedef long long           int64;
+
+typedef unsigned char      uint8;
+typedef unsigned short     uint16;
+typedef unsigned int       uint32;
+
+typedef unsigned long long uint64;
+
+const uint16 kuint16max = ((uint16)0xFFFF);
+const int32 kint32max = ((int32)0x7FFFFFFF);
+
+#if defined(OS_POSIX)
+// The Win32 names the shared code is written against. They keep their Win32
+// widths so structures and atomics behave the same on both platforms.
+typedef uint32 DWORD;
+typedef int32 LONG;
+
+#define INFINITE 0xFFFFFFFF
+
+inline LONG InterlockedIncrement(volatile LONG* addend) {
+	return __sync_add_and_fetch(addend, 1);
+}
+
+inline LONG InterlockedDecrement(volatile LONG* addend) {
+	return __sync_sub_and_fetch(addend, 1);
+}
+
+inline LONG InterlockedExchangeAdd(volatile LONG* addend, LONG value) {
+	return __sync_fetch_and_add(addend, value);
+}
+
+inline LONG InterlockedExchange(volatile LONG* target, LONG value) {
+	return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedCompareExchange(volatile LONG* destination,
+	LONG exchange, LONG comparand) {
+	return __sync_val_compare_and_swap(destination, comparand, exchange);
+}
+
+inline void* InterlockedExchangePointer(void* volatile* target, void* value) {
+	return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+inline void* InterlockedCompareExchangePointer(void* volatile* destination,
+	void* exchange, void* comparand) {
+	return __sync_val_compare_and_swap(destination, comparand, exchange);
+}
+#endif
+
+// A macro to disallow the copy constructor and operator= functions
+// This should be used in the private: declarations for a class
+#define DISALLOW_COPY_AND_ASSIGN(TypeName) \
+  TypeName(const TypeName&);               \
+  void operator=(const TypeName&)
@@ -0,0 +1,197 @@
+#include "ipc_dispatcher.h"
+
+namespace IPC
+{
+	Dispatcher::Queue::Queue(Dispatcher* dispatcher, size_t strand_count,
+		size_t low_watermark, const Task& on_low)
+		: dispatcher_(dispatcher)
+		, strands_(strand_count ? strand_count : 1)
+		, low_watermark_(low_watermark)
+		, on_low_(on_low)
+		, pending_(0)
+		, scheduled_count_(0)
+		, waiting_(false)
+		, idle_event_(false, false)
+	{
+		for (size_t i = 0; i < strands_.size(); ++i) {
+			strands_[i].queue = this;
+			strands_[i].head = NULL;
+			strands_[i].tail = NULL;
+			strands_[i].scheduled = false;
+		}
+	}
+
+	Dispatcher::Queue::~Queue()
+	{
+		{
+			AutoLock lock(lock_);
+			if (!scheduled_count_)
+				return;
+			waiting_ = true;
+		}
+		idle_event_.Wait(INFINITE);
+		// The last worker signals under the lock, let it leave first.
+		AutoLock lock(lock_);
+	}
+
+	size_t Dispatcher::Queue::PushTask(uint32 key, TaskNode* node)
+	{
+		size_t pending = static_cast<size_t>(InterlockedIncrement(&pending_));
+		Strand* strand = &strands_[key % strands_.size()];
+		node->next = NULL;
+		bool schedule = false;
+		{
+			AutoLock lock(lock_);
+			if (strand->tail)
+				strand->tail->next = node;
+			else
+				strand->head = node;
+			strand->tail = node;
+			if (!strand->scheduled) {
+				strand->scheduled = true;
+				++scheduled_count_;
+				schedule = true;
+			}
+		}
+		if (schedule)
+			dispatcher_->Schedule(strand);
+		return pending;
+	}
+
+	void Dispatcher::Queue::TaskDone()
+	{
+		LONG left = InterlockedDecrement(&pending_);
+		if (static_cast<size_t>(left) == low_watermark_ && on_low_)
+			on_low_();
+	}
+
+	Dispatcher::Dispatcher(size_t worker_count)
+		: next_worker_(0)
+		, quit_(false)
+	{
+		if (!worker_count)
+			worker_count = NumberOfProcessors();
+		workers_.resize(worker_count);
+		for (size_t i = 0; i < worker_count; ++i)
+			workers_[i] = new Worker;
+		// All workers exist before any of them looks for a strand to steal.
+		for (size_t i = 0; i < worker_count; ++i)
+			workers_[i]->thread = std::thread(&Dispatcher::WorkerMain, this, i);
+	}
+
+	Dispatcher::~Dispatcher()
+	{
+		quit_ = true;
+		for (size_t i = 0; i < workers_.size(); ++i)
+			workers_[i]->wake_event.Signal();
+		// A worker still running may look into the strands of any other.
+		for (size_t i = 0; i < workers_.size(); ++i)
+			workers_[i]->thread.join();
+		for (size_t i = 0; i < workers_.size(); ++i) {
+			assert(workers_[i]->strands.empty());
+			delete workers_[i];
+		}
+	}
+
+	void Dispatcher::WorkerMain(size_t index)
+	{
+		Worker* self = workers_[index];
+		for (;;) {
+			Strand* strand = TakeStrand(index);
+			if (!strand) {
+				// Announce the sleep before looking one last time, Schedule()
+				// pushes before it checks |sleeping|.
+				InterlockedExchange(&self->sleeping, 1);
+				strand = TakeStrand(index);
+				if (!strand) {
+					if (quit_)
+						break;
+					self->wake_event.Wait(INFINITE);
+					InterlockedExchange(&self->sleeping, 0);
+					continue;
+				}
+				InterlockedExchange(&self->sleeping, 0);
+			}
+			RunStrand(strand, index);
+		}
+		MessagePool::ReleaseThreadCache();
+	}
+
+	void Dispatcher::Schedule(Strand* strand)
+	{
+		size_t index = static_cast<size_t>(InterlockedIncrement(&next_worker_)) %
+			workers_.size();
+		Worker* target = workers_[index];
+		{
+			AutoLock lock(target->lock);
+			target->strands.push_back(strand);
+		}
+		if (InterlockedCompareExchange(&target->sleeping, 0, 0)) {
+			target->wake_event.Signal();
+			return;
+		}
+		// The worker is busy, maybe with a slow task. Wake another one to
+		// steal the strand.
+		for (size_t i = 1; i < workers_.size(); ++i) {
+			Worker* worker = workers_[(index + i) % workers_.size()];
+			if (InterlockedCompareExchange(&worker->sleeping, 0, 0)) {
+				worker->wake_event.Signal();
+				return;
+			}
+		}
+	}
+
+	Dispatcher::Strand* Dispatcher::TakeStrand(size_t index)
+	{
+		Worker* self = workers_[index];
+		{
+			AutoLock lock(self->lock);
+			if (!self->strands.empty()) {
+				Strand* strand = self->strands.front();
+				self->strands.pop_front();
+				return strand;
+			}
+		}
+		for (size_t i = 1; i < workers_.size(); ++i) {
+			Worker* victim = workers_[(index + i) % workers_.size()];
+			AutoLock lock(victim->lock);
+			if (!victim->strands.empty()) {
+				Strand* strand = victim->strands.back();
+				victim->strands.pop_back();
+				return strand;
+			}
+		}
+		return NULL;
+	}
+
+	void Dispatcher::RunStrand(Strand* strand, size_t index)
+	{
+		Queue* queue = strand->queue;
+		TaskNode* node;
+		{
+			AutoLock lock(queue->lock_);
+			node = strand->head;
+			strand->head = NULL;
+			strand->tail = NULL;
+		}
+
+		while (node) {
+			TaskNode* next = node->next;
+			node->finish(node);
+			queue->TaskDone();
+			node = next;
+		}
+
+		AutoLock lock(queue->lock_);
+		if (strand->head) {
+			// More came in, let the other strands of this worker go first.
+			Worker* self = workers_[index];
+			AutoLock worker_lock(self->lock);
+			self->strands.push_back(strand);
+			return;
+		}
+		strand->scheduled = false;
+		if (--queue->scheduled_count_ == 0 && queue->waiting_)
+			queue->idle_event_.Signal();
+	}
+}
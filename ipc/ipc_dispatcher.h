@@ -0,0 +1,155 @@
+#pragma once
+#include "ipc/ipc_common.h"
+#include "ipc/ipc_utils.h"
+#include "ipc/ipc_message_pool.h"
+
+#include <cassert>
+#include <deque>
+#include <functional>
+#include <new>
+#include <thread>
+#include <vector>
+
+namespace IPC
+{
+	// Runs tasks on a pool of worker threads. Tasks are posted to a Queue
+	// under a key: tasks with the same key run one after the other in the
+	// order they were posted, tasks with different keys run in parallel.
+	//
+	// The keys of a queue are spread over its strands. A strand with tasks
+	// is scheduled on one worker, which runs what it finds queued in one go
+	// and puts the strand back at the end of its deque if more came in
+	// meanwhile. Workers without strands of their own steal from the others,
+	// so a slow task only holds up the strand it runs on.
+	class Dispatcher
+	{
+	public:
+		typedef std::function<void(void)> Task;
+
+		class Queue;
+
+	private:
+		// Posted task, linked into its strand.
+		struct TaskNode {
+			TaskNode* next;
+			// Runs the task and frees the node.
+			void (*finish)(TaskNode* node);
+		};
+
+		template <typename F>
+		struct TaskNodeImpl : TaskNode {
+			explicit TaskNodeImpl(const F& f) : task(f) {
+				finish = &TaskNodeImpl::Finish;
+			}
+
+			static void Finish(TaskNode* node) {
+				TaskNodeImpl* self = static_cast<TaskNodeImpl*>(node);
+				self->task();
+				self->~TaskNodeImpl();
+				MessagePool::Free(self);
+			}
+
+			F task;
+		};
+
+		struct Strand {
+			Queue* queue;
+			// Tasks not taken by a worker yet, oldest first.
+			TaskNode* head;
+			TaskNode* tail;
+			// Set from the first task until a worker finds the strand empty.
+			bool scheduled;
+		};
+
+	public:
+		class Queue
+		{
+		public:
+			// Keys go to one of |strand_count| strands by their value modulo
+			// |strand_count|, keys sharing a strand also run in order.
+			// |on_low|, if set, runs on a worker whenever pending() drops to
+			// |low_watermark|. |dispatcher| must outlive the queue.
+			Queue(Dispatcher* dispatcher, size_t strand_count,
+				size_t low_watermark, const Task& on_low);
+
+			// Waits until the tasks posted so far ran. Must not be called
+			// from one of them.
+			~Queue();
+
+			// Runs |task| on a worker after the tasks posted with |key|
+			// before. Can be called on any thread, takes any callable like
+			// Thread::PostTask(). Returns pending() including |task|.
+			template <typename F>
+			size_t Post(uint32 key, const F& task)
+			{
+				void* memory = MessagePool::Allocate(sizeof(TaskNodeImpl<F>), NULL);
+				assert(memory);
+				return PushTask(key, new (memory) TaskNodeImpl<F>(task));
+			}
+
+			// Tasks posted that did not finish yet.
+			size_t pending() const {
+				return static_cast<size_t>(InterlockedCompareExchange(
+					const_cast<volatile LONG*>(&pending_), 0, 0));
+			}
+
+		private:
+			friend class Dispatcher;
+
+			size_t PushTask(uint32 key, TaskNode* node);
+			// Called by the worker after each task.
+			void TaskDone();
+
+			Dispatcher* dispatcher_;
+			std::vector<Strand> strands_;
+			size_t low_watermark_;
+			Task on_low_;
+			volatile LONG pending_;
+
+			// Guards the strands.
+			Lock lock_;
+			// Strands scheduled, the destructor waits for none to be left.
+			size_t scheduled_count_;
+			bool waiting_;
+			WaitableEvent idle_event_;
+
+			DISALLOW_COPY_AND_ASSIGN(Queue);
+		};
+
+		// Starts |worker_count| workers, or one per processor if 0.
+		explicit Dispatcher(size_t worker_count = 0);
+
+		// Stops the workers. Every queue must be gone.
+		~Dispatcher();
+
+		size_t worker_count() const { return workers_.size(); }
+
+	private:
+		struct Worker {
+			Worker() : wake_event(false, false), sleeping(0) {}
+
+			// Strands ready to run. The worker takes them from the front,
+			// thieves from the back.
+			Lock lock;
+			std::deque<Strand*> strands;
+			WaitableEvent wake_event;
+			volatile LONG sleeping;
+			std::thread thread;
+		};
+
+		void WorkerMain(size_t index);
+		// Puts |strand| on the deque of the next worker in turn and makes
+		// sure somebody is awake to run it.
+		void Schedule(Strand* strand);
+		// Takes a strand of worker |index|, or steals one from the others.
+		Strand* TakeStrand(size_t index);
+		// Runs the tasks queued on |strand|, which worker |index| took.
+		void RunStrand(Strand* strand, size_t index);
+
+		std::vector<Worker*> workers_;
+		volatile LONG next_worker_;
+		volatile bool quit_;
+
+		DISALLOW_COPY_AND_ASSIGN(Dispatcher);
+	};
+}
@@ -1,115 +1,885 @@
-#include "ipc_endpoint.h"
-#include "ipc/ipc_message.h"
-#include <cassert>
-
-namespace IPC
-{
-
-	Endpoint::Endpoint(const std::string& name, Listener* listener, bool start_now)
-		: name_(name)
-		, listener_(listener)
-		, is_connected_(false)
-	{
-		thread_.Start();
-		if (start_now)
-			Start();
-	}
-
-	Endpoint::~Endpoint()
-	{
-		SetConnected(false);
-		if (channel_) 
-		{
-			HANDLE wait_event = ::CreateEvent(NULL, FALSE, FALSE, NULL);
-			thread_.PostTask(std::bind(&Endpoint::CloseChannel, this, wait_event));
-			DWORD ret = ::WaitForSingleObject(wait_event, 2000);
-			assert(ret == WAIT_OBJECT_0);
-			CloseHandle(wait_event);
-			delete channel_;
-			channel_ = NULL;
-		}
-		thread_.Stop();
-		thread_.Wait(2000);
-	}
-
-	void Endpoint::Start()
-	{
-		if (channel_ == NULL)
-			thread_.PostTask(std::bind(&Endpoint::CreateChannel, this));
-	}
-
-
-	bool Endpoint::IsConnected() const
-	{
-		AutoLock lock(lock_);
-		return is_connected_;
-	}
-
-
-	void Endpoint::SetConnected(bool c)
-	{
-		AutoLock lock(lock_);
-		is_connected_ = c;
-	}
-
-
-	void Endpoint::CreateChannel()
-	{
-		if (channel_)
-			return;
-
-		channel_ = new Channel(name_, this, &thread_);
-		channel_->Connect();
-	}
-
-	bool Endpoint::Send(Message* message)
-	{
-		scoped_refptr<Message> m(message);
-		if (channel_ == NULL || !IsConnected()) {
-			return false;
-		}
-		thread_.PostTask(std::bind(&Endpoint::OnSendMessage, this, m));
-		return true;
-	}
-
-
-	void Endpoint::OnSendMessage(scoped_refptr<Message> message)
-	{
-		if (channel_ == NULL)
-			return;
-
-		channel_->Send(message.get());
-	}
-
-
-	bool Endpoint::OnMessageReceived(Message* message)
-	{
-		return listener_->OnMessageReceived(message);
-	}
-
-	void Endpoint::OnChannelConnected(int32 peer_pid)
-	{
-		SetConnected(true);
-		listener_->OnChannelConnected(peer_pid);
-	}
-
-	void Endpoint::OnChannelError()
-	{
-		Channel* ch = channel_;
-		channel_ = NULL;
-		delete ch;
-		SetConnected(false);
-		listener_->OnChannelError();
-		Start();
-	}
-
-	void Endpoint::CloseChannel(HANDLE wait_event)
-	{
-		Channel* ch = channel_;
-		channel_ = NULL;
-		delete ch;
-		SetEvent(wait_event);
-	}
-
-
+#include "ipc_endpoint.h"
+#include "ipc/ipc_message.h"
+#include <algorithm>
+#include <cassert>
+#include <memory>
+
+namespace IPC
+{
+	namespace
+	{
+		void DeleteSyncEvent(WaitableEvent* event)
+		{
+			delete event;
+		}
+
+		// Signalled for the SendSync() call waiting on the thread. Deleted when
+		// the thread exits on POSIX, Windows TLS has no destructors.
+		ThreadLocalPointer<WaitableEvent> g_sync_event(&DeleteSyncEvent);
+
+		WaitableEvent* GetSyncEvent()
+		{
+			WaitableEvent* event = g_sync_event.Get();
+			if (!event) {
+				event = new WaitableEvent(false, false);
+				g_sync_event.Set(event);
+			}
+			return event;
+		}
+
+		// State of a PendingCall slot owned by a thread.
+		const LONG kCallSlotBusy = -1;
+
+		// Expired calls are looked for at most this often, in microseconds.
+		const uint64 kExpiryCheckInterval = 1000;
+
+		void SetCallResult(std::shared_ptr<std::promise<Endpoint::CallResult> > promise,
+			Endpoint::CallStatus status, Message* reply)
+		{
+			Endpoint::CallResult result;
+			result.status = status;
+			result.reply = reply;
+			promise->set_value(result);
+		}
+	}
+
+	struct Endpoint::PendingSync
+	{
+		PendingSync(uint32 request_id, WaitableEvent* wait_event)
+			: id(request_id), event(wait_event), reply(NULL), done(false) {}
+
+		uint32 id;
+		WaitableEvent* event;
+		Message* reply;
+		bool done;
+		// UNBLOCK_BIT messages to dispatch on the waiting thread.
+		std::deque<Message*> unblock_messages;
+	};
+
+	struct Endpoint::OutgoingMessage
+	{
+		OutgoingMessage* next;
+		// Holds a reference.
+		Message* message;
+	};
+
+	struct Endpoint::PendingCall
+	{
+		PendingCall() : state(0), id(0), deadline(0) {}
+
+		volatile LONG state;
+		// Only touched by the thread owning the slot.
+		uint32 id;
+		// MonotonicMicroseconds() when the call times out, 0 for never.
+		uint64 deadline;
+		ReplyCallback callback;
+	};
+
+	Endpoint::Endpoint(const std::string& name, Listener* listener, bool start_now)
+		: name_(name)
+		, thread_(new Thread)
+		, pool_(NULL)
+		, channel_(NULL)
+		, channel_features_(0)
+		, output_scheduling_(Channel::SCHEDULE_STRICT)
+		, listener_(listener)
+		, dispatch_queue_(NULL)
+		, reading_paused_(0)
+		, is_connected_(0)
+		, max_message_size_(static_cast<LONG>(Channel::kMaximumMessageSize))
+		, closing_(false)
+		, outgoing_head_(NULL)
+		, outgoing_bytes_(0)
+		, outgoing_messages_(0)
+		, connect_buffer_bytes_(0)
+		, connect_buffer_limit_(0)
+		, connect_buffer_ttl_(INFINITE)
+		, output_blocked_(0)
+		, writable_waiters_(0)
+		, next_request_id_(0)
+		, pending_calls_(NULL)
+		, next_expiry_check_(0)
+		, expiry_deadline_(0)
+	{
+		thread_->Start();
+		if (start_now)
+			Start();
+	}
+
+	Endpoint::Endpoint(const std::string& name, Listener* listener,
+		ThreadPool* pool, bool start_now)
+		: name_(name)
+		, thread_(pool->Acquire())
+		, pool_(pool)
+		, channel_(NULL)
+		, channel_features_(0)
+		, output_scheduling_(Channel::SCHEDULE_STRICT)
+		, listener_(listener)
+		, dispatch_queue_(NULL)
+		, reading_paused_(0)
+		, is_connected_(0)
+		, max_message_size_(static_cast<LONG>(Channel::kMaximumMessageSize))
+		, closing_(false)
+		, outgoing_head_(NULL)
+		, outgoing_bytes_(0)
+		, outgoing_messages_(0)
+		, connect_buffer_bytes_(0)
+		, connect_buffer_limit_(0)
+		, connect_buffer_ttl_(INFINITE)
+		, output_blocked_(0)
+		, writable_waiters_(0)
+		, next_request_id_(0)
+		, pending_calls_(NULL)
+		, next_expiry_check_(0)
+		, expiry_deadline_(0)
+	{
+		if (start_now)
+			Start();
+	}
+
+	Endpoint::~Endpoint()
+	{
+		SetConnected(false);
+		{
+			AutoLock lock(lock_);
+			closing_ = true;
+		}
+		FailPendingSyncs();
+
+		if (thread_->BelongsToCurrentThread()) {
+			// Deleted from a task of the thread, by another endpoint that
+			// shares it, which cannot wait for the thread. The same rounds
+			// run inline.
+			thread_->RunPendingTasks();
+			CloseChannel(NULL);
+			thread_->RunPendingTasks();
+			if (dispatch_queue_) {
+				delete dispatch_queue_;
+				dispatch_queue_ = NULL;
+				thread_->RunPendingTasks();
+			}
+		} else {
+			// The thread may be shared and keeps running, so nothing posted
+			// for this endpoint or its channel may be left behind. The first
+			// round lets a CreateChannel() in flight finish, the tasks its
+			// channel posted run before the channel is closed in the second.
+			WaitableEvent wait_event(false, false);
+			thread_->PostTask(std::bind(&WaitableEvent::Signal, &wait_event));
+			wait_event.Wait(INFINITE);
+			thread_->PostTask(std::bind(&Endpoint::CloseChannel, this, &wait_event));
+			wait_event.Wait(INFINITE);
+			if (dispatch_queue_) {
+				// Waits for the messages still with the workers. What they
+				// posted to the thread runs in one more round.
+				delete dispatch_queue_;
+				dispatch_queue_ = NULL;
+				thread_->PostTask(std::bind(&WaitableEvent::Signal, &wait_event));
+				wait_event.Wait(INFINITE);
+			}
+		}
+		FlushOutgoingMessages();
+		for (size_t i = 0; i < connect_buffer_.size(); ++i)
+			connect_buffer_[i].message->Release();
+		connect_buffer_.clear();
+
+		if (pool_) {
+			pool_->Release(thread_);
+		} else if (thread_->BelongsToCurrentThread()) {
+			thread_->DeleteSoon();
+		} else {
+			thread_->Stop();
+			thread_->Wait(2000);
+			delete thread_;
+		}
+
+		ExpireCalls(true);
+		delete[] pending_calls_;
+	}
+
+	void Endpoint::Start()
+	{
+		{
+			AutoLock lock(lock_);
+			if (closing_)
+				return;
+		}
+		if (channel_ == NULL)
+			thread_->PostTask(std::bind(&Endpoint::CreateChannel, this));
+	}
+
+
+	void Endpoint::SetConnected(bool c)
+	{
+		InterlockedExchange(&is_connected_, c ? 1 : 0);
+	}
+
+
+	void Endpoint::CreateChannel()
+	{
+		if (channel_)
+			return;
+		{
+			AutoLock lock(lock_);
+			if (closing_)
+				return;
+		}
+
+		channel_ = new Channel(name_, this, thread_, channel_features_,
+			&session_);
+		channel_->set_output_scheduling(output_scheduling_);
+		channel_->set_output_limits(output_limits_);
+		InterlockedExchange(&reading_paused_, 0);
+		InterlockedExchange(&output_blocked_, 0);
+		if (channel_->Connect())
+			FlushOutgoingMessages();
+	}
+
+	bool Endpoint::Send(Message* message)
+	{
+		scoped_refptr<Message> m(message);
+		if (message->size() > static_cast<size_t>(max_message_size_))
+			return false;
+		bool buffered;
+		if (!IsConnected() && BufferMessage(message, &buffered))
+			return buffered;
+
+		if (thread_->BelongsToCurrentThread()) {
+			// Keep the order with messages other threads queued before.
+			FlushOutgoingMessages();
+			channel_->Send(message);
+			return true;
+		}
+
+		OutgoingMessage* outgoing = static_cast<OutgoingMessage*>(
+			MessagePool::Allocate(sizeof(OutgoingMessage), NULL));
+		outgoing->message = message;
+		message->AddRef();
+		InterlockedExchangeAdd(&outgoing_bytes_, static_cast<LONG>(message->size()));
+		InterlockedIncrement(&outgoing_messages_);
+		for (;;) {
+			void* head = outgoing_head_;
+			outgoing->next = static_cast<OutgoingMessage*>(head);
+			if (InterlockedCompareExchangePointer(&outgoing_head_, outgoing,
+				head) == head) {
+				if (!head)
+					thread_->PostTask(std::bind(&Endpoint::FlushOutgoingMessages, this));
+				return true;
+			}
+		}
+	}
+
+	Endpoint::SendStatus Endpoint::TrySend(Message* message,
+		const std::function<void()>& on_writable)
+	{
+		if (IsConnected() && IsOutputBlocked()) {
+			if (on_writable) {
+				{
+					AutoLock lock(lock_);
+					writable_callbacks_.push_back(on_writable);
+					InterlockedExchange(&writable_waiters_, 1);
+				}
+				// The output may have drained before the callback was
+				// queued, in which case nobody else looks at it.
+				if (!IsOutputBlocked())
+					thread_->PostTask(std::bind(&Endpoint::NotifyWritable, this));
+			}
+			return SEND_WOULD_BLOCK;
+		}
+		return Send(message) ? SEND_OK : SEND_FAILED;
+	}
+
+	bool Endpoint::IsOutputBlocked() const
+	{
+		volatile LONG* blocked = const_cast<volatile LONG*>(&output_blocked_);
+		if (InterlockedCompareExchange(blocked, 0, 0))
+			return true;
+		size_t bytes = static_cast<size_t>(outgoing_bytes_);
+		size_t messages = static_cast<size_t>(outgoing_messages_);
+		return (output_limits_.high_bytes && bytes >= output_limits_.high_bytes) ||
+			(output_limits_.high_messages &&
+			messages >= output_limits_.high_messages);
+	}
+
+	void Endpoint::NotifyWritable()
+	{
+		std::vector<std::function<void()> > callbacks;
+		{
+			AutoLock lock(lock_);
+			if (closing_ || writable_callbacks_.empty())
+				return;
+			// A failed channel has nothing to wait for.
+			if (IsConnected() && IsOutputBlocked())
+				return;
+			callbacks.swap(writable_callbacks_);
+			InterlockedExchange(&writable_waiters_, 0);
+		}
+		for (size_t i = 0; i < callbacks.size(); ++i)
+			callbacks[i]();
+	}
+
+	void Endpoint::OnChannelOutputBlocked(bool blocked)
+	{
+		InterlockedExchange(&output_blocked_, blocked ? 1 : 0);
+		if (!blocked)
+			NotifyWritable();
+	}
+
+	Endpoint::OutgoingMessage* Endpoint::TakeOutgoingMessages()
+	{
+		OutgoingMessage* outgoing = static_cast<OutgoingMessage*>(
+			InterlockedExchangePointer(&outgoing_head_, NULL));
+		OutgoingMessage* oldest = NULL;
+		while (outgoing) {
+			OutgoingMessage* next = outgoing->next;
+			outgoing->next = oldest;
+			oldest = outgoing;
+			outgoing = next;
+		}
+		return oldest;
+	}
+
+	bool Endpoint::BufferMessage(Message* message, bool* buffered)
+	{
+		*buffered = false;
+		bool was_empty;
+		{
+			AutoLock lock(lock_);
+			// OnChannelConnected() took the buffer for the last time.
+			if (IsConnected())
+				return false;
+			if (closing_ || !connect_buffer_limit_)
+				return true;
+			uint64 now = MonotonicMicroseconds();
+			ExpireConnectBuffer(now);
+			if (connect_buffer_bytes_ + message->size() > connect_buffer_limit_)
+				return true;
+
+			BufferedMessage buffered = { message, 0 };
+			if (connect_buffer_ttl_ != INFINITE)
+				buffered.deadline = now + static_cast<uint64>(connect_buffer_ttl_) * 1000;
+			message->AddRef();
+			was_empty = connect_buffer_.empty();
+			connect_buffer_.push_back(buffered);
+			connect_buffer_bytes_ += message->size();
+		}
+		*buffered = true;
+		// A channel that connected to its peer takes them at once, they go
+		// out right behind its hello.
+		if (was_empty)
+			thread_->PostTask(std::bind(&Endpoint::FlushConnectBuffer, this));
+		return true;
+	}
+
+	void Endpoint::ExpireConnectBuffer(uint64 now)
+	{
+		while (!connect_buffer_.empty() && connect_buffer_.front().deadline &&
+			connect_buffer_.front().deadline <= now) {
+			Message* m = connect_buffer_.front().message;
+			connect_buffer_.pop_front();
+			connect_buffer_bytes_ -= m->size();
+			m->Release();
+		}
+	}
+
+	void Endpoint::FlushConnectBuffer()
+	{
+		if (!channel_ || channel_->waiting_connect())
+			return;
+		std::deque<BufferedMessage> buffered;
+		{
+			AutoLock lock(lock_);
+			if (connect_buffer_.empty())
+				return;
+			ExpireConnectBuffer(MonotonicMicroseconds());
+			buffered.swap(connect_buffer_);
+			connect_buffer_bytes_ = 0;
+		}
+		for (size_t i = 0; i < buffered.size(); ++i) {
+			channel_->Enqueue(buffered[i].message);
+			buffered[i].message->Release();
+		}
+		channel_->Flush();
+	}
+
+	void Endpoint::FlushOutgoingMessages()
+	{
+		// Messages that lost the race with a broken channel go with what
+		// it could not write.
+		SendOutgoingMessages((channel_features_ & Channel::FEATURE_RELIABLE) &&
+			!IsConnected());
+		// Whatever was buffered since the break was sent after them.
+		FlushConnectBuffer();
+	}
+
+	void Endpoint::SendOutgoingMessages(bool keep)
+	{
+		OutgoingMessage* outgoing = TakeOutgoingMessages();
+		if (!outgoing)
+			return;
+
+		while (outgoing) {
+			OutgoingMessage* next = outgoing->next;
+			InterlockedExchangeAdd(&outgoing_bytes_,
+				-static_cast<LONG>(outgoing->message->size()));
+			InterlockedDecrement(&outgoing_messages_);
+			if (keep)
+				session_.KeepUnsent(outgoing->message);
+			else if (channel_)
+				channel_->Enqueue(outgoing->message);
+			outgoing->message->Release();
+			MessagePool::Free(outgoing);
+			outgoing = next;
+		}
+		// One write for the whole batch.
+		if (channel_)
+			channel_->Flush();
+		if (InterlockedCompareExchange(&writable_waiters_, 0, 0))
+			NotifyWritable();
+	}
+
+
+	bool Endpoint::SendSync(Message* message, Message** reply, DWORD timeout)
+	{
+		scoped_refptr<Message> m(message);
+		*reply = NULL;
+		// The reply could never be read while the IO thread waits for it.
+		if (thread_->BelongsToCurrentThread())
+			return false;
+
+		uint32 id = NextRequestId();
+		message->set_sync();
+		message->set_request_id(id);
+
+		PendingSync pending(id, GetSyncEvent());
+		{
+			AutoLock lock(sync_lock_);
+			pending_syncs_.push_back(&pending);
+		}
+
+		uint64 deadline = 0;
+		if (timeout != INFINITE)
+			deadline = MonotonicMicroseconds() + static_cast<uint64>(timeout) * 1000;
+		bool sent = Send(message);
+		while (sent) {
+			Message* unblock = NULL;
+			{
+				AutoLock lock(sync_lock_);
+				if (pending.done)
+					break;
+				if (!pending.unblock_messages.empty()) {
+					unblock = pending.unblock_messages.front();
+					pending.unblock_messages.pop_front();
+				}
+			}
+			if (unblock) {
+				DispatchToListener(unblock);
+				unblock->Release();
+				continue;
+			}
+
+			DWORD wait = INFINITE;
+			if (deadline) {
+				uint64 now = MonotonicMicroseconds();
+				if (now >= deadline)
+					break;
+				wait = static_cast<DWORD>((deadline - now + 999) / 1000);
+			}
+			pending.event->Wait(wait);
+		}
+
+		std::deque<Message*> unblock_messages;
+		{
+			AutoLock lock(sync_lock_);
+			pending_syncs_.erase(std::find(pending_syncs_.begin(),
+				pending_syncs_.end(), &pending));
+			unblock_messages.swap(pending.unblock_messages);
+			*reply = pending.reply;
+		}
+		// Still ours, they may have come in after the reply.
+		for (size_t i = 0; i < unblock_messages.size(); ++i) {
+			DispatchToListener(unblock_messages[i]);
+			unblock_messages[i]->Release();
+		}
+
+		if (*reply && (*reply)->is_reply_error()) {
+			(*reply)->Release();
+			*reply = NULL;
+		}
+		return *reply != NULL;
+	}
+
+	uint32 Endpoint::CallAsync(Message* message, const ReplyCallback& callback,
+		DWORD timeout)
+	{
+		scoped_refptr<Message> m(message);
+		PendingCall* calls = GetPendingCalls();
+
+		// Take the first request id whose slot is free.
+		PendingCall* call = NULL;
+		uint32 id = 0;
+		for (uint32 i = 0; i < kMaxPendingCalls && !call; ++i) {
+			id = NextRequestId();
+			PendingCall* slot = &calls[id % kMaxPendingCalls];
+			if (InterlockedCompareExchange(&slot->state, kCallSlotBusy, 0) == 0)
+				call = slot;
+		}
+		if (!call)
+			return 0;  // Too many calls in flight.
+
+		call->id = id;
+		call->deadline = 0;
+		if (timeout != INFINITE) {
+			call->deadline = MonotonicMicroseconds() + static_cast<uint64>(timeout) * 1000;
+			if (thread_->BelongsToCurrentThread())
+				ArmExpiryTimer(call->deadline);
+			else
+				thread_->PostTask(std::bind(&Endpoint::ArmExpiryTimer, this,
+					call->deadline));
+		}
+		call->callback = callback;
+		message->set_sync();
+		message->set_request_id(id);
+
+		// Publish the call before sending, the reply may come back right away.
+		InterlockedExchange(&call->state, static_cast<LONG>(id));
+		if (!Send(message) && ClaimCall(id) == call) {
+			call->callback = ReplyCallback();
+			InterlockedExchange(&call->state, 0);
+			return 0;
+		}
+		return id;
+	}
+
+	std::future<Endpoint::CallResult> Endpoint::CallAsync(Message* message,
+		DWORD timeout, uint32* call_id)
+	{
+		std::shared_ptr<std::promise<CallResult> > promise(
+			new std::promise<CallResult>);
+		std::future<CallResult> future = promise->get_future();
+		uint32 id = CallAsync(message, std::bind(&SetCallResult, promise,
+			std::placeholders::_1, std::placeholders::_2), timeout);
+		if (!id)
+			SetCallResult(promise, CALL_FAILED, NULL);
+		if (call_id)
+			*call_id = id;
+		return future;
+	}
+
+	bool Endpoint::CancelCall(uint32 call_id)
+	{
+		PendingCall* call = ClaimCall(call_id);
+		if (!call)
+			return false;
+		FinishCall(call, CALL_CANCELLED, NULL);
+		return true;
+	}
+
+	uint32 Endpoint::NextRequestId()
+	{
+		uint32 id;
+		do {
+			id = InterlockedIncrement(&next_request_id_) & Message::kMaxRequestId;
+		} while (!id);
+		return id;
+	}
+
+	Endpoint::PendingCall* Endpoint::GetPendingCalls()
+	{
+		PendingCall* calls = pending_calls_;
+		if (calls)
+			return calls;
+
+		calls = new PendingCall[kMaxPendingCalls];
+		if (InterlockedCompareExchangePointer(
+			reinterpret_cast<void* volatile*>(&pending_calls_), calls, NULL)) {
+			// Another thread was faster.
+			delete[] calls;
+			calls = pending_calls_;
+		}
+		return calls;
+	}
+
+	Endpoint::PendingCall* Endpoint::ClaimCall(uint32 call_id)
+	{
+		PendingCall* calls = pending_calls_;
+		if (!calls || !call_id || call_id > Message::kMaxRequestId)
+			return NULL;
+		PendingCall* call = &calls[call_id % kMaxPendingCalls];
+		LONG id = static_cast<LONG>(call_id);
+		if (InterlockedCompareExchange(&call->state, kCallSlotBusy, id) != id)
+			return NULL;
+		return call;
+	}
+
+	void Endpoint::FinishCall(PendingCall* call, CallStatus status,
+		Message* reply)
+	{
+		ReplyCallback callback;
+		callback.swap(call->callback);
+		InterlockedExchange(&call->state, 0);
+		callback(status, reply);
+	}
+
+	uint64 Endpoint::ExpireCalls(bool all)
+	{
+		PendingCall* calls = pending_calls_;
+		if (!calls)
+			return 0;
+
+		uint64 now = MonotonicMicroseconds();
+		if (!all) {
+			if (now < next_expiry_check_)
+				return 0;
+			next_expiry_check_ = now + kExpiryCheckInterval;
+		}
+
+		uint64 next_deadline = 0;
+		for (uint32 i = 0; i < kMaxPendingCalls; ++i) {
+			LONG state = calls[i].state;
+			if (state == 0 || state == kCallSlotBusy)
+				continue;
+			// The deadline was written before the state was published. If the
+			// slot changes hands meanwhile, claiming it below fails.
+			uint64 deadline = calls[i].deadline;
+			if (!all && (!deadline || deadline > now)) {
+				if (deadline && (!next_deadline || deadline < next_deadline))
+					next_deadline = deadline;
+				continue;
+			}
+			PendingCall* call = ClaimCall(static_cast<uint32>(state));
+			if (call)
+				FinishCall(call, all ? CALL_FAILED : CALL_TIMED_OUT, NULL);
+		}
+		return next_deadline;
+	}
+
+	void Endpoint::ArmExpiryTimer(uint64 deadline)
+	{
+		if (expiry_timer_.IsRunning() && expiry_deadline_ <= deadline)
+			return;
+
+		uint64 now = MonotonicMicroseconds();
+		DWORD delay = 0;
+		if (deadline > now)
+			delay = static_cast<DWORD>((deadline - now + 999) / 1000);
+		expiry_deadline_ = deadline;
+		expiry_timer_.Start(thread_, delay,
+			std::bind(&Endpoint::OnExpiryTimer, this));
+	}
+
+	void Endpoint::OnExpiryTimer()
+	{
+		next_expiry_check_ = 0;
+		uint64 next_deadline = ExpireCalls(false);
+		if (next_deadline)
+			ArmExpiryTimer(next_deadline);
+	}
+
+	bool Endpoint::OnMessageReceived(Message* message)
+	{
+		if (message->is_reply()) {
+			DispatchReply(message);
+			return true;
+		}
+		if (message->should_unblock() && DispatchUnblockMessage(message))
+			return true;
+		if (dispatch_queue_)
+			DispatchLater(message);
+		else
+			DispatchToListener(message);
+		return true;
+	}
+
+	void Endpoint::set_dispatcher(Dispatcher* dispatcher, const DispatchKey& key)
+	{
+		delete dispatch_queue_;
+		dispatch_queue_ = NULL;
+		if (dispatcher) {
+			dispatch_queue_ = new Dispatcher::Queue(dispatcher, kDispatchStrands,
+				kDispatchLowWatermark,
+				std::bind(&Endpoint::OnDispatchBacklogLow, this));
+		}
+		dispatch_key_ = key;
+	}
+
+	void Endpoint::DispatchLater(Message* message)
+	{
+		uint32 key = dispatch_key_ ? dispatch_key_(message) :
+			static_cast<uint32>(message->routing_id());
+		size_t pending = dispatch_queue_->Post(key,
+			std::bind(&Endpoint::DispatchQueued, this, scoped_refptr<Message>(message)));
+		if (pending < kDispatchHighWatermark || reading_paused_ || !channel_)
+			return;
+
+		InterlockedExchange(&reading_paused_, 1);
+		channel_->PauseReading();
+		// The workers may have caught up before the flag was set, in which
+		// case none of them resumes. Posted, the channel is in the middle
+		// of reading.
+		if (dispatch_queue_->pending() <= kDispatchLowWatermark)
+			thread_->PostTask(std::bind(&Endpoint::ResumeReading, this));
+	}
+
+	void Endpoint::DispatchQueued(scoped_refptr<Message> message)
+	{
+		DispatchToListener(message.get());
+	}
+
+	void Endpoint::OnDispatchBacklogLow()
+	{
+		if (InterlockedCompareExchange(&reading_paused_, 0, 0))
+			thread_->PostTask(std::bind(&Endpoint::ResumeReading, this));
+	}
+
+	void Endpoint::ResumeReading()
+	{
+		if (InterlockedExchange(&reading_paused_, 0) && channel_)
+			channel_->ResumeReading();
+	}
+
+	void Endpoint::DispatchToListener(Message* message)
+	{
+		if (!listener_->OnMessageReceived(message) && message->is_sync()) {
+			// Nobody is going to answer, don't keep the caller waiting.
+			scoped_refptr<Message> reply(Message::GenerateReply(message));
+			reply->set_reply_error();
+			Send(reply.get());
+		}
+	}
+
+	void Endpoint::DispatchReply(Message* reply)
+	{
+		PendingCall* call = ClaimCall(reply->request_id());
+		if (call) {
+			if (reply->is_reply_error())
+				FinishCall(call, CALL_FAILED, NULL);
+			else
+				FinishCall(call, CALL_OK, reply);
+			ExpireCalls(false);
+			return;
+		}
+		ExpireCalls(false);
+
+		AutoLock lock(sync_lock_);
+		for (size_t i = 0; i < pending_syncs_.size(); ++i) {
+			PendingSync* pending = pending_syncs_[i];
+			if (pending->id == reply->request_id() && !pending->done) {
+				reply->AddRef();
+				pending->reply = reply;
+				pending->done = true;
+				pending->event->Signal();
+				return;
+			}
+		}
+		// The caller timed out, drop the reply.
+	}
+
+	bool Endpoint::DispatchUnblockMessage(Message* message)
+	{
+		AutoLock lock(sync_lock_);
+		if (pending_syncs_.empty())
+			return false;
+		PendingSync* pending = pending_syncs_.back();
+		message->AddRef();
+		pending->unblock_messages.push_back(message);
+		pending->event->Signal();
+		return true;
+	}
+
+	void Endpoint::FailPendingSyncs()
+	{
+		AutoLock lock(sync_lock_);
+		for (size_t i = 0; i < pending_syncs_.size(); ++i) {
+			pending_syncs_[i]->done = true;
+			pending_syncs_[i]->event->Signal();
+		}
+	}
+
+	void Endpoint::OnChannelConnected(int32 peer_pid)
+	{
+		{
+			AutoLock lock(lock_);
+			capabilities_ = channel_->capabilities();
+		}
+		InterlockedExchange(&max_message_size_,
+			static_cast<LONG>(capabilities_.max_message_size));
+		// Send() order: what was queued before the break, behind what the
+		// channel replayed, then what was buffered since. Send() buffers
+		// no more once the endpoint is connected under |lock_|.
+		SendOutgoingMessages(false);
+		std::deque<BufferedMessage> buffered;
+		{
+			AutoLock lock(lock_);
+			ExpireConnectBuffer(MonotonicMicroseconds());
+			buffered.swap(connect_buffer_);
+			connect_buffer_bytes_ = 0;
+			SetConnected(true);
+		}
+		for (size_t i = 0; i < buffered.size(); ++i) {
+			channel_->Enqueue(buffered[i].message);
+			buffered[i].message->Release();
+		}
+		channel_->Flush();
+		listener_->OnChannelConnected(peer_pid);
+	}
+
+	void Endpoint::OnChannelError()
+	{
+		Channel* ch = channel_;
+		channel_ = NULL;
+		delete ch;
+		SetConnected(false);
+		InterlockedExchange(&output_blocked_, 0);
+		FailPendingSyncs();
+		ExpireCalls(true);
+		NotifyWritable();
+		listener_->OnChannelError();
+		Start();
+	}
+
+	void Endpoint::OnChannelStreamReset()
+	{
+		listener_->OnChannelStreamReset();
+	}
+
+	void Endpoint::CloseChannel(WaitableEvent* wait_event)
+	{
+		expiry_timer_.Stop();
+		Channel* ch = channel_;
+		channel_ = NULL;
+		delete ch;
+		if (wait_event)
+			wait_event->Signal();
+	}
+
+	bool Endpoint::GetCapabilities(Channel::Capabilities* caps) const
+	{
+		AutoLock lock(lock_);
+		if (!IsConnected())
+			return false;
+		*caps = capabilities_;
+		return true;
+	}
+
+	bool Endpoint::GetOutputStats(Channel::OutputStats* stats)
+	{
+		bool result = false;
+		WaitableEvent wait_event(false, false);
+		thread_->PostTask(std::bind(&Endpoint::ReadOutputStats, this, stats,
+			&result, &wait_event));
+		wait_event.Wait(INFINITE);
+		return result;
+	}
+
+	void Endpoint::ReadOutputStats(Channel::OutputStats* stats, bool* result,
+		WaitableEvent* wait_event)
+	{
+		if (channel_) {
+			*stats = channel_->output_stats();
+			*result = true;
+		}
+		wait_event->Signal();
+	}
+
+
 }
\ No newline at end of file
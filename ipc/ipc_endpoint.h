@@ -1,41 +1,329 @@
-#pragma once
-#include "ipc/ipc_thread.h"
-#include "ipc/ipc_channel.h"
-#include "ipc/ipc_listener.h"
-
-namespace IPC
-{
-	class Endpoint : public Sender, public Listener
-	{
-	public:
-		Endpoint(const std::string& name, Listener* listener, bool start_now = true);
-		~Endpoint();
-
-		void Start();
-
-		bool IsConnected() const;
-
-		virtual bool Send(Message* message) override;
-
-		virtual bool OnMessageReceived(Message* message) override;
-
-		virtual void OnChannelConnected(int32 peer_pid) override;
-
-		virtual void OnChannelError() override;
-
-	private:
-		void CreateChannel();
-		void OnSendMessage(scoped_refptr<Message> message);
-		void CloseChannel(HANDLE wait_event);
-		void SetConnected(bool c);
-		std::string name_;
-		Thread thread_;
-
-		Channel* channel_;
-		Listener* listener_;
-		//std::queue
-
-		mutable Lock lock_;
-		bool is_connected_;
-	};
+#pragma once
+#include "ipc/ipc_thread.h"
+#include "ipc/ipc_thread_pool.h"
+#include "ipc/ipc_dispatcher.h"
+#include "ipc/ipc_channel.h"
+#include "ipc/ipc_listener.h"
+#include "ipc/ipc_session.h"
+
+#include <deque>
+#include <functional>
+#include <future>
+#include <vector>
+
+namespace IPC
+{
+	class Endpoint : public Sender, public Listener
+	{
+	public:
+		enum CallStatus {
+			CALL_OK,
+			// The peer did not handle the request, or the channel failed before
+			// the reply arrived.
+			CALL_FAILED,
+			CALL_TIMED_OUT,
+			CALL_CANCELLED,
+		};
+
+		// Receives the outcome of CallAsync(). |reply| is only set with CALL_OK
+		// and only valid during the callback, AddRef() it to keep it.
+		typedef std::function<void(CallStatus status, Message* reply)>
+			ReplyCallback;
+
+		struct CallResult {
+			CallStatus status;
+			scoped_refptr<Message> reply;
+		};
+
+		// Outcome of TrySend().
+		enum SendStatus {
+			SEND_OK,
+			// The output is above its high watermark, the message was not
+			// taken.
+			SEND_WOULD_BLOCK,
+			SEND_FAILED,
+		};
+
+		// Returns the key that orders a received message, see
+		// set_dispatcher().
+		typedef std::function<uint32(Message* message)> DispatchKey;
+
+		// Most CallAsync() calls that can wait for their reply at once.
+		static const uint32 kMaxPendingCalls = 4096;
+
+		// Strands of the dispatcher queue of an endpoint.
+		static const size_t kDispatchStrands = 64;
+		// Reading from the channel pauses once this many received messages
+		// wait for a worker, and resumes when kDispatchLowWatermark are left.
+		static const size_t kDispatchHighWatermark = 1024;
+		static const size_t kDispatchLowWatermark = 256;
+
+		Endpoint(const std::string& name, Listener* listener, bool start_now = true);
+
+		// Runs the channel on a thread of |pool| instead of a thread of its
+		// own. |pool| must outlive the endpoint.
+		Endpoint(const std::string& name, Listener* listener, ThreadPool* pool,
+			bool start_now = true);
+		// Can be called on the thread of the channel, from a task of
+		// another endpoint on the same pool thread, but not from the
+		// callbacks of its own listener.
+		~Endpoint();
+
+		void Start();
+
+		// Optional Channel::Feature values offered to the peer. Only takes
+		// effect for channels created afterwards, so construct the endpoint
+		// with |start_now| false and call this before Start().
+		void set_channel_features(uint32 features) { channel_features_ = features; }
+
+		// How messages of different priorities share the channel, see
+		// Channel::OutputScheduling. Same rules as set_channel_features().
+		void set_output_scheduling(Channel::OutputScheduling scheduling) {
+			output_scheduling_ = scheduling;
+		}
+
+		// Watermarks of the output for TrySend(), see Channel::OutputLimits.
+		// Messages Send() queued on other threads for the IO thread count
+		// towards the high watermarks too. Same rules as
+		// set_channel_features().
+		void set_output_limits(const Channel::OutputLimits& limits) {
+			output_limits_ = limits;
+		}
+
+		// Lets Send() take up to |max_bytes| of messages while the channel is
+		// not connected. They are written right behind the hello of a channel
+		// that connected to its peer, or once the hello of the peer arrived on
+		// one that waited for it, ahead of anything sent later. Messages that
+		// waited longer than |ttl| milliseconds are dropped unless |ttl| is
+		// INFINITE. With |max_bytes| 0, the default, Send() fails until the
+		// channel is connected. Same rules as set_channel_features().
+		void set_connect_buffer(size_t max_bytes, DWORD ttl = INFINITE) {
+			connect_buffer_limit_ = max_bytes;
+			connect_buffer_ttl_ = ttl;
+		}
+
+		// Passes received messages to the listener on the workers of
+		// |dispatcher| instead of the IO thread. Messages with the same key
+		// are handled in the order they arrived, by default the key is the
+		// routing id. OnChannelConnected() and OnChannelError() still run on
+		// the IO thread and can overtake messages waiting for a worker. Same
+		// rules as set_channel_features(), |dispatcher| must outlive the
+		// endpoint, which must not be destroyed by one of its workers.
+		void set_dispatcher(Dispatcher* dispatcher,
+			const DispatchKey& key = DispatchKey());
+
+		bool IsConnected() const { return is_connected_ != 0; }
+
+		// Copies what the channel agreed on with the peer in the hello, see
+		// Channel::Capabilities. Returns false while not connected. Can be
+		// called on any thread, also from OnChannelConnected().
+		bool GetCapabilities(Channel::Capabilities* caps) const;
+
+		// See Thread::SetBusyPolling(). Applies to the IO thread, which
+		// endpoints from a ThreadPool share with others.
+		void set_busy_polling(uint32 max_spin) { thread_->SetBusyPolling(max_spin); }
+
+		// Spin and block times of the IO thread, see Thread::PollingStats.
+		void GetPollingStats(Thread::PollingStats* stats) const {
+			thread_->GetPollingStats(stats);
+		}
+
+		// Copies the output counters of the current channel. Returns false if
+		// there is no channel. Blocks until the IO thread answered, so it must
+		// not be called from the listener callbacks.
+		bool GetOutputStats(Channel::OutputStats* stats);
+
+		// Can be called on any thread. Messages sent from other threads are
+		// queued without a lock and handed to the channel in batches, on the
+		// IO thread they go to the channel right away. While the channel is
+		// not connected they go to the connect buffer, see
+		// set_connect_buffer(), and fail without one. Messages bigger than
+		// the peer takes, see GetCapabilities(), fail.
+		virtual bool Send(Message* message) override;
+
+		// Sends |message| like Send() unless the output is above a high
+		// watermark. Then it returns SEND_WOULD_BLOCK and leaves |message|
+		// alone, the caller needs a reference of its own to send it later.
+		// |on_writable|, if set, runs once on the IO thread when the output
+		// drained to the low watermarks or the channel failed, unless the
+		// endpoint is destroyed first. Can be called on any thread.
+		SendStatus TrySend(Message* message,
+			const std::function<void()>& on_writable = std::function<void()>());
+
+		// Sends |message| as a synchronous message and blocks until the peer
+		// answers it with a reply made by Message::GenerateReply(), the channel
+		// fails or |timeout| milliseconds pass. On success |*reply| receives the
+		// reply with a reference the caller has to release.
+		//
+		// Messages with UNBLOCK_BIT set that arrive meanwhile are passed to the
+		// listener on the waiting thread, so a peer that needs this thread
+		// before it can answer does not deadlock. Must not be called on the IO
+		// thread, which includes the listener callbacks.
+		bool SendSync(Message* message, Message** reply, DWORD timeout);
+
+		// Sends |message| as a request like SendSync() but returns right away.
+		// |callback| runs exactly once: on the IO thread when the reply comes
+		// in, the channel fails or the call times out, or on the thread that
+		// cancelled the call. Returns the id of the call, or 0 if the request
+		// could not be sent, in which case |callback| is not run.
+		uint32 CallAsync(Message* message, const ReplyCallback& callback,
+			DWORD timeout);
+
+		// Same as above, the result is delivered through the returned future.
+		// |call_id|, if not NULL, receives the id of the call.
+		std::future<CallResult> CallAsync(Message* message, DWORD timeout,
+			uint32* call_id = NULL);
+
+		// Finishes the call with CALL_CANCELLED unless it already finished.
+		// Returns true if it was cancelled.
+		bool CancelCall(uint32 call_id);
+
+		virtual bool OnMessageReceived(Message* message) override;
+
+		virtual void OnChannelConnected(int32 peer_pid) override;
+
+		virtual void OnChannelError() override;
+
+		virtual void OnChannelStreamReset() override;
+
+		virtual void OnChannelOutputBlocked(bool blocked) override;
+
+	private:
+		void CreateChannel();
+		struct OutgoingMessage;
+		// Takes the messages queued by Send(), oldest first.
+		OutgoingMessage* TakeOutgoingMessages();
+		// Passes the queued messages to the channel, or drops them if there
+		// is none, then the connect buffer. The queued ones were sent first.
+		void FlushOutgoingMessages();
+		// Same for the queued messages only, |keep| hands them to the
+		// session instead. IO thread only.
+		void SendOutgoingMessages(bool keep);
+		// Keeps |message| for the next channel and sets |buffered|, false
+		// if the connect buffer is off or full. Returns false if the
+		// endpoint connected meanwhile, the message is sent instead.
+		bool BufferMessage(Message* message, bool* buffered);
+		// Drops the buffered messages that expired by |now|. Called with
+		// |lock_| held.
+		void ExpireConnectBuffer(uint64 now);
+		// Passes the buffered messages to the channel unless it still waits
+		// for its peer to connect. IO thread only.
+		void FlushConnectBuffer();
+		void CloseChannel(WaitableEvent* wait_event);
+		void ReadOutputStats(Channel::OutputStats* stats, bool* result,
+			WaitableEvent* wait_event);
+		void SetConnected(bool c);
+
+		bool IsOutputBlocked() const;
+		// Runs the callbacks of TrySend() unless the output is still
+		// blocked. IO thread only.
+		void NotifyWritable();
+
+		struct PendingSync;
+		struct PendingCall;
+		// Hands |reply| to the SendSync() or CallAsync() waiting for it, if any.
+		void DispatchReply(Message* reply);
+		// Queues |message| for the most recent SendSync() still waiting.
+		// Returns false if there is none.
+		bool DispatchUnblockMessage(Message* message);
+		// Passes |message| to the listener and answers a synchronous message
+		// the listener did not handle with an error reply.
+		void DispatchToListener(Message* message);
+		// Wakes up all SendSync() calls without a reply.
+		void FailPendingSyncs();
+
+		// Hands |message| to |dispatch_queue_| and pauses reading if the
+		// workers fall behind.
+		void DispatchLater(Message* message);
+		void DispatchQueued(scoped_refptr<Message> message);
+		// Runs on a worker when the backlog dropped to kDispatchLowWatermark.
+		void OnDispatchBacklogLow();
+		void ResumeReading();
+
+		uint32 NextRequestId();
+		PendingCall* GetPendingCalls();
+		// Takes the CallAsync() with |call_id| out of the table. Returns NULL
+		// if it already finished.
+		PendingCall* ClaimCall(uint32 call_id);
+		// Returns the slot of a call taken by ClaimCall() to the table and runs
+		// its callback.
+		void FinishCall(PendingCall* call, CallStatus status, Message* reply);
+		// Finishes the calls whose deadline passed, or all calls if |all|.
+		// Returns the earliest deadline of the calls left, 0 if there is
+		// none or the check was skipped.
+		uint64 ExpireCalls(bool all);
+		// Makes sure |expiry_timer_| fires by |deadline|. IO thread only.
+		void ArmExpiryTimer(uint64 deadline);
+		void OnExpiryTimer();
+		std::string name_;
+		// Owned unless it came from |pool_|.
+		Thread* thread_;
+		ThreadPool* pool_;
+
+		Channel* channel_;
+		uint32 channel_features_;
+		// Carries Channel::FEATURE_RELIABLE from one channel to the next.
+		Session session_;
+		Channel::OutputScheduling output_scheduling_;
+		Listener* listener_;
+		//std::queue
+
+		// Set by set_dispatcher().
+		Dispatcher::Queue* dispatch_queue_;
+		DispatchKey dispatch_key_;
+		// Set while the channel does not read because of the backlog.
+		volatile LONG reading_paused_;
+
+		mutable Lock lock_;
+		volatile LONG is_connected_;
+		// Agreed by the last channel that connected, guarded by |lock_|.
+		// The message size is kept apart for Send().
+		Channel::Capabilities capabilities_;
+		volatile LONG max_message_size_;
+		// Set by the destructor, no channel is created afterwards.
+		bool closing_;
+
+		// OutgoingMessage list of Send() calls from other threads, most
+		// recent first. A push onto the empty list posts the flush.
+		void* volatile outgoing_head_;
+		// Size and number of the messages in the list.
+		volatile LONG outgoing_bytes_;
+		volatile LONG outgoing_messages_;
+
+		// Messages Send() took while the channel was not connected, oldest
+		// first, guarded by |lock_|.
+		struct BufferedMessage {
+			Message* message;
+			// MonotonicMicroseconds() when it expires, 0 for never.
+			uint64 deadline;
+		};
+		std::deque<BufferedMessage> connect_buffer_;
+		size_t connect_buffer_bytes_;
+		size_t connect_buffer_limit_;
+		DWORD connect_buffer_ttl_;
+
+		Channel::OutputLimits output_limits_;
+		// Set while the channel reports its output blocked.
+		volatile LONG output_blocked_;
+		// Callbacks of TrySend() calls that would have blocked, guarded by
+		// |lock_|. |writable_waiters_| is set while there are some.
+		std::vector<std::function<void()> > writable_callbacks_;
+		volatile LONG writable_waiters_;
+
+		// SendSync() calls waiting for their reply, most recent last.
+		Lock sync_lock_;
+		std::vector<PendingSync*> pending_syncs_;
+		volatile LONG next_request_id_;
+
+		// CallAsync() calls by request id modulo kMaxPendingCalls, allocated
+		// with the first call. The state of a slot is 0 when free, the request
+		// id of its call, or kCallSlotBusy while a thread owns it. Threads take
+		// slots over with a compare and swap of the state, no lock is needed.
+		PendingCall* volatile pending_calls_;
+		uint64 next_expiry_check_;
+
+		// Fires at the earliest deadline of the calls, at |expiry_deadline_|.
+		Thread::Timer expiry_timer_;
+		uint64 expiry_deadline_;
+	};
 }
\ No newline at end of file
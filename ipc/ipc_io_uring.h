@@ -0,0 +1,84 @@
+#pragma once
+#include "ipc/ipc_common.h"
+
+#include <linux/io_uring.h>
+
+#include <deque>
+
+namespace IPC
+{
+	// The few parts of io_uring the Thread backend needs, on top of the raw
+	// system calls. Entries are queued by GetSqe() and go to the kernel with
+	// the next Submit(), usually together with the wait for completions, so
+	// a single system call covers any number of requests. Completions are
+	// picked up from the shared ring without a system call.
+	//
+	// Linux only, and only used by the thread that owns the ring.
+	class IoUring
+	{
+	public:
+		IoUring();
+		~IoUring();
+
+		// Sets up a ring with room for |entries| requests. Returns false if
+		// the kernel has no io_uring, or one without multishot poll and
+		// timed waits.
+		bool Init(unsigned entries);
+		void Close();
+
+		bool is_valid() const { return ring_fd_ != -1; }
+
+		// Returns a zeroed entry to fill in, submitting the queued ones
+		// first if the queue is full. NULL if that did not help.
+		io_uring_sqe* GetSqe();
+
+		// Like GetSqe(), but never fails. While the kernel takes no more
+		// entries, until the completions were reaped, the entry waits aside
+		// and goes in with a later Submit(), in order.
+		io_uring_sqe* GetSqeOrDefer();
+
+		// Entries queued and not submitted yet, the deferred ones included.
+		unsigned pending() const;
+
+		// Submits the queued entries and, if |wait| is true, waits until a
+		// completion is ready or |timeout| milliseconds passed. Returns
+		// false on an error other than a timeout or an interruption.
+		bool Submit(bool wait, DWORD timeout);
+
+		// Returns the oldest completion, NULL if there is none. It stays
+		// valid until PopCqe().
+		io_uring_cqe* PeekCqe();
+		void PopCqe();
+
+		// True while completions wait in the kernel because the ring was
+		// full. Submit(true, 0) moves them over.
+		bool cq_overflowed() const;
+
+	private:
+		int ring_fd_;
+
+		void* sq_ring_;
+		size_t sq_ring_size_;
+		void* cq_ring_;
+		size_t cq_ring_size_;
+		io_uring_sqe* sqes_;
+		size_t sqes_size_;
+
+		unsigned* sq_head_;
+		unsigned* sq_tail_;
+		unsigned* sq_flags_;
+		unsigned sq_mask_;
+		unsigned sq_entries_;
+		// Tail including the entries not published yet.
+		unsigned sqe_tail_;
+		// Entries GetSqeOrDefer() found no room for, oldest first.
+		std::deque<io_uring_sqe> deferred_sqes_;
+
+		unsigned* cq_head_;
+		unsigned* cq_tail_;
+		unsigned cq_mask_;
+		io_uring_cqe* cqes_;
+
+		DISALLOW_COPY_AND_ASSIGN(IoUring);
+	};
+}
@@ -0,0 +1,227 @@
+#include "ipc/ipc_io_uring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace IPC
+{
+	namespace
+	{
+		// Kernel features the Thread backend relies on: completions are
+		// never dropped, waits take a timeout, and IORING_FEAT_RSRC_TAGS
+		// came with the same release as multishot poll.
+		const unsigned kRequiredFeatures = IORING_FEAT_NODROP |
+			IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS;
+
+		template <typename T>
+		T* RingField(void* ring, unsigned offset)
+		{
+			return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+		}
+	}
+
+	IoUring::IoUring()
+		: ring_fd_(-1)
+		, sq_ring_(MAP_FAILED)
+		, sq_ring_size_(0)
+		, cq_ring_(MAP_FAILED)
+		, cq_ring_size_(0)
+		, sqes_(static_cast<io_uring_sqe*>(MAP_FAILED))
+		, sqes_size_(0)
+		, sq_head_(NULL)
+		, sq_tail_(NULL)
+		, sq_flags_(NULL)
+		, sq_mask_(0)
+		, sq_entries_(0)
+		, sqe_tail_(0)
+		, cq_head_(NULL)
+		, cq_tail_(NULL)
+		, cq_mask_(0)
+		, cqes_(NULL)
+	{
+	}
+
+	IoUring::~IoUring()
+	{
+		Close();
+	}
+
+	bool IoUring::Init(unsigned entries)
+	{
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CLAMP;
+		ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+		if (ring_fd_ == -1)
+			return false;
+		if ((params.features & kRequiredFeatures) != kRequiredFeatures) {
+			Close();
+			return false;
+		}
+
+		sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			if (cq_ring_size_ > sq_ring_size_)
+				sq_ring_size_ = cq_ring_size_;
+			cq_ring_size_ = 0;
+		}
+		sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+		if (sq_ring_ == MAP_FAILED) {
+			Close();
+			return false;
+		}
+		void* cq_ring = sq_ring_;
+		if (cq_ring_size_) {
+			cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+			if (cq_ring_ == MAP_FAILED) {
+				Close();
+				return false;
+			}
+			cq_ring = cq_ring_;
+		}
+		sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+		sqes_ = static_cast<io_uring_sqe*>(mmap(NULL, sqes_size_,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+			IORING_OFF_SQES));
+		if (sqes_ == MAP_FAILED) {
+			Close();
+			return false;
+		}
+
+		sq_head_ = RingField<unsigned>(sq_ring_, params.sq_off.head);
+		sq_tail_ = RingField<unsigned>(sq_ring_, params.sq_off.tail);
+		sq_flags_ = RingField<unsigned>(sq_ring_, params.sq_off.flags);
+		sq_mask_ = *RingField<unsigned>(sq_ring_, params.sq_off.ring_mask);
+		sq_entries_ = *RingField<unsigned>(sq_ring_, params.sq_off.ring_entries);
+		sqe_tail_ = *sq_tail_;
+		// Entry i of the queue always uses sqes_[i].
+		unsigned* array = RingField<unsigned>(sq_ring_, params.sq_off.array);
+		for (unsigned i = 0; i < sq_entries_; ++i)
+			array[i] = i;
+
+		cq_head_ = RingField<unsigned>(cq_ring, params.cq_off.head);
+		cq_tail_ = RingField<unsigned>(cq_ring, params.cq_off.tail);
+		cq_mask_ = *RingField<unsigned>(cq_ring, params.cq_off.ring_mask);
+		cqes_ = RingField<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+		return true;
+	}
+
+	void IoUring::Close()
+	{
+		if (sqes_ != MAP_FAILED) {
+			munmap(sqes_, sqes_size_);
+			sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+		}
+		if (cq_ring_ != MAP_FAILED) {
+			munmap(cq_ring_, cq_ring_size_);
+			cq_ring_ = MAP_FAILED;
+		}
+		if (sq_ring_ != MAP_FAILED) {
+			munmap(sq_ring_, sq_ring_size_);
+			sq_ring_ = MAP_FAILED;
+		}
+		if (ring_fd_ != -1) {
+			close(ring_fd_);
+			ring_fd_ = -1;
+		}
+	}
+
+	io_uring_sqe* IoUring::GetSqe()
+	{
+		if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+			Submit(false, 0);
+			if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+				return NULL;
+		}
+		io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+		memset(sqe, 0, sizeof(*sqe));
+		++sqe_tail_;
+		return sqe;
+	}
+
+	io_uring_sqe* IoUring::GetSqeOrDefer()
+	{
+		if (deferred_sqes_.empty()) {
+			io_uring_sqe* sqe = GetSqe();
+			if (sqe)
+				return sqe;
+		}
+		deferred_sqes_.push_back(io_uring_sqe());
+		io_uring_sqe* sqe = &deferred_sqes_.back();
+		memset(sqe, 0, sizeof(*sqe));
+		return sqe;
+	}
+
+	unsigned IoUring::pending() const
+	{
+		return sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) +
+			static_cast<unsigned>(deferred_sqes_.size());
+	}
+
+	bool IoUring::Submit(bool wait, DWORD timeout)
+	{
+		unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+		while (!deferred_sqes_.empty() && sqe_tail_ - head < sq_entries_) {
+			sqes_[sqe_tail_ & sq_mask_] = deferred_sqes_.front();
+			deferred_sqes_.pop_front();
+			++sqe_tail_;
+		}
+		__atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+		unsigned to_submit = sqe_tail_ - head;
+
+		unsigned flags = 0;
+		void* arg = NULL;
+		size_t arg_size = 0;
+		struct __kernel_timespec ts;
+		struct io_uring_getevents_arg getevents_arg;
+		if (wait) {
+			flags |= IORING_ENTER_GETEVENTS;
+			if (timeout != INFINITE) {
+				ts.tv_sec = timeout / 1000;
+				ts.tv_nsec = (timeout % 1000) * 1000000LL;
+				memset(&getevents_arg, 0, sizeof(getevents_arg));
+				getevents_arg.sigmask_sz = _NSIG / 8;
+				getevents_arg.ts = reinterpret_cast<uint64>(&ts);
+				flags |= IORING_ENTER_EXT_ARG;
+				arg = &getevents_arg;
+				arg_size = sizeof(getevents_arg);
+			}
+		}
+		if (!to_submit && !wait)
+			return true;
+
+		long rv = syscall(__NR_io_uring_enter, ring_fd_, to_submit,
+			wait ? 1 : 0, flags, arg, arg_size);
+		if (rv >= 0)
+			return true;
+		// EBUSY and EAGAIN ask for completions to be reaped first.
+		return errno == ETIME || errno == EINTR || errno == EBUSY ||
+			errno == EAGAIN;
+	}
+
+	io_uring_cqe* IoUring::PeekCqe()
+	{
+		unsigned head = *cq_head_;
+		if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+			return NULL;
+		return &cqes_[head & cq_mask_];
+	}
+
+	void IoUring::PopCqe()
+	{
+		__atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+	}
+
+	bool IoUring::cq_overflowed() const
+	{
+		return (__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) &
+			IORING_SQ_CQ_OVERFLOW) != 0;
+	}
+}
@@ -26,6 +26,18 @@ class Listener {
   // This method is not called when a channel is closed normally.
   virtual void OnChannelError() {}
 
+  // Called with FEATURE_RELIABLE, right before OnChannelConnected(), when
+  // the messages kept for the peer outgrew the limits of the Session and
+  // were given up, or the peer did so or restarted. Messages sent before
+  // the last channel broke, either way, may not have arrived, the stream
+  // starts over from here.
+  virtual void OnChannelStreamReset() {}
+
+  // Called with true when the messages waiting to be written reached a high
+  // watermark of the channel, and with false once they drained to the low
+  // watermarks, see Channel::OutputLimits.
+  virtual void OnChannelOutputBlocked(bool blocked) {}
+
  protected:
   virtual ~Listener() {}
 };
@@ -3,9 +3,11 @@
 // found in the LICENSE file.
 
 #include "ipc/ipc_message.h"
+#include "ipc/ipc_message_pool.h"
 
 #include <cassert>
 #include <algorithm>
+#include <new>
 
 namespace {
 
@@ -38,17 +40,65 @@ namespace IPC {
 
 //------------------------------------------------------------------------------
 
+MessageBuffer::MessageBuffer(size_t capacity)
+	: capacity_(capacity)
+	, ref_count_(1) {
+}
+
+// static
+MessageBuffer* MessageBuffer::Create(size_t capacity)
+{
+	size_t size;
+	void* p = MessagePool::Allocate(sizeof(MessageBuffer) + capacity, &size);
+	if (!p)
+		return NULL;
+	// Hand out the whole size class, the reader makes good use of the slack.
+	return new (p) MessageBuffer(size - sizeof(MessageBuffer));
+}
+
+void MessageBuffer::AddRef() const
+{
+	InterlockedIncrement(&ref_count_);
+}
+
+void MessageBuffer::Release() const
+{
+	if (InterlockedDecrement(&ref_count_) == 0)
+	{
+		this->~MessageBuffer();
+		MessagePool::Free(const_cast<MessageBuffer*>(this));
+	}
+}
+
+bool MessageBuffer::HasOneRef() const
+{
+	return InterlockedExchangeAdd(&ref_count_, 0) == 1;
+}
+
+//------------------------------------------------------------------------------
+
 Message::~Message() {
-	if (capacity_ != kCapacityReadOnly)
-		free(header_);
+	if (capacity_ != kCapacityReadOnly && !is_inline())
+		MessagePool::Free(header_);
+	if (buffer_)
+		buffer_->Release();
+	if (segments_) {
+		for (size_t i = 0; i < segments_->size(); ++i) {
+			if ((*segments_)[i].release)
+				(*segments_)[i].release();
+		}
+		delete segments_;
+	}
 }
 
 Message::Message()
-	: header_(NULL)
-	, capacity_(0)
+	: header_(reinterpret_cast<Header*>(inline_buffer_))
+	, capacity_(kInlineCapacity)
 	, ref_count_(0)
-	, variable_buffer_offset_(0) {
-	Resize(kPayloadUnit);
+	, variable_buffer_offset_(0)
+	, buffer_(NULL)
+	, segments_(NULL)
+	, external_size_(0) {
 	
   header()->payload_size = 0;
   header()->routing = header()->type = 0;
@@ -60,11 +110,13 @@ Message::Message()
 }
 
 Message::Message(int32 routing_id, uint32 type, PriorityValue priority)
-	: header_(NULL)
-	, capacity_(0)
+	: header_(reinterpret_cast<Header*>(inline_buffer_))
+	, capacity_(kInlineCapacity)
 	, ref_count_(0)
-	, variable_buffer_offset_(0) {
-	Resize(kPayloadUnit);
+	, variable_buffer_offset_(0)
+	, buffer_(NULL)
+	, segments_(NULL)
+	, external_size_(0) {
 
   header()->payload_size = 0;
   header()->routing = routing_id;
@@ -80,7 +132,10 @@ Message::Message(const char* data, int data_len)
 	: header_(reinterpret_cast<Header*>(const_cast<char*>(data)))
 	, capacity_(kCapacityReadOnly)
 	, ref_count_(0)
-	, variable_buffer_offset_(0) {
+	, variable_buffer_offset_(0)
+	, buffer_(NULL)
+	, segments_(NULL)
+	, external_size_(0) {
 
 	if (kHeaderSize > static_cast<unsigned int>(data_len))
 		header_ = NULL;
@@ -91,6 +146,27 @@ Message::Message(const char* data, int data_len)
    InitLoggingVariables();
  }
 
+Message::Message(const char* data, int data_len, MessageBuffer* buffer)
+	: header_(reinterpret_cast<Header*>(const_cast<char*>(data)))
+	, capacity_(kCapacityReadOnly)
+	, ref_count_(0)
+	, variable_buffer_offset_(0)
+	, buffer_(buffer)
+	, segments_(NULL)
+	, external_size_(0) {
+	assert(data >= buffer->data() &&
+		data + data_len <= buffer->data() + buffer->capacity());
+	buffer_->AddRef();
+
+	if (kHeaderSize > static_cast<unsigned int>(data_len))
+		header_ = NULL;
+
+	if (header_ && header_->payload_size + kHeaderSize > static_cast<unsigned int>(data_len))
+		header_ = NULL;
+
+	InitLoggingVariables();
+}
+
 void Message::InitLoggingVariables() {
 #ifdef IPC_MESSAGE_LOG_ENABLED
   received_time_ = 0;
@@ -144,10 +220,13 @@ bool Message::Resize(size_t new_capacity)
 	new_capacity = AlignInt(new_capacity, kPayloadUnit);
 
 	assert(capacity_ != kCapacityReadOnly);
-	void* p = realloc(header_, new_capacity);
+	void* p = MessagePool::Allocate(new_capacity, &new_capacity);
 	if (!p)
 		return false;
 
+	memcpy(p, header_, kHeaderSize + header_->payload_size - external_size_);
+	if (!is_inline())
+		MessagePool::Free(header_);
 	header_ = reinterpret_cast<Header*>(p);
 	capacity_ = new_capacity;
 	return true;
@@ -167,6 +246,29 @@ const char* Message::FindNext(const char* range_start, const char* range_end)
 	return (payload_end > range_end) ? NULL : payload_end;
 }
 
+// static
+Message* Message::GenerateReply(const Message* request)
+{
+	assert(request->is_sync());
+	Message* reply = new Message(request->routing_id(), IPC_REPLY_ID,
+		PRIORITY_HIGH);
+	reply->set_reply();
+	reply->set_request_id(request->request_id());
+	return reply;
+}
+
+size_t Message::PeekMessageSize(const char* range_start,
+	const char* range_end)
+{
+	if (static_cast<size_t>(range_end - range_start) < sizeof(Header))
+		return 0;
+
+	const Header* hdr = reinterpret_cast<const Header*>(range_start);
+	if (hdr->payload_size > static_cast<size_t>(-1) - sizeof(Header))
+		return static_cast<size_t>(-1);
+	return sizeof(Header) + hdr->payload_size;
+}
+
 bool Message::WriteString(const std::string& value)
 {
 	if(!WriteInt(static_cast<int>(value.size())))
@@ -193,19 +295,89 @@ bool Message::WriteBytes(const void* data, int data_len)
 {
 	assert(kCapacityReadOnly != capacity_);
 
-	size_t offset = header_->payload_size;
+	// External segments are not stored in the buffer.
+	size_t offset = header_->payload_size - external_size_;
 
 	size_t new_size = offset + data_len;
 	size_t needed_size = sizeof(Header) + new_size;
 	if (needed_size > capacity_ && !Resize((std::max)(capacity_ * 2, needed_size)))
 		return false;
 
-	header_->payload_size = static_cast<uint32>(new_size);
+	header_->payload_size += data_len;
 	char* dest = const_cast<char*>(payload()) + offset;
 	memcpy(dest, data, data_len);
+
+	if (segments_) {
+		Segment& last = segments_->back();
+		if (!last.external) {
+			last.size += data_len;
+		} else {
+			Segment segment = {
+				NULL, kHeaderSize + offset, static_cast<size_t>(data_len)
+			};
+			segments_->push_back(segment);
+		}
+	}
+	return true;
+}
+
+bool Message::WriteExternalData(const char* data, int length,
+	const std::function<void()>& release)
+{
+	return length >= 0 && WriteInt(length) &&
+		WriteExternalBytes(data, length, release);
+}
+
+bool Message::WriteExternalBytes(const void* data, int data_len,
+	const std::function<void()>& release)
+{
+	assert(kCapacityReadOnly != capacity_);
+	if (data_len < 0)
+		return false;
+
+	if (!segments_) {
+		segments_ = new std::vector<Segment>;
+		Segment own = { NULL, 0, size() };
+		segments_->push_back(own);
+	}
+	Segment segment = {
+		static_cast<const char*>(data), 0, static_cast<size_t>(data_len), release
+	};
+	segments_->push_back(segment);
+	external_size_ += data_len;
+	header_->payload_size += data_len;
 	return true;
 }
 
+void Message::GetSegment(size_t index, const char** data, size_t* size) const
+{
+	if (!segments_) {
+		assert(index == 0);
+		*data = reinterpret_cast<const char*>(header_);
+		*size = this->size();
+		return;
+	}
+	const Segment& segment = (*segments_)[index];
+	*data = segment.external ? segment.external
+		: reinterpret_cast<const char*>(header_) + segment.offset;
+	*size = segment.size;
+}
+
+// static
+void* Message::operator new(size_t size)
+{
+	void* p = MessagePool::Allocate(size, NULL);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+// static
+void Message::operator delete(void* p)
+{
+	MessagePool::Free(p);
+}
+
 void Message::AddRef() const
 {
 	InterlockedIncrement(&ref_count_);
@@ -5,7 +5,9 @@
 #ifndef IPC_IPC_MESSAGE_H_
 #define IPC_IPC_MESSAGE_H_
 
+#include <functional>
 #include <string>
+#include <vector>
 
 #include "ipc/ipc_common.h"
 
@@ -13,11 +15,49 @@
 //#define IPC_MESSAGE_LOG_ENABLED
 #endif
 
+// Bytes, header included, a Message can hold before it allocates a buffer on
+// the heap. Must be a multiple of 32.
+#ifndef IPC_MESSAGE_INLINE_CAPACITY
+#define IPC_MESSAGE_INLINE_CAPACITY 192
+#endif
+
 namespace IPC {
 
 //------------------------------------------------------------------------------
 
 class Message;
+
+// A refcounted block of bytes received from a channel. Messages dispatched by
+// the channel point straight into it and hold a reference, so a listener can
+// keep a message, queue it to another thread or forward it without copying.
+// The memory comes from MessagePool and goes back there with the last
+// reference.
+class MessageBuffer {
+ public:
+  // Returns a buffer with a single reference and room for at least
+  // |capacity| bytes, or NULL if the heap is exhausted.
+  static MessageBuffer* Create(size_t capacity);
+
+  void AddRef() const;
+  void Release() const;
+
+  // True if the caller holds the only reference, in which case nobody else
+  // can look at the data.
+  bool HasOneRef() const;
+
+  char* data() { return reinterpret_cast<char*>(this + 1); }
+  size_t capacity() const { return capacity_; }
+
+ private:
+  explicit MessageBuffer(size_t capacity);
+  ~MessageBuffer() {}
+
+  size_t capacity_;
+  mutable LONG ref_count_;
+
+  DISALLOW_COPY_AND_ASSIGN(MessageBuffer);
+};
+
 class MessageReader
 {
 public:
@@ -87,9 +127,17 @@ class Message {
   // should be used on the message when initialized this way.
   Message(const char* data, int data_len);
 
+  // Same as above, but the message keeps a reference to |buffer|, which must
+  // contain |data|, for as long as it lives.
+  Message(const char* data, int data_len, MessageBuffer* buffer);
+
   void AddRef() const;
   void Release() const;
 
+  // Message objects come from MessagePool rather than the global heap.
+  static void* operator new(size_t size);
+  static void operator delete(void* p);
+
   // Returns the size of the Pickle's data.
   size_t size() const { return kHeaderSize + header_->payload_size; }
 
@@ -104,12 +152,24 @@ class Message {
   }
 
   // Returns the address of the byte immediately following the currently valid
-  // header + payload.
+  // header + payload. External segments are not part of that range.
   const char* end_of_payload() const {
 	  // This object may be invalid.
-	  return header_ ? payload() + payload_size() : NULL;
+	  return header_ ? payload() + payload_size() - external_size_ : NULL;
   }
 
+  // Returns the number of separate ranges of memory the message is sent
+  // from, see WriteExternalBytes(). A message without external segments is a
+  // single range covering data() and size().
+  size_t segment_count() const {
+    return segments_ ? segments_->size() : 1;
+  }
+
+  // Returns range |index|, the first one starts with the header.
+  void GetSegment(size_t index, const char** data, size_t* size) const;
+
+  bool has_external_segments() const { return segments_ != NULL; }
+
   PriorityValue priority() const {
     return static_cast<PriorityValue>(header()->flags & PRIORITY_MASK);
   }
@@ -156,6 +216,22 @@ class Message {
     return (header()->flags & UNBLOCK_BIT) != 0;
   }
 
+  // Synchronous messages and their replies carry the id of the request in
+  // the upper 24 bits of the flags, in place of the reference number.
+  static const uint32 kMaxRequestId = 0xFFFFFF;
+
+  void set_request_id(uint32 id) {
+    header()->flags = (header()->flags & 0xFF) | ((id & kMaxRequestId) << 8);
+  }
+
+  uint32 request_id() const {
+    return header()->flags >> 8;
+  }
+
+  // Creates the reply to the synchronous message |request|. It is sent like
+  // any other message, at PRIORITY_HIGH.
+  static Message* GenerateReply(const Message* request);
+
   // Tells the receiver that the caller is pumping messages while waiting
   // for the result.
   bool is_caller_pumping_messages() const {
@@ -213,6 +289,19 @@ class Message {
   // known size. See also WriteData.
   bool WriteBytes(const void* data, int data_len);
 
+  // Same as WriteData and WriteBytes, but the bytes are not copied. The
+  // channel writes them straight from |data|, so they have to stay valid and
+  // unchanged until the message is destroyed, at which point |release| is
+  // called if it is set. The peer receives the usual contiguous message.
+  //
+  // Use this for large bodies only, every external segment costs an entry in
+  // the gather write. External segments cannot be read back from this
+  // message with a MessageReader.
+  bool WriteExternalData(const char* data, int length,
+                         const std::function<void()>& release);
+  bool WriteExternalBytes(const void* data, int data_len,
+                          const std::function<void()>& release);
+
   // Used for async messages with no parameters.
   static void Log(std::string* name, const Message* msg, std::string* l) {
   }
@@ -222,6 +311,11 @@ class Message {
   // if the entire message is not found in the given data range.
   static const char* FindNext(const char* range_start, const char* range_end);
 
+  // Returns the size of the message that starts at range_start as announced
+  // by its header, or 0 if the header is not complete yet.
+  static size_t PeekMessageSize(const char* range_start,
+                                const char* range_end);
+
 #ifdef IPC_MESSAGE_LOG_ENABLED
   // Adds the outgoing time from Time::Now() at the end of the message and sets
   // a bit to indicate that it's been added.
@@ -273,6 +367,11 @@ class Message {
   // the return result for true (i.e., successful resizing).
   bool Resize(size_t new_capacity);
 
+  // True while the data lives in |inline_buffer_|.
+  bool is_inline() const {
+    return header_ == reinterpret_cast<const Header*>(inline_buffer_);
+  }
+
   // Aligns 'i' by rounding it up to the next multiple of 'alignment'
   static size_t AlignInt(size_t i, int alignment) {
 	  return i + (alignment - (i % alignment)) % alignment;
@@ -288,13 +387,35 @@ class Message {
   mutable bool dont_log_;
 #endif
   static const uint32 kHeaderSize;
+  static const size_t kInlineCapacity = IPC_MESSAGE_INLINE_CAPACITY;
 
   Header* header_;
   // Allocation size of payload (or -1 if allocation is const).
   size_t capacity_;
   size_t variable_buffer_offset_;  // IF non-zero, then offset to a buffer.
 
+  // Holds the data of a message received from a channel, may be NULL.
+  MessageBuffer* buffer_;
+
+  // A range of the message on the wire. Internal ranges live in |header_|
+  // at |offset|.
+  struct Segment {
+    const char* external;
+    size_t offset;
+    size_t size;
+    std::function<void()> release;
+  };
+
+  // NULL until the first external segment is written, the whole message is
+  // then described by the list.
+  std::vector<Segment>* segments_;
+  // Bytes of the payload in external segments.
+  size_t external_size_;
+
   mutable LONG ref_count_;
+
+  // Storage for small messages, declared as uint64 to keep the header aligned.
+  uint64 inline_buffer_[kInlineCapacity / sizeof(uint64)];
 };
 
 //------------------------------------------------------------------------------
@@ -0,0 +1,246 @@
+#include "ipc_message_pool.h"
+#include "ipc_utils.h"
+#include <cassert>
+
+namespace IPC
+{
+	namespace
+	{
+		// kMinPooledSize << i for every class i.
+		const int kSizeClassCount = 11;
+		const uint32 kLargeSizeClass = 0xFFFFFFFF;
+
+		// Upper bound on the bytes a thread keeps cached per size class. Small
+		// classes are further limited by kMaxCachedBlocks.
+		const size_t kMaxCachedBytes = 256 * 1024;
+		const size_t kMaxCachedBlocks = 256;
+		const size_t kMinCachedBlocks = 4;
+
+		struct ThreadCache;
+
+		// Precedes every block, keeps the payload 16 byte aligned.
+		struct BlockHeader {
+			ThreadCache* owner;
+			uint32 size_class;
+			uint32 reserved[sizeof(void*) == 8 ? 1 : 2];
+		};
+
+		// Overlays the payload of a block sitting in a free list.
+		struct FreeBlock {
+			FreeBlock* next;
+		};
+
+		struct ThreadCache {
+			FreeBlock* free_blocks[kSizeClassCount];
+			size_t free_count[kSizeClassCount];
+
+			// Blocks freed by other threads, pushed without a lock and taken
+			// all at once by the owner.
+			void* volatile remote_blocks;
+
+			// Set while no thread uses the cache. Caches are never deleted, so
+			// blocks freed long after their thread exited still have a valid
+			// place to go; an idle cache is adopted by the next new thread.
+			bool idle;
+			ThreadCache* next;
+
+			MessagePool::Stats stats;
+		};
+
+		Lock g_caches_lock;
+		ThreadCache* g_caches = NULL;
+
+		void ReleaseCache(ThreadCache* cache);
+		ThreadLocalPointer<ThreadCache> g_current_cache(&ReleaseCache);
+
+		size_t ClassSize(uint32 size_class)
+		{
+			return MessagePool::kMinPooledSize << size_class;
+		}
+
+		size_t MaxCachedBlocks(uint32 size_class)
+		{
+			size_t count = kMaxCachedBytes / ClassSize(size_class);
+			if (count > kMaxCachedBlocks)
+				return kMaxCachedBlocks;
+			return count < kMinCachedBlocks ? kMinCachedBlocks : count;
+		}
+
+		BlockHeader* HeaderFromBlock(void* p)
+		{
+			return reinterpret_cast<BlockHeader*>(p) - 1;
+		}
+
+		ThreadCache* GetCurrentCache()
+		{
+			ThreadCache* cache = g_current_cache.Get();
+			if (cache)
+				return cache;
+
+			{
+				AutoLock lock(g_caches_lock);
+				for (cache = g_caches; cache; cache = cache->next) {
+					if (cache->idle)
+						break;
+				}
+				if (!cache) {
+					cache = new ThreadCache;
+					memset(cache, 0, sizeof(*cache));
+					cache->next = g_caches;
+					g_caches = cache;
+				}
+				cache->idle = false;
+			}
+			g_current_cache.Set(cache);
+			return cache;
+		}
+
+		// Puts a block back into |cache|, which must belong to the calling
+		// thread, or frees it if the cache for its class is full.
+		void CacheBlock(ThreadCache* cache, void* p)
+		{
+			uint32 size_class = HeaderFromBlock(p)->size_class;
+			if (cache->free_count[size_class] >= MaxCachedBlocks(size_class)) {
+				free(HeaderFromBlock(p));
+				return;
+			}
+			FreeBlock* block = static_cast<FreeBlock*>(p);
+			block->next = cache->free_blocks[size_class];
+			cache->free_blocks[size_class] = block;
+			cache->free_count[size_class]++;
+		}
+
+		// Moves the blocks other threads handed back into the free lists.
+		void DrainRemoteBlocks(ThreadCache* cache)
+		{
+			FreeBlock* block = static_cast<FreeBlock*>(
+				InterlockedExchangePointer(&cache->remote_blocks, NULL));
+			while (block) {
+				FreeBlock* next = block->next;
+				CacheBlock(cache, block);
+				block = next;
+			}
+		}
+
+		void FlushCache(ThreadCache* cache)
+		{
+			DrainRemoteBlocks(cache);
+			for (int i = 0; i < kSizeClassCount; ++i) {
+				FreeBlock* block = cache->free_blocks[i];
+				while (block) {
+					FreeBlock* next = block->next;
+					free(HeaderFromBlock(block));
+					block = next;
+				}
+				cache->free_blocks[i] = NULL;
+				cache->free_count[i] = 0;
+			}
+		}
+
+		void ReleaseCache(ThreadCache* cache)
+		{
+			FlushCache(cache);
+			AutoLock lock(g_caches_lock);
+			cache->idle = true;
+		}
+	}
+
+	// static
+	void* MessagePool::Allocate(size_t size, size_t* capacity)
+	{
+		ThreadCache* cache = GetCurrentCache();
+
+		if (size > kMaxPooledSize) {
+			BlockHeader* header = static_cast<BlockHeader*>(
+				malloc(sizeof(BlockHeader) + size));
+			if (!header)
+				return NULL;
+			header->owner = NULL;
+			header->size_class = kLargeSizeClass;
+			cache->stats.large_allocations++;
+			if (capacity)
+				*capacity = size;
+			return header + 1;
+		}
+
+		uint32 size_class = 0;
+		while (ClassSize(size_class) < size)
+			++size_class;
+		if (capacity)
+			*capacity = ClassSize(size_class);
+
+		if (!cache->free_blocks[size_class])
+			DrainRemoteBlocks(cache);
+
+		FreeBlock* block = cache->free_blocks[size_class];
+		if (block) {
+			cache->free_blocks[size_class] = block->next;
+			cache->free_count[size_class]--;
+			cache->stats.hits++;
+			return block;
+		}
+
+		cache->stats.misses++;
+		BlockHeader* header = static_cast<BlockHeader*>(
+			malloc(sizeof(BlockHeader) + ClassSize(size_class)));
+		if (!header)
+			return NULL;
+		header->owner = cache;
+		header->size_class = size_class;
+		return header + 1;
+	}
+
+	// static
+	void MessagePool::Free(void* p)
+	{
+		if (!p)
+			return;
+
+		BlockHeader* header = HeaderFromBlock(p);
+		if (header->size_class == kLargeSizeClass) {
+			free(header);
+			return;
+		}
+
+		ThreadCache* cache = GetCurrentCache();
+		if (header->owner == cache) {
+			CacheBlock(cache, p);
+			return;
+		}
+
+		// Hand the block back to the thread that allocated it.
+		cache->stats.remote_frees++;
+		ThreadCache* owner = header->owner;
+		FreeBlock* block = static_cast<FreeBlock*>(p);
+		for (;;) {
+			void* head = owner->remote_blocks;
+			block->next = static_cast<FreeBlock*>(head);
+			if (InterlockedCompareExchangePointer(
+				&owner->remote_blocks, block, head) == head)
+				break;
+		}
+	}
+
+	// static
+	void MessagePool::GetStats(Stats* stats)
+	{
+		memset(stats, 0, sizeof(*stats));
+		AutoLock lock(g_caches_lock);
+		for (ThreadCache* cache = g_caches; cache; cache = cache->next) {
+			stats->hits += cache->stats.hits;
+			stats->misses += cache->stats.misses;
+			stats->remote_frees += cache->stats.remote_frees;
+			stats->large_allocations += cache->stats.large_allocations;
+		}
+	}
+
+	// static
+	void MessagePool::ReleaseThreadCache()
+	{
+		ThreadCache* cache = g_current_cache.Get();
+		if (!cache)
+			return;
+		g_current_cache.Set(NULL);
+		ReleaseCache(cache);
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include "ipc/ipc_common.h"
+
+namespace IPC
+{
+	// Allocator for Message objects and their payload buffers.
+	//
+	// Requests up to kMaxPooledSize bytes are rounded up to a power of two
+	// size class and served from a cache owned by the calling thread, without
+	// any locking. A block freed on another thread is handed back to the cache
+	// of the thread that allocated it through a lock-free list, which that
+	// thread picks up the next time it runs out of blocks. Larger requests go
+	// straight to the heap.
+	class MessagePool
+	{
+	public:
+		static const size_t kMinPooledSize = 64;
+		static const size_t kMaxPooledSize = 64 * 1024;
+
+		struct Stats {
+			// Allocations served from a thread cache.
+			uint64 hits;
+			// Pooled allocations that had to go to the heap.
+			uint64 misses;
+			// Blocks freed on a thread other than the one that allocated them.
+			uint64 remote_frees;
+			// Allocations larger than kMaxPooledSize.
+			uint64 large_allocations;
+		};
+
+		// Returns at least |size| bytes, or NULL if the heap is exhausted.
+		// |capacity|, if not NULL, receives the usable size of the block.
+		static void* Allocate(size_t size, size_t* capacity);
+
+		// Frees a block returned by Allocate(). Can be called on any thread.
+		static void Free(void* p);
+
+		// Sums up the counters of all thread caches. The counters are updated
+		// without synchronization, so the result is only approximate while
+		// other threads are allocating.
+		static void GetStats(Stats* stats);
+
+		// Returns the blocks cached by the calling thread to the heap. Threads
+		// exiting on POSIX do this automatically, on Windows it has to be
+		// called before a thread that allocated messages exits. ipc_dll
+		// calls it from DLL_THREAD_DETACH.
+		static void ReleaseThreadCache();
+	};
+}
@@ -0,0 +1,249 @@
+#include "ipc_server.h"
+#include "ipc/ipc_message.h"
+#include <algorithm>
+#include <cassert>
+
+namespace IPC
+{
+	Server::Client::Client(Server* server, Thread* thread, uint32 id)
+		: server_(server)
+		, thread_(thread)
+		, channel_(NULL)
+		, id_(id)
+		, peer_pid_(0)
+		, connected_(0)
+		, ref_count_(0)
+	{
+	}
+
+	Server::Client::~Client()
+	{
+		assert(!channel_);
+	}
+
+	void Server::Client::AddRef()
+	{
+		InterlockedIncrement(&ref_count_);
+	}
+
+	void Server::Client::Release()
+	{
+		if (InterlockedDecrement(&ref_count_) == 0)
+			delete this;
+	}
+
+	bool Server::Client::Send(Message* message)
+	{
+		scoped_refptr<Message> m(message);
+		if (!connected_)
+			return false;
+		thread_->PostTask(std::bind(&Client::SendOnThread,
+			scoped_refptr<Client>(this), m));
+		return true;
+	}
+
+	void Server::Client::Disconnect()
+	{
+		thread_->PostTask(std::bind(&Client::CloseOnThread,
+			scoped_refptr<Client>(this)));
+	}
+
+	// static
+	void Server::Client::SendOnThread(scoped_refptr<Client> client,
+		scoped_refptr<Message> message)
+	{
+		if (client->channel_)
+			client->channel_->Send(message.get());
+	}
+
+	// static
+	void Server::Client::CloseOnThread(scoped_refptr<Client> client)
+	{
+		client->Close();
+	}
+
+	void Server::Client::Close()
+	{
+		if (!channel_)
+			return;
+
+		delete channel_;
+		channel_ = NULL;
+		bool was_connected = InterlockedExchange(&connected_, 0) != 0;
+		server_->ClientClosed(this, was_connected);
+	}
+
+	bool Server::Client::OnMessageReceived(Message* message)
+	{
+		return server_->delegate_->OnClientMessage(this, message);
+	}
+
+	void Server::Client::OnChannelConnected(int32 peer_pid)
+	{
+		peer_pid_ = peer_pid;
+		InterlockedExchange(&connected_, 1);
+		server_->ClientConnected(this);
+	}
+
+	void Server::Client::OnChannelError()
+	{
+		Close();
+	}
+
+	Server::Server(const std::string& name, Delegate* delegate,
+		size_t thread_count)
+#if defined(OS_POSIX)
+		: acceptor_(this)
+		, listen_fd_(-1)
+		, accept_thread_(NULL)
+		, name_(name)
+#else
+		: name_(name)
+#endif
+		, delegate_(delegate)
+		, pool_(new ThreadPool(thread_count))
+		, owns_pool_(true)
+		, channel_features_(0)
+		, running_(false)
+		, next_client_id_(0)
+	{
+	}
+
+	Server::Server(const std::string& name, Delegate* delegate,
+		ThreadPool* pool)
+#if defined(OS_POSIX)
+		: acceptor_(this)
+		, listen_fd_(-1)
+		, accept_thread_(NULL)
+		, name_(name)
+#else
+		: name_(name)
+#endif
+		, delegate_(delegate)
+		, pool_(pool)
+		, owns_pool_(false)
+		, channel_features_(0)
+		, running_(false)
+		, next_client_id_(0)
+	{
+	}
+
+	Server::~Server()
+	{
+		Stop();
+		if (owns_pool_)
+			delete pool_;
+	}
+
+	bool Server::Start()
+	{
+		{
+			AutoLock lock(lock_);
+			if (running_)
+				return true;
+			running_ = true;
+		}
+		if (Listen())
+			return true;
+
+		Stop();
+		return false;
+	}
+
+	void Server::Stop()
+	{
+		{
+			AutoLock lock(lock_);
+			running_ = false;
+		}
+		StopListening();
+
+		// Clients are only added while running, so after the tasks below no
+		// client is left. The thread Stop() runs on, if it is one of the
+		// pool, closes its own clients, it could never get to the task.
+		for (size_t i = 0; i < pool_->thread_count(); ++i) {
+			Thread* thread = pool_->thread(i);
+			WaitableEvent wait_event(false, false);
+			if (thread->BelongsToCurrentThread()) {
+				thread->RunPendingTasks();
+				CloseClients(thread, &wait_event);
+				continue;
+			}
+			thread->PostTask(std::bind(&Server::CloseClients, this, thread,
+				&wait_event));
+			wait_event.Wait(INFINITE);
+		}
+	}
+
+	size_t Server::client_count() const
+	{
+		AutoLock lock(lock_);
+		size_t count = 0;
+		for (size_t i = 0; i < clients_.size(); ++i) {
+			if (clients_[i]->connected_)
+				++count;
+		}
+		return count;
+	}
+
+	bool Server::AddClient(const ChannelHandle& handle)
+	{
+		AutoLock lock(lock_);
+		if (!running_)
+			return false;
+
+		Thread* thread = pool_->Acquire();
+		Client* client = new Client(this, thread, ++next_client_id_);
+		client->AddRef();
+		clients_.push_back(client);
+		// Posted under the lock, so a CloseClients() posted by Stop() runs
+		// after the client opened.
+		thread->PostTask(std::bind(&Client::Open, client, handle));
+		return true;
+	}
+
+	void Server::ClientConnected(Client* client)
+	{
+#if defined(OS_WIN)
+		// The client took a waiting instance, put up a new one.
+		AddPendingInstance(false);
+#endif
+		delegate_->OnClientConnected(client);
+	}
+
+	void Server::ClientClosed(Client* client, bool was_connected)
+	{
+		{
+			AutoLock lock(lock_);
+			std::vector<Client*>::iterator it =
+				std::find(clients_.begin(), clients_.end(), client);
+			if (it == clients_.end())
+				return;
+			clients_.erase(it);
+		}
+
+		if (was_connected)
+			delegate_->OnClientDisconnected(client);
+#if defined(OS_WIN)
+		else  // The instance failed before a client showed up.
+			AddPendingInstance(false);
+#endif
+		pool_->Release(client->thread_);
+		client->Release();
+	}
+
+	void Server::CloseClients(Thread* thread, WaitableEvent* wait_event)
+	{
+		std::vector<Client*> clients;
+		{
+			AutoLock lock(lock_);
+			for (size_t i = 0; i < clients_.size(); ++i) {
+				if (clients_[i]->thread_ == thread)
+					clients.push_back(clients_[i]);
+			}
+		}
+		for (size_t i = 0; i < clients.size(); ++i)
+			clients[i]->Close();
+		wait_event->Signal();
+	}
+}
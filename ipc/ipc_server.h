@@ -0,0 +1,172 @@
+#pragma once
+#include "ipc/ipc_thread.h"
+#include "ipc/ipc_thread_pool.h"
+#include "ipc/ipc_channel.h"
+#include "ipc/ipc_listener.h"
+
+#include <vector>
+
+namespace IPC
+{
+	// Serves any number of clients on a single name. Every client that
+	// connects gets its own Channel, each new channel goes to the least
+	// loaded thread of a ThreadPool.
+	//
+	// Clients connect with a plain Endpoint of the same name. On Windows the
+	// server keeps kPendingInstances pipe instances waiting for them, on POSIX
+	// it accepts them from one listening socket on a thread of the pool.
+	class Server
+	{
+	public:
+		class Client;
+
+		// Called on the thread of the client, so callbacks for clients on
+		// different threads can run at the same time.
+		class Delegate {
+		public:
+			virtual ~Delegate() {}
+
+			// The hello exchange with |client| completed.
+			virtual void OnClientConnected(Client* client) {}
+
+			// Returns true iff the message was handled.
+			virtual bool OnClientMessage(Client* client, Message* message) = 0;
+
+			// |client| went away or was disconnected. It is released after
+			// this returns, AddRef() it to keep using the pointer.
+			virtual void OnClientDisconnected(Client* client) {}
+		};
+
+		class Client : public Sender, private Listener
+		{
+		public:
+			uint32 id() const { return id_; }
+			int32 peer_pid() const { return peer_pid_; }
+
+			// Can be called on any thread while the server is running. Returns
+			// false once the client disconnected.
+			virtual bool Send(Message* message) override;
+
+			// Drops the connection, OnClientDisconnected() follows on the
+			// thread of the client.
+			void Disconnect();
+
+			void AddRef();
+			void Release();
+
+		private:
+			friend class Server;
+
+			Client(Server* server, Thread* thread, uint32 id);
+			~Client();
+
+			// Takes over |handle| and connects a Channel on it. Runs on
+			// |thread_|.
+			void Open(const ChannelHandle& handle);
+			// Deletes the channel and tells the server. Runs on |thread_|.
+			void Close();
+
+			static void SendOnThread(scoped_refptr<Client> client,
+				scoped_refptr<Message> message);
+			static void CloseOnThread(scoped_refptr<Client> client);
+
+			virtual bool OnMessageReceived(Message* message) override;
+			virtual void OnChannelConnected(int32 peer_pid) override;
+			virtual void OnChannelError() override;
+
+			Server* server_;
+			Thread* thread_;
+			Channel* channel_;
+			uint32 id_;
+			int32 peer_pid_;
+			volatile LONG connected_;
+			volatile LONG ref_count_;
+		};
+
+#if defined(OS_WIN)
+		// Pipe instances waiting for a client at any time.
+		static const size_t kPendingInstances = 4;
+#else
+		// Connections the listening socket queues until they are accepted.
+		static const int kListenBacklog = 128;
+#endif
+
+		// Starts a pool of |thread_count| threads for the clients, one per
+		// processor if 0.
+		Server(const std::string& name, Delegate* delegate,
+			size_t thread_count = 1);
+
+		// Runs the clients on the threads of |pool|, which must outlive the
+		// server.
+		Server(const std::string& name, Delegate* delegate, ThreadPool* pool);
+		~Server();
+
+		// Begins to accept clients. Returns false if the name is already
+		// served by someone else.
+		bool Start();
+
+		// Stops accepting and disconnects all clients. No delegate callback
+		// runs after this returns. Can be called from a task of a thread of
+		// the pool, which then closes its clients itself, but still waits
+		// for the other threads. Not from a delegate callback.
+		void Stop();
+
+		// Optional Channel::Feature values offered to the clients connecting
+		// afterwards.
+		void set_channel_features(uint32 features) { channel_features_ = features; }
+
+		// Clients that completed the hello exchange and are still connected.
+		size_t client_count() const;
+
+	private:
+		// Creates a Client for |handle| on a thread of the pool. Returns false if
+		// the server is stopping, the caller still owns |handle| then.
+		bool AddClient(const ChannelHandle& handle);
+		void ClientConnected(Client* client);
+		// |client| lost its channel. Forgets it, unless Stop() got there
+		// first.
+		void ClientClosed(Client* client, bool was_connected);
+		// Closes the clients running on |thread|.
+		void CloseClients(Thread* thread, WaitableEvent* wait_event);
+
+		// Platform specific part of Start() and Stop().
+		bool Listen();
+		void StopListening();
+
+#if defined(OS_WIN)
+		// Creates one more pipe instance and a client waiting on it. Only the
+		// |first| instance insists on creating the name.
+		bool AddPendingInstance(bool first);
+#else
+		class Acceptor : public Thread::IOHandler {
+		public:
+			explicit Acceptor(Server* server) : server_(server) {}
+			virtual void OnIOCompleted(Thread::IOContext* context,
+				DWORD bytes_transfered, DWORD error) override;
+		private:
+			Server* server_;
+		};
+
+		void AcceptClients();
+		void RegisterListeningSocket();
+		void CloseListeningSocket(WaitableEvent* wait_event);
+
+		Acceptor acceptor_;
+		int listen_fd_;
+		// Taken from the pool while listening.
+		Thread* accept_thread_;
+#endif
+
+		std::string name_;
+		Delegate* delegate_;
+		ThreadPool* pool_;
+		bool owns_pool_;
+		uint32 channel_features_;
+
+		mutable Lock lock_;
+		bool running_;
+		// Every client with a channel, each holding a reference.
+		std::vector<Client*> clients_;
+		uint32 next_client_id_;
+	};
+}
@@ -0,0 +1,80 @@
+#include "ipc_server.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace IPC
+{
+	void Server::Client::Open(const ChannelHandle& handle)
+	{
+		// The channel works on a duplicate of the socket.
+		channel_ = new Channel(handle, this, thread_, server_->channel_features_);
+		close(handle.socket.fd);
+		if (!channel_->Connect())
+			Close();
+	}
+
+	void Server::Acceptor::OnIOCompleted(Thread::IOContext* context,
+		DWORD bytes_transfered, DWORD error)
+	{
+		if (context->events & EPOLLIN)
+			server_->AcceptClients();
+	}
+
+	bool Server::Listen()
+	{
+		listen_fd_ = Channel::CreateListeningSocket(name_, kListenBacklog);
+		if (listen_fd_ == -1)
+			return false;
+		accept_thread_ = pool_->Acquire();
+		accept_thread_->PostTask(std::bind(&Server::RegisterListeningSocket, this));
+		return true;
+	}
+
+	void Server::StopListening()
+	{
+		if (listen_fd_ == -1)
+			return;
+		WaitableEvent wait_event(false, false);
+		if (accept_thread_->BelongsToCurrentThread()) {
+			CloseListeningSocket(&wait_event);
+		} else {
+			accept_thread_->PostTask(std::bind(&Server::CloseListeningSocket,
+				this, &wait_event));
+			wait_event.Wait(INFINITE);
+		}
+		pool_->Release(accept_thread_);
+		accept_thread_ = NULL;
+	}
+
+	void Server::RegisterListeningSocket()
+	{
+		// Connections that queued up before are reported right away.
+		accept_thread_->RegisterIOHandler(listen_fd_, &acceptor_);
+	}
+
+	void Server::CloseListeningSocket(WaitableEvent* wait_event)
+	{
+		accept_thread_->UnregisterIOHandler(listen_fd_);
+		close(listen_fd_);
+		listen_fd_ = -1;
+		wait_event->Signal();
+	}
+
+	void Server::AcceptClients()
+	{
+		// Edge triggered, so take everything that is waiting.
+		for (;;) {
+			int fd = accept4(listen_fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd == -1) {
+				// Somebody connected and gave up again.
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				return;
+			}
+			if (!AddClient(ChannelHandle(fd)))
+				close(fd);
+		}
+	}
+}
@@ -0,0 +1,39 @@
+#include "ipc_server.h"
+
+namespace IPC
+{
+	void Server::Client::Open(const ChannelHandle& handle)
+	{
+		// The channel works on a duplicate of the pipe.
+		channel_ = new Channel(handle, this, thread_, server_->channel_features_);
+		CloseHandle(handle.pipe.handle);
+		if (!channel_->Connect())
+			Close();
+	}
+
+	bool Server::Listen()
+	{
+		if (!AddPendingInstance(true))
+			return false;
+		for (size_t i = 1; i < kPendingInstances; ++i)
+			AddPendingInstance(false);
+		return true;
+	}
+
+	void Server::StopListening()
+	{
+		// The waiting instances belong to clients and are closed with them.
+	}
+
+	bool Server::AddPendingInstance(bool first)
+	{
+		HANDLE pipe = Channel::CreateServerInstance(name_, first);
+		if (pipe == INVALID_HANDLE_VALUE)
+			return false;
+		if (!AddClient(ChannelHandle(pipe))) {
+			CloseHandle(pipe);
+			return false;
+		}
+		return true;
+	}
+}
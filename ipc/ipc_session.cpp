@@ -0,0 +1,152 @@
+#include "ipc_session.h"
+#include "ipc/ipc_message.h"
+
+#include <limits>
+
+namespace IPC
+{
+	namespace
+	{
+		uint64 NewStreamId()
+		{
+			// Never 0, which stands for no stream.
+			return RandGenerator((std::numeric_limits<uint64>::max)()) + 1;
+		}
+	}
+
+	Session::Session()
+		: id_(NewStreamId())
+		, previous_id_(0)
+		, peer_id_(0)
+		, received_(0)
+		, sent_(0)
+		, unacked_bytes_(0)
+		, overflowed_(false)
+		, stream_reset_(false)
+	{
+	}
+
+	Session::~Session()
+	{
+		Restart(id_);
+		std::vector<Message*> unsent;
+		TakeUnsent(&unsent);
+		for (size_t i = 0; i < unsent.size(); ++i)
+			unsent[i]->Release();
+	}
+
+	void Session::Restart(uint64 id)
+	{
+		while (!unacked_.empty()) {
+			unacked_.front()->Release();
+			unacked_.pop_front();
+		}
+		unacked_bytes_ = 0;
+		sent_ = 0;
+		overflowed_ = false;
+		id_ = id;
+	}
+
+	void Session::WillConnect()
+	{
+		if (overflowed_) {
+			previous_id_ = id_;
+			Restart(NewStreamId());
+			stream_reset_ = true;
+		}
+	}
+
+	bool Session::TakeStreamReset()
+	{
+		bool reset = stream_reset_;
+		stream_reset_ = false;
+		return reset;
+	}
+
+	void Session::DidSend(Message* message)
+	{
+		sent_++;
+		if (overflowed_)
+			return;
+		if (unacked_.size() >= kMaxUnackedMessages ||
+			unacked_bytes_ + message->size() > kMaxUnackedBytes) {
+			// The peer stopped acknowledging, a replay could not be complete
+			// anymore.
+			overflowed_ = true;
+			while (!unacked_.empty()) {
+				unacked_.front()->Release();
+				unacked_.pop_front();
+			}
+			unacked_bytes_ = 0;
+			return;
+		}
+		message->AddRef();
+		unacked_.push_back(message);
+		unacked_bytes_ += message->size();
+	}
+
+	void Session::KeepUnsent(Message* message)
+	{
+		message->AddRef();
+		unsent_.push_back(message);
+	}
+
+	void Session::TakeUnsent(std::vector<Message*>* unsent)
+	{
+		unsent->insert(unsent->end(), unsent_.begin(), unsent_.end());
+		unsent_.clear();
+	}
+
+	void Session::Acknowledge(uint64 count)
+	{
+		if (count > sent_)
+			count = sent_;
+		uint64 first = sent_ - unacked_.size() + 1;
+		while (!unacked_.empty() && first <= count) {
+			Message* m = unacked_.front();
+			unacked_.pop_front();
+			unacked_bytes_ -= m->size();
+			m->Release();
+			first++;
+		}
+	}
+
+	bool Session::Resume(uint64 peer_id, uint64 peer_received, uint64 echoed_id,
+		std::vector<Message*>* replay)
+	{
+		if (peer_id != peer_id_) {
+			// A new stream, the peer connected for the first time or
+			// restarted. What it did not write again of the old one is
+			// lost.
+			if (peer_id_)
+				stream_reset_ = true;
+			peer_id_ = peer_id;
+			received_ = 0;
+		}
+
+		if (previous_id_ && echoed_id == previous_id_) {
+			// The hello that started this stream crossed the one of the
+			// peer, which has yet to see any of it.
+			echoed_id = id_;
+			peer_received = 0;
+		}
+		if (echoed_id != id_ || peer_received > sent_) {
+			// The peer never saw this stream, what it missed was meant for
+			// an instance that is gone.
+			Restart(id_);
+			return true;
+		}
+		Acknowledge(peer_received);
+		if (sent_ - peer_received > unacked_.size()) {
+			// Messages the peer missed were given up, it counts the stream
+			// from scratch once it sees the new id.
+			overflowed_ = true;
+			return false;
+		}
+		for (size_t i = 0; i < unacked_.size(); ++i) {
+			unacked_[i]->AddRef();
+			replay->push_back(unacked_[i]);
+		}
+		return true;
+	}
+}
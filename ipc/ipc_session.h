@@ -0,0 +1,102 @@
+#pragma once
+#include "ipc/ipc_common.h"
+#include "ipc/ipc_utils.h"
+
+#include <deque>
+#include <vector>
+
+namespace IPC
+{
+	class Message;
+
+	// The state of Channel::FEATURE_RELIABLE that outlives a channel, so the
+	// next channel to the same peer picks up where the broken one stopped.
+	//
+	// Each side numbers the messages it puts on the wire and keeps them until
+	// the peer acknowledges them. The hello of a new channel tells the peer
+	// how many of its messages arrived, and the peer writes the rest again
+	// before anything else. A stream is named by a random id, so a peer that
+	// restarted is told apart from one that reconnected.
+	//
+	// Owned by Endpoint and lent to each channel it creates, only used on the
+	// IO thread.
+	class Session
+	{
+	public:
+		// Messages that may wait for an acknowledgement. Beyond either limit
+		// the messages not acknowledged are given up, and the next channel
+		// starts a new stream the peer counts from scratch. The listeners
+		// on both sides learn about it through
+		// Listener::OnChannelStreamReset().
+		static const size_t kMaxUnackedBytes = 16 * 1024 * 1024;
+		static const size_t kMaxUnackedMessages = 65536;
+
+		Session();
+		~Session();
+
+		// Called by the channel while it writes its hello. Starts a new
+		// stream if the old one gave up messages.
+		void WillConnect();
+
+		// True once after WillConnect() started a new stream, the peer may
+		// have missed messages of the old one, or Resume() saw the peer
+		// start one, this side may have.
+		bool TakeStreamReset();
+
+		// Id of the stream sent, and of the stream received, 0 until the
+		// first hello of the peer.
+		uint64 id() const { return id_; }
+		uint64 peer_id() const { return peer_id_; }
+
+		// Messages received on the stream of the peer.
+		uint64 received() const { return received_; }
+		void DidReceive() { received_++; }
+
+		// Keeps |message|, which was just put on the wire.
+		void DidSend(Message* message);
+
+		// Keeps |message|, given up with a broken channel before it was put
+		// on the wire. It does not count against the limits, the next
+		// channel queues it again like a new message.
+		void KeepUnsent(Message* message);
+		// Moves the messages KeepUnsent() kept to |unsent|, oldest first,
+		// each with a reference for the caller.
+		void TakeUnsent(std::vector<Message*>* unsent);
+
+		// The peer received the first |count| messages of the stream.
+		void Acknowledge(uint64 count);
+
+		// Takes the hello of the peer, which names its stream |peer_id| and
+		// received |peer_received| messages of the stream |echoed_id|.
+		// Fills |replay| with the messages to write again, oldest first,
+		// each with a reference for the caller. Returns false if some of
+		// them were given up, the channel has to go so that the next one
+		// starts a new stream.
+		bool Resume(uint64 peer_id, uint64 peer_received, uint64 echoed_id,
+			std::vector<Message*>* replay);
+
+	private:
+		// Forgets the messages kept, and starts the stream over as |id|.
+		void Restart(uint64 id);
+
+		uint64 id_;
+		// The stream WillConnect() gave up last, the peer may still echo it.
+		uint64 previous_id_;
+		uint64 peer_id_;
+		uint64 received_;
+
+		// Messages put on the wire, and those of them the peer did not
+		// acknowledge yet, oldest first.
+		uint64 sent_;
+		std::deque<Message*> unacked_;
+		size_t unacked_bytes_;
+		// See KeepUnsent(), oldest first.
+		std::deque<Message*> unsent_;
+		// Set when the limits were hit, see WillConnect().
+		bool overflowed_;
+		// See TakeStreamReset().
+		bool stream_reset_;
+
+		DISALLOW_COPY_AND_ASSIGN(Session);
+	};
+}
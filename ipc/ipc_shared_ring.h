@@ -0,0 +1,97 @@
+#pragma once
+#include "ipc/ipc_common.h"
+
+#include <atomic>
+
+namespace IPC
+{
+	// A single-producer single-consumer byte ring living in memory shared by two
+	// processes. The producer side is created by the process that writes into
+	// the ring and handed to the reading process as a memfd together with two
+	// eventfd doorbells: |data_fd| wakes the reader after new bytes were
+	// published, |space_fd| wakes the writer after bytes were consumed.
+	//
+	// Doorbells are only rung when the other side announced it is about to
+	// sleep, so a busy pair of endpoints exchanges data without any syscall.
+	class SharedRing
+	{
+	public:
+		// Default size of the data area, must be a power of two.
+		static const uint32 kDefaultCapacity = 1024 * 1024;
+
+		SharedRing();
+		~SharedRing();
+
+		// Creates a new ring and the descriptors describing it. The ring keeps
+		// ownership of the descriptors.
+		bool Create(uint32 capacity);
+
+		// Maps a ring created by the peer. Takes ownership of the descriptors.
+		bool Attach(int memory_fd, int data_fd, int space_fd);
+
+		void Close();
+
+		bool is_valid() const { return control_ != NULL; }
+
+		int memory_fd() const { return memory_fd_; }
+		int data_fd() const { return data_fd_; }
+		int space_fd() const { return space_fd_; }
+
+		// Producer side. Copies up to |len| bytes into the ring and returns how
+		// many were copied, zero when the ring is full.
+		size_t Write(const char* data, size_t len);
+
+		// Consumer side. Copies up to |len| bytes out of the ring and returns how
+		// many were copied, zero when the ring is empty. Returns -1 if the peer
+		// corrupted the ring indices.
+		int Read(char* buffer, size_t len);
+
+		// Called by the consumer when Read() returned zero. Returns true if the
+		// consumer may go to sleep and wait for |data_fd|; false if data arrived
+		// in the meantime and it should read again.
+		bool PrepareReaderSleep();
+
+		// Called by the producer when Write() returned zero. Returns true if the
+		// producer may go to sleep and wait for |space_fd|; false if space was
+		// freed in the meantime.
+		bool PrepareWriterSleep();
+
+		// Rings |data_fd| if the consumer is sleeping.
+		void WakeReader();
+
+		// Rings |space_fd| if the producer is sleeping.
+		void WakeWriter();
+
+		// Resets the counter of a doorbell after it was signaled.
+		static void DrainDoorbell(int fd);
+
+	private:
+		// Lives at the start of the shared mapping. Indices are free-running byte
+		// counters, the producer and consumer indices are kept on separate cache
+		// lines.
+		struct Control {
+			std::atomic<uint64> write_index;
+			char pad0[56];
+			std::atomic<uint64> read_index;
+			char pad1[56];
+			std::atomic<uint32> reader_sleeping;
+			std::atomic<uint32> writer_sleeping;
+			uint32 capacity;
+		};
+
+		static const size_t kDataOffset = 256;
+
+		bool Map(uint32 capacity);
+
+		Control* control_;
+		char* data_;
+		uint32 capacity_;
+		size_t mapped_size_;
+
+		int memory_fd_;
+		int data_fd_;
+		int space_fd_;
+
+		DISALLOW_COPY_AND_ASSIGN(SharedRing);
+	};
+}
@@ -0,0 +1,201 @@
+#include "ipc/ipc_shared_ring.h"
+
+#include <cassert>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace IPC
+{
+	SharedRing::SharedRing()
+		: control_(NULL)
+		, data_(NULL)
+		, capacity_(0)
+		, mapped_size_(0)
+		, memory_fd_(-1)
+		, data_fd_(-1)
+		, space_fd_(-1)
+	{
+	}
+
+	SharedRing::~SharedRing()
+	{
+		Close();
+	}
+
+	bool SharedRing::Create(uint32 capacity)
+	{
+		assert(!is_valid());
+		assert(capacity && (capacity & (capacity - 1)) == 0);
+
+		memory_fd_ = memfd_create("ipc-ring", MFD_CLOEXEC);
+		data_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		space_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (memory_fd_ == -1 || data_fd_ == -1 || space_fd_ == -1 ||
+			ftruncate(memory_fd_, kDataOffset + capacity) == -1 ||
+			!Map(capacity)) {
+			Close();
+			return false;
+		}
+
+		// A fresh memfd is zero filled, only the capacity needs publishing.
+		control_->capacity = capacity;
+		return true;
+	}
+
+	bool SharedRing::Attach(int memory_fd, int data_fd, int space_fd)
+	{
+		assert(!is_valid());
+		memory_fd_ = memory_fd;
+		data_fd_ = data_fd;
+		space_fd_ = space_fd;
+
+		// The size of the mapping comes from the kernel rather than from the
+		// shared header, which the peer could have scribbled over.
+		struct stat st;
+		if (fstat(memory_fd_, &st) == -1 ||
+			st.st_size <= static_cast<off_t>(kDataOffset) ||
+			st.st_size - kDataOffset > 0x80000000u) {
+			Close();
+			return false;
+		}
+		uint32 capacity = static_cast<uint32>(st.st_size - kDataOffset);
+		if ((capacity & (capacity - 1)) != 0 || !Map(capacity)) {
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	bool SharedRing::Map(uint32 capacity)
+	{
+		size_t size = kDataOffset + capacity;
+		void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			memory_fd_, 0);
+		if (p == MAP_FAILED)
+			return false;
+
+		control_ = static_cast<Control*>(p);
+		data_ = static_cast<char*>(p) + kDataOffset;
+		capacity_ = capacity;
+		mapped_size_ = size;
+		return true;
+	}
+
+	void SharedRing::Close()
+	{
+		if (control_) {
+			munmap(control_, mapped_size_);
+			control_ = NULL;
+			data_ = NULL;
+		}
+		int* fds[] = { &memory_fd_, &data_fd_, &space_fd_ };
+		for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+			if (*fds[i] != -1) {
+				close(*fds[i]);
+				*fds[i] = -1;
+			}
+		}
+	}
+
+	size_t SharedRing::Write(const char* data, size_t len)
+	{
+		uint64 write_index = control_->write_index.load(std::memory_order_relaxed);
+		uint64 read_index = control_->read_index.load(std::memory_order_acquire);
+		uint64 used = write_index - read_index;
+		if (used >= capacity_)
+			return 0;
+
+		size_t amount = static_cast<size_t>(capacity_ - used);
+		if (amount > len)
+			amount = len;
+
+		size_t offset = static_cast<size_t>(write_index & (capacity_ - 1));
+		size_t first = capacity_ - offset;
+		if (first > amount)
+			first = amount;
+		memcpy(data_ + offset, data, first);
+		memcpy(data_, data + first, amount - first);
+
+		control_->write_index.store(write_index + amount);
+		return amount;
+	}
+
+	int SharedRing::Read(char* buffer, size_t len)
+	{
+		uint64 read_index = control_->read_index.load(std::memory_order_relaxed);
+		uint64 write_index = control_->write_index.load(std::memory_order_acquire);
+		uint64 available = write_index - read_index;
+		if (available > capacity_)
+			return -1;
+
+		size_t amount = static_cast<size_t>(available);
+		if (amount > len)
+			amount = len;
+		if (amount > 0x7fffffff)
+			amount = 0x7fffffff;
+
+		size_t offset = static_cast<size_t>(read_index & (capacity_ - 1));
+		size_t first = capacity_ - offset;
+		if (first > amount)
+			first = amount;
+		memcpy(buffer, data_ + offset, first);
+		memcpy(buffer + first, data_, amount - first);
+
+		control_->read_index.store(read_index + amount);
+		return static_cast<int>(amount);
+	}
+
+	bool SharedRing::PrepareReaderSleep()
+	{
+		// Announce the sleep before looking at the indices one last time. The
+		// writer publishes before checking the flag, so either we see its data
+		// or it sees the flag. Both sides use sequentially consistent accesses.
+		control_->reader_sleeping.store(1);
+		if (control_->write_index.load() != control_->read_index.load()) {
+			control_->reader_sleeping.store(0);
+			return false;
+		}
+		return true;
+	}
+
+	bool SharedRing::PrepareWriterSleep()
+	{
+		control_->writer_sleeping.store(1);
+		if (control_->write_index.load() - control_->read_index.load() <
+			capacity_) {
+			control_->writer_sleeping.store(0);
+			return false;
+		}
+		return true;
+	}
+
+	void SharedRing::WakeReader()
+	{
+		if (control_->reader_sleeping.load() &&
+			control_->reader_sleeping.exchange(0)) {
+			uint64 value = 1;
+			ssize_t rv = write(data_fd_, &value, sizeof(value));
+			(void)rv;
+		}
+	}
+
+	void SharedRing::WakeWriter()
+	{
+		if (control_->writer_sleeping.load() &&
+			control_->writer_sleeping.exchange(0)) {
+			uint64 value = 1;
+			ssize_t rv = write(space_fd_, &value, sizeof(value));
+			(void)rv;
+		}
+	}
+
+	// static
+	void SharedRing::DrainDoorbell(int fd)
+	{
+		uint64 value;
+		while (read(fd, &value, sizeof(value)) > 0) {}
+	}
+}
@@ -1,226 +1,481 @@
-#include "ipc_thread.h"
-#include <cassert>
-
-namespace IPC
-{
-	Thread::Thread()
-		: thread_(NULL)
-		, should_quit_(false)
-	{
-		io_port_ = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, NULL, 1);
-	}
-
-	Thread::~Thread()
-	{
-		::CloseHandle(io_port_);
-	}
-
-	void Thread::RegisterIOHandler(HANDLE file, IOHandler* handler)
-	{
-		ULONG_PTR key = HandlerToKey(handler, true);
-		HANDLE port = CreateIoCompletionPort(file, io_port_, key, 1);
-		assert(port);
-	}
-
-	ULONG_PTR Thread::HandlerToKey(IOHandler* handler, bool has_valid_io_context)
-	{
-		ULONG_PTR key = reinterpret_cast<ULONG_PTR>(handler);
-
-		// |IOHandler| is at least pointer-size aligned, so the lowest two bits are
-		// always cleared. We use the lowest bit to distinguish completion keys with
-		// and without the associated |IOContext|.
-		assert((key & 1) == 0);
-
-		// Mark the completion key as context-less.
-		if (!has_valid_io_context)
-			key = key | 1;
-		return key;
-	}
-
-	Thread::IOHandler* Thread::KeyToHandler(ULONG_PTR key, bool* has_valid_io_context)
-	{
-		*has_valid_io_context = ((key & 1) == 0);
-		return reinterpret_cast<IOHandler*>(key & ~static_cast<ULONG_PTR>(1));
-	}
-
-	void Thread::PostTask(const Task& task)
-	{
-		{
-			AutoLock lock(task_mutex_);
-			task_queue_.push_back(task);
-		}
-		ScheduleWork();
-	}
-
-	void Thread::Start()
-	{
-		if (thread_ == NULL)
-		{
-			should_quit_ = false;
-			thread_ = ::CreateThread(0, 0, IOThreadMain, this, 0, 0);
-		}
-	}
-
-
-	void Thread::Stop()
-	{
-		should_quit_ = true;
-
-		if (thread_)
-		{
-			::WaitForSingleObject(thread_, 1000);
-			CloseHandle(thread_);
-			thread_ = NULL;
-		}
-	}
-
-
-	void Thread::Wait(DWORD timeout)
-	{
-		::WaitForSingleObject(thread_, timeout);
-	}
-
-
-
-	DWORD WINAPI Thread::IOThreadMain(LPVOID params)
-	{
-		reinterpret_cast<Thread*>(params)->Run();
-		return 0;
-	}
-
-	void Thread::Run()
-	{
-		for (;;) {
-
-			bool more_work_is_plausible = DoScheduledWork();
-
-			if (should_quit_)
-				break;
-
-			more_work_is_plausible |= WaitForIOCompletion(0, NULL);
-
-			if (should_quit_)
-				break;
-
-			if (more_work_is_plausible)
-				continue;
-
-			if (should_quit_)
-				break;
-
-			WaitForWork();  // Wait (sleep) until we have work to do again.
-		}
-	}
-
-	bool Thread::DoScheduledWork()
-	{
-		std::deque<Task> work_queue;
-		{
-			AutoLock lock(task_mutex_);
-			if (task_queue_.empty())
-				return false;
-			work_queue.swap(task_queue_);
-		}
-
-		do
-		{
-			Task t = work_queue.front();
-			work_queue.pop_front();
-
-			t();
-		} while (!work_queue.empty());
-
-		return false;
-	}
-
-	bool Thread::WaitForIOCompletion(DWORD timeout, IOHandler* filter)
-	{
-		IOItem item;
-		if (completed_io_.empty() || !MatchCompletedIOItem(filter, &item)) {
-			// We have to ask the system for another IO completion.
-			if (!GetIOItem(timeout, &item))
-				return false;
-
-			if (ProcessInternalIOItem(item))
-				return true;
-		}
-
-		// If |item.has_valid_io_context| is false then |item.context| does not point
-		// to a context structure, and so should not be dereferenced, although it may
-		// still hold valid non-pointer data.
-		if (!item.has_valid_io_context || item.context->handler) {
-			if (filter && item.handler != filter) {
-				// Save this item for later
-				completed_io_.push_back(item);
-			}
-			else {
-				assert(!item.has_valid_io_context ||
-					(item.context->handler == item.handler));
-				item.handler->OnIOCompleted(item.context, item.bytes_transfered,
-					item.error);
-			}
-		}
-		else {
-			// The handler must be gone by now, just cleanup the mess.
-			delete item.context;
-		}
-		return true;
-	}
-
-	void Thread::WaitForWork()
-	{
-		int timeout;
-		timeout = INFINITE;
-		WaitForIOCompletion(timeout, NULL);
-	}
-
-	bool Thread::MatchCompletedIOItem(IOHandler* filter, IOItem* item)
-	{
-		for (std::list<IOItem>::iterator it = completed_io_.begin();
-			it != completed_io_.end(); ++it) {
-			if (!filter || it->handler == filter) {
-				*item = *it;
-				completed_io_.erase(it);
-				return true;
-			}
-		}
-		return false;
-	}
-
-	bool Thread::GetIOItem(DWORD timeout, IOItem* item)
-	{
-		memset(item, 0, sizeof(*item));
-		ULONG_PTR key = NULL;
-		OVERLAPPED* overlapped = NULL;
-		if (!GetQueuedCompletionStatus(io_port_, &item->bytes_transfered, &key,
-			&overlapped, timeout)) {
-			if (!overlapped)
-				return false;  // Nothing in the queue.
-			item->error = GetLastError();
-			item->bytes_transfered = 0;
-		}
-
-		item->handler = KeyToHandler(key, &item->has_valid_io_context);
-		item->context = reinterpret_cast<IOContext*>(overlapped);
-		return true;
-	}
-
-	bool Thread::ProcessInternalIOItem(const IOItem& item)
-	{
-		if (this == reinterpret_cast<Thread*>(item.context) &&
-			this == reinterpret_cast<Thread*>(item.handler)) {
-			// This is our internal completion.
-			assert(!item.bytes_transfered);
-			return true;
-		}
-		return false;
-	}
-
-	void Thread::ScheduleWork()
-	{
-		PostQueuedCompletionStatus(io_port_, 0,
-			reinterpret_cast<ULONG_PTR>(this),
-			reinterpret_cast<OVERLAPPED*>(this));
-	}
-
-}
+#include "ipc_thread.h"
+#include "ipc_message_pool.h"
+#include <cassert>
+
+namespace IPC
+{
+	namespace
+	{
+		// The Thread whose Run() is executing on the calling thread.
+		ThreadLocalPointer<Thread> g_current_thread;
+	}
+
+	bool Thread::BelongsToCurrentThread() const
+	{
+		return g_current_thread.Get() == this;
+	}
+
+	void Thread::PushTask(TaskNode* node)
+	{
+		for (;;) {
+			void* head = task_head_;
+			node->next = static_cast<TaskNode*>(head);
+			if (InterlockedCompareExchangePointer(&task_head_, node, head) == head) {
+				// A non-empty list already has a wakeup on the way, or the
+				// thread is running and takes the list before it sleeps. A
+				// spinning thread looks at the list before it blocks.
+				if (!head && !spinning_)
+					ScheduleWork();
+				return;
+			}
+		}
+	}
+
+	Thread::TaskNode* Thread::TakeTasks()
+	{
+		TaskNode* node = static_cast<TaskNode*>(
+			InterlockedExchangePointer(&task_head_, NULL));
+		TaskNode* oldest = NULL;
+		while (node) {
+			TaskNode* next = node->next;
+			node->next = oldest;
+			oldest = node;
+			node = next;
+		}
+		return oldest;
+	}
+
+	void Thread::Run()
+	{
+		g_current_thread.Set(this);
+		for (;;) {
+
+			bool more_work_is_plausible = DoScheduledWork();
+
+			if (should_quit_)
+				break;
+
+			more_work_is_plausible |= DoDelayedWork();
+
+			if (should_quit_)
+				break;
+
+			more_work_is_plausible |= DoDeferredIO();
+
+			if (should_quit_)
+				break;
+
+			more_work_is_plausible |= WaitForIOCompletion(0, NULL);
+
+			if (should_quit_)
+				break;
+
+			more_work_is_plausible |= DoResumedIO();
+
+			if (should_quit_)
+				break;
+
+			if (more_work_is_plausible)
+				continue;
+
+			if (should_quit_)
+				break;
+
+			WaitForWork();  // Wait (sleep) until we have work to do again.
+		}
+
+		g_current_thread.Set(NULL);
+		if (delete_on_quit_)
+			delete this;
+		MessagePool::ReleaseThreadCache();
+	}
+
+	void Thread::DiscardTasks()
+	{
+		TaskNode* node = TakeTasks();
+		while (node) {
+			TaskNode* next = node->next;
+			node->finish(node, false);
+			node = next;
+		}
+		while (TimerEntry* entry = timers_.PopAny())
+			entry->fire(entry, false);
+	}
+
+	bool Thread::DoScheduledWork()
+	{
+		// Tasks posted meanwhile start a new list and schedule a wakeup.
+		running_tasks_ = TakeTasks();
+		RunTaskList();
+		return false;
+	}
+
+	void Thread::RunPendingTasks()
+	{
+		assert(BelongsToCurrentThread());
+		TaskNode** tail = &running_tasks_;
+		while (*tail)
+			tail = &(*tail)->next;
+		*tail = TakeTasks();
+		RunTaskList();
+	}
+
+	void Thread::RunTaskList()
+	{
+		// A task may call RunPendingTasks(), which carries on with the list.
+		while (TaskNode* node = running_tasks_) {
+			running_tasks_ = node->next;
+			node->finish(node, true);
+		}
+	}
+
+	bool Thread::DoResumedIO()
+	{
+		// Handlers resuming again only run on the next pass, after the IO that
+		// became ready in the meantime.
+		size_t count = resumed_io_.size();
+		while (count-- && !resumed_io_.empty()) {
+			IOItem item = resumed_io_.front();
+			resumed_io_.pop_front();
+			item.handler->OnIOCompleted(item.context, 0, 0);
+		}
+		return !resumed_io_.empty();
+	}
+
+	void Thread::ResumeIO(IOHandler* handler, IOContext* context)
+	{
+		IOItem item = { handler, context, 0, 0, true };
+		resumed_io_.push_back(item);
+	}
+
+	void Thread::CancelResumedIO(IOHandler* handler)
+	{
+		for (std::list<IOItem>::iterator it = resumed_io_.begin();
+			it != resumed_io_.end();) {
+			if (it->handler == handler)
+				it = resumed_io_.erase(it);
+			else
+				++it;
+		}
+	}
+
+	bool Thread::DoDeferredIO()
+	{
+		// Completions deferred while these run wait for the next pass.
+		size_t count = deferred_count_;
+		IOItem item;
+		while (count-- && deferred_head_ &&
+			TakeDeferredIOItem(deferred_head_, &item)) {
+			DispatchIOItem(item);
+		}
+		return deferred_head_ != NULL;
+	}
+
+	bool Thread::WaitForIOCompletion(DWORD timeout, IOHandler* filter)
+	{
+		IOItem item;
+		IOHandler* deferred = filter ? filter : deferred_head_;
+		if (!deferred || !TakeDeferredIOItem(deferred, &item)) {
+			// We have to ask the system for another IO completion.
+			if (!GetIOItem(timeout, &item))
+				return false;
+
+			if (ProcessInternalIOItem(item))
+				return true;
+
+			// If |item.has_valid_io_context| is false then |item.context| does
+			// not point to a context structure, and so should not be
+			// dereferenced, although it may still hold valid non-pointer data.
+			// Such a completion has nothing to be queued by and is handled
+			// right away.
+			if (filter && item.handler != filter &&
+				item.has_valid_io_context && item.context->handler) {
+				// Save this item for later
+				DeferIOItem(item);
+				return true;
+			}
+		}
+
+		DispatchIOItem(item);
+		return true;
+	}
+
+	void Thread::DispatchIOItem(const IOItem& item)
+	{
+		if (!item.has_valid_io_context || item.context->handler) {
+			assert(!item.has_valid_io_context ||
+				(item.context->handler == item.handler));
+			item.handler->OnIOCompleted(item.context, item.bytes_transfered,
+				item.error);
+		}
+		else {
+			// The handler must be gone by now, just cleanup the mess.
+			delete item.context;
+		}
+	}
+
+	void Thread::DeferIOItem(const IOItem& item)
+	{
+		IOHandler* handler = item.handler;
+		IOContext* context = item.context;
+		for (IOContext* queued = handler->deferred_head_; queued;
+			queued = queued->next_deferred) {
+			if (queued == context) {
+				if (item.error)
+					queued->deferred_error = item.error;
+				return;
+			}
+		}
+
+		context->next_deferred = NULL;
+		context->deferred_bytes = item.bytes_transfered;
+		context->deferred_error = item.error;
+		if (handler->deferred_tail_) {
+			handler->deferred_tail_->next_deferred = context;
+		} else {
+			handler->deferred_head_ = context;
+			handler->prev_deferred_ = deferred_tail_;
+			handler->next_deferred_ = NULL;
+			if (deferred_tail_)
+				deferred_tail_->next_deferred_ = handler;
+			else
+				deferred_head_ = handler;
+			deferred_tail_ = handler;
+		}
+		handler->deferred_tail_ = context;
+		++deferred_count_;
+	}
+
+	bool Thread::TakeDeferredIOItem(IOHandler* handler, IOItem* item)
+	{
+		IOContext* context = handler->deferred_head_;
+		if (!context)
+			return false;
+
+		item->handler = handler;
+		item->context = context;
+		item->bytes_transfered = context->deferred_bytes;
+		item->error = context->deferred_error;
+		item->has_valid_io_context = true;
+
+		handler->deferred_head_ = context->next_deferred;
+		context->next_deferred = NULL;
+		--deferred_count_;
+		if (handler->deferred_head_)
+			return true;
+
+		// The last one, take the handler off the list.
+		handler->deferred_tail_ = NULL;
+		if (handler->prev_deferred_)
+			handler->prev_deferred_->next_deferred_ = handler->next_deferred_;
+		else
+			deferred_head_ = handler->next_deferred_;
+		if (handler->next_deferred_)
+			handler->next_deferred_->prev_deferred_ = handler->prev_deferred_;
+		else
+			deferred_tail_ = handler->prev_deferred_;
+		handler->prev_deferred_ = NULL;
+		handler->next_deferred_ = NULL;
+		return true;
+	}
+
+	void Thread::DropDeferredIOItem(IOContext* context)
+	{
+		IOHandler* handler = context->handler;
+		IOContext* prev = NULL;
+		for (IOContext* queued = handler->deferred_head_; queued;
+			queued = queued->next_deferred) {
+			if (queued != context) {
+				prev = queued;
+				continue;
+			}
+			if (!prev) {
+				// Taking the head also unlinks the handler when it was the only
+				// one.
+				IOItem item;
+				TakeDeferredIOItem(handler, &item);
+				return;
+			}
+			prev->next_deferred = context->next_deferred;
+			if (handler->deferred_tail_ == context)
+				handler->deferred_tail_ = prev;
+			context->next_deferred = NULL;
+			--deferred_count_;
+			return;
+		}
+	}
+
+	void Thread::WaitForWork()
+	{
+		// Sleep until the next timer is due.
+		DWORD timeout = timers_.NextTimeout(CurrentTick());
+		if (max_spin_ && SpinForWork(timeout))
+			return;
+
+		uint64 start = MonotonicMicroseconds();
+		WaitForIOCompletion(timeout, NULL);
+		uint64 waited = MonotonicMicroseconds() - start;
+		polling_stats_.block_time += waited;
+		polling_stats_.block_wakeups++;
+		if (max_spin_)
+			AdaptSpinWindow(waited + spin_window_);
+	}
+
+	bool Thread::SpinForWork(DWORD timeout)
+	{
+		uint64 window = spin_window_;
+		if (window > static_cast<uint64>(max_spin_))
+			window = static_cast<uint64>(max_spin_);
+		if (timeout != INFINITE && static_cast<uint64>(timeout) * 1000 < window)
+			window = static_cast<uint64>(timeout) * 1000;
+
+		// Tasks pushed from here on do not wake the thread up.
+		InterlockedExchange(&spinning_, 1);
+		uint64 start = MonotonicMicroseconds();
+		uint64 now = start;
+		bool found = false;
+		uint32 backoff = 1;
+		while (now - start < window) {
+			if (task_head_ || WaitForIOCompletion(0, NULL)) {
+				found = true;
+				break;
+			}
+			// Back off exponentially, the clock and the poll are not free.
+			for (uint32 i = 0; i < backoff; ++i)
+				CpuRelax();
+			if (backoff < 64)
+				backoff *= 2;
+			now = MonotonicMicroseconds();
+		}
+		InterlockedExchange(&spinning_, 0);
+		if (task_head_)
+			found = true;
+
+		polling_stats_.spin_time += now - start;
+		if (!found)
+			return false;
+		polling_stats_.spin_wakeups++;
+		AdaptSpinWindow(now - start);
+		return true;
+	}
+
+	void Thread::AdaptSpinWindow(uint64 wait)
+	{
+		uint64 max_spin = static_cast<uint64>(max_spin_);
+		// A single long idle period must not take long to be forgotten.
+		if (wait > max_spin * 2)
+			wait = max_spin * 2;
+		average_wait_ = average_wait_ - average_wait_ / 8 + wait / 8;
+
+		uint64 window = average_wait_ * 2;
+		if (window > max_spin) {
+			// Work comes in too slowly for spinning to pay off.
+			window = spin_window_ / 2;
+		}
+		if (window < kMinSpinWindow)
+			window = kMinSpinWindow;
+		if (window > max_spin)
+			window = max_spin;
+		spin_window_ = static_cast<uint32>(window);
+		polling_stats_.spin_window = spin_window_;
+	}
+
+	void Thread::SetBusyPolling(uint32 max_spin)
+	{
+		// With a single processor the work can only come in once the
+		// spinning thread is preempted.
+		if (NumberOfProcessors() == 1)
+			max_spin = 0;
+		InterlockedExchange(&max_spin_, static_cast<LONG>(max_spin));
+	}
+
+	void Thread::GetPollingStats(PollingStats* stats) const
+	{
+		*stats = polling_stats_;
+	}
+
+	// static
+	uint64 Thread::CurrentTick()
+	{
+		return MonotonicMicroseconds() / 1000;
+	}
+
+	void Thread::AddDelayedTask(TimerEntry* entry, DWORD delay)
+	{
+		entry->deadline = CurrentTick() + delay;
+		if (BelongsToCurrentThread())
+			AddTimer(entry);
+		else
+			PostTask(std::bind(&Thread::AddTimer, this, entry));
+	}
+
+	void Thread::AddTimer(TimerEntry* entry)
+	{
+		timers_.Add(entry);
+	}
+
+	bool Thread::DoDelayedWork()
+	{
+		if (!timers_.size())
+			return false;
+
+		timers_.Advance(CurrentTick());
+		while (TimerEntry* entry = timers_.PopExpired())
+			entry->fire(entry, true);
+		return false;
+	}
+
+	Thread::Timer::Timer()
+		: thread_(NULL)
+		, delay_(0)
+		, repeating_(false)
+	{
+		fire = &Timer::Fire;
+	}
+
+	Thread::Timer::~Timer()
+	{
+		Stop();
+	}
+
+	void Thread::Timer::Start(Thread* thread, DWORD delay, const Task& task,
+		bool repeating)
+	{
+		assert(thread->BelongsToCurrentThread());
+		Stop();
+		thread_ = thread;
+		task_ = task;
+		delay_ = delay;
+		repeating_ = repeating;
+		deadline = CurrentTick() + delay;
+		thread_->AddTimer(this);
+	}
+
+	void Thread::Timer::Stop()
+	{
+		if (thread_) {
+			thread_->timers_.Remove(this);
+			thread_ = NULL;
+		}
+	}
+
+	// static
+	void Thread::Timer::Fire(TimerEntry* entry, bool run)
+	{
+		Timer* timer = static_cast<Timer*>(entry);
+		if (!run) {
+			// The thread is going away.
+			timer->thread_ = NULL;
+			return;
+		}
+		// Queued again first, so the task can stop it.
+		if (timer->repeating_) {
+			timer->deadline = CurrentTick() + timer->delay_;
+			timer->thread_->AddTimer(timer);
+		} else {
+			timer->thread_ = NULL;
+		}
+		timer->task_();
+	}
+
+}
@@ -1,85 +1,444 @@
-#pragma once
-#include "ipc/ipc_common.h"
-#include "ipc/ipc_utils.h"
-
-#include <functional>
-#include <queue>
-#include <list>
-
-namespace IPC
-{
-	class Thread
-	{
-	public:
-		typedef std::function<void(void)> Task;
-
-		struct IOContext;
-
-		class IOHandler {
-		public:
-			virtual ~IOHandler() {}
-			// This will be called once the pending IO operation associated with
-			// |context| completes. |error| is the Win32 error code of the IO operation
-			// (ERROR_SUCCESS if there was no error). |bytes_transfered| will be zero
-			// on error.
-			virtual void OnIOCompleted(IOContext* context, DWORD bytes_transfered,
-				DWORD error) = 0;
-		};
-
-		struct IOContext {
-			OVERLAPPED overlapped;
-			IOHandler* handler;
-		};
-
-		Thread();
-		~Thread();
-
-		void Start();
-		void Stop();
-		void Wait(DWORD timeout);
-
-		void RegisterIOHandler(HANDLE file, IOHandler* handler);
-		bool WaitForIOCompletion(DWORD timeout, IOHandler* filter);
-
-		void PostTask(const Task& task);
-	private:
-		struct IOItem {
-			IOHandler* handler;
-			IOContext* context;
-			DWORD bytes_transfered;
-			DWORD error;
-
-			// In some cases |context| can be a non-pointer value casted to a pointer.
-			// |has_valid_io_context| is true if |context| is a valid IOContext
-			// pointer, and false otherwise.
-			bool has_valid_io_context;
-		};
-
-		static DWORD WINAPI IOThreadMain(LPVOID params);
-		// Converts an IOHandler pointer to a completion port key.
-		// |has_valid_io_context| specifies whether completion packets posted to
-		// |handler| will have valid OVERLAPPED pointers.
-		static ULONG_PTR HandlerToKey(IOHandler* handler, bool has_valid_io_context);
-		static IOHandler* KeyToHandler(ULONG_PTR key, bool* has_valid_io_context);
-
-		void Run();
-		bool DoScheduledWork();
-		void ScheduleWork();
-		void WaitForWork();
-
-		bool MatchCompletedIOItem(IOHandler* filter, IOItem* item);
-		bool GetIOItem(DWORD timeout, IOItem* item);
-		bool ProcessInternalIOItem(const IOItem& item);
-		void WillProcessIOEvent();
-		void DidProcessIOEvent();
-
-		HANDLE thread_;
-		bool should_quit_;
-
-		HANDLE io_port_;
-		std::list<IOItem> completed_io_;
-
-		Lock task_mutex_;
-		std::deque<Task> task_queue_;
-	};
-}
\ No newline at end of file
+#pragma once
+#include "ipc/ipc_common.h"
+#include "ipc/ipc_utils.h"
+#include "ipc/ipc_message_pool.h"
+#include "ipc/ipc_timer_wheel.h"
+
+#include <cassert>
+#include <functional>
+#include <list>
+#include <new>
+
+#if defined(OS_POSIX)
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <map>
+#include <vector>
+
+struct msghdr;
+#endif
+
+namespace IPC
+{
+#if defined(OS_POSIX)
+	class IoUring;
+#endif
+
+	class Thread
+	{
+	public:
+		typedef std::function<void(void)> Task;
+
+		struct IOContext;
+
+		class IOHandler {
+		public:
+			IOHandler()
+				: deferred_head_(NULL)
+				, deferred_tail_(NULL)
+				, prev_deferred_(NULL)
+				, next_deferred_(NULL) {}
+			virtual ~IOHandler() {}
+			// This will be called once the pending IO operation associated with
+			// |context| completes. |error| is the Win32 error code of the IO operation
+			// (ERROR_SUCCESS if there was no error). |bytes_transfered| will be zero
+			// on error.
+			//
+			// On POSIX this is called once the descriptor is ready for the kind of
+			// IO described by |context|, |bytes_transfered| is always zero and
+			// |error| is the pending socket error, if any.
+			virtual void OnIOCompleted(IOContext* context, DWORD bytes_transfered,
+				DWORD error) = 0;
+
+		private:
+			friend class Thread;
+
+			// Completions held back by a WaitForIOCompletion() for another
+			// handler, oldest first, linked through the contexts.
+			IOContext* deferred_head_;
+			IOContext* deferred_tail_;
+			// Links the handlers that have deferred completions.
+			IOHandler* prev_deferred_;
+			IOHandler* next_deferred_;
+		};
+
+#if defined(OS_WIN)
+		struct IOContext {
+			OVERLAPPED overlapped;
+			IOHandler* handler;
+			// Used by the thread while the completion is deferred.
+			IOContext* next_deferred;
+			DWORD deferred_bytes;
+			DWORD deferred_error;
+		};
+#else
+		struct IOContext {
+			IOHandler* handler;
+			// EPOLLIN for the read side of a descriptor, EPOLLOUT for the write side.
+			uint32 events;
+			// Used by the thread while the readiness is deferred.
+			IOContext* next_deferred;
+			DWORD deferred_bytes;
+			DWORD deferred_error;
+		};
+#endif
+
+		// Where the thread spent the time it waited for work, see
+		// SetBusyPolling().
+		struct PollingStats {
+			// Microseconds spent spinning, and blocked in the system.
+			uint64 spin_time;
+			uint64 block_time;
+			// Waits that ended while spinning, and while blocked.
+			uint64 spin_wakeups;
+			uint64 block_wakeups;
+			// Current spin window, in microseconds.
+			uint32 spin_window;
+		};
+
+		// The spin window never shrinks below this, in microseconds, so it
+		// can grow again once work comes in faster.
+		static const uint32 kMinSpinWindow = 5;
+
+#if defined(OS_WIN)
+		Thread();
+#else
+		// How a POSIX thread waits for IO.
+		enum Backend {
+			// Whatever SetDefaultBackend() picked, epoll unless changed.
+			BACKEND_DEFAULT,
+			BACKEND_EPOLL,
+			// io_uring, on Linux 5.13 or later. Readiness comes from multishot
+			// polls and writes can be submitted with SubmitSend(), all of it
+			// batched into one system call per pass of the message loop.
+			// Falls back to epoll if the kernel does not have it.
+			BACKEND_IO_URING,
+		};
+
+		// Sets the backend of the threads created with BACKEND_DEFAULT from
+		// now on, including the ones Endpoint and Server create.
+		static void SetDefaultBackend(Backend backend);
+
+		explicit Thread(Backend backend = BACKEND_DEFAULT);
+
+		// The backend in use, never BACKEND_DEFAULT.
+		Backend backend() const { return backend_; }
+#endif
+		~Thread();
+
+		void Start();
+		void Stop();
+		void Wait(DWORD timeout);
+
+		// Returns true if called from inside Run() of this thread.
+		bool BelongsToCurrentThread() const;
+
+		// Runs the tasks posted so far, the rest of the batch the running
+		// task came from first. Must be called on this thread. Lets an
+		// object that lives on a shared thread tear down from a task without
+		// waiting for the thread, which would never get to it.
+		void RunPendingTasks();
+
+		// Stops the thread from one of its tasks, and deletes it once Run()
+		// returns. Must be called on this thread, the caller must not touch
+		// the thread afterwards.
+		void DeleteSoon();
+
+#if defined(OS_WIN)
+		void RegisterIOHandler(HANDLE file, IOHandler* handler);
+#else
+		// Adds |fd| to the epoll set in edge-triggered mode. Readiness is reported
+		// through a read and a write context owned by the thread, so the handler
+		// must consume the descriptor until EAGAIN before it can expect another
+		// notification.
+		void RegisterIOHandler(int fd, IOHandler* handler);
+
+		// Removes |fd| from the epoll set and drops any readiness already collected
+		// for it. Must be called on this thread before |fd| is closed.
+		void UnregisterIOHandler(int fd);
+
+		// True if SubmitSend() can be used, which is the case on io_uring.
+		bool SupportsAsyncSend() const { return ring_ != NULL; }
+
+		// Sends |msg| on |fd| in the background. |context|->handler is called
+		// with the number of bytes sent, or the error, once the send is done.
+		// |msg| and the data it points to must stay untouched until then.
+		// Returns false if the send could not be queued.
+		bool SubmitSend(int fd, const struct msghdr* msg, IOContext* context);
+
+		// Asks the kernel to stop the send of |context| early. The handler
+		// still gets its completion, with ECANCELED if the cancel won.
+		void CancelIO(IOContext* context);
+#endif
+
+		// Handles one IO completion, waiting up to |timeout| for it. With a
+		// |filter| only completions for that handler are handled, the others
+		// are deferred in a queue of their handler and handled in order by
+		// the next pass of the message loop. Returns false on timeout.
+		bool WaitForIOCompletion(DWORD timeout, IOHandler* filter);
+
+		// Calls |handler|->OnIOCompleted(context, 0, 0) from the message loop
+		// after the IO that is ready by then had its turn. A handler that stops
+		// early to leave room for others uses this to pick up where it left off.
+		// Must be called on this thread.
+		void ResumeIO(IOHandler* handler, IOContext* context);
+
+		// Drops the calls queued by ResumeIO() for |handler|.
+		void CancelResumedIO(IOHandler* handler);
+
+		// Lets the thread poll for IO and tasks for up to |max_spin|
+		// microseconds before it blocks, trading CPU time for the latency of
+		// a wakeup. The window adapts to how long the thread usually waits:
+		// twice the average wait, down to kMinSpinWindow while work comes
+		// in slower than |max_spin|. 0, the default, blocks right away, as
+		// does a machine with a single processor. Can be called on any
+		// thread.
+		void SetBusyPolling(uint32 max_spin);
+
+		// Copies the counters kept since the thread was created. They are
+		// updated without synchronization, so the result is approximate
+		// while the thread runs.
+		void GetPollingStats(PollingStats* stats) const;
+
+		// Runs |task| on this thread. Any callable works, a std::bind() result
+		// is best passed directly: it is stored inline in a node from the
+		// MessagePool of the calling thread instead of going through a Task.
+		// Can be called on any thread without taking a lock, the thread is
+		// only woken up when the queue was empty.
+		template <typename F>
+		void PostTask(const F& task)
+		{
+			void* memory = MessagePool::Allocate(sizeof(TaskNodeImpl<F>), NULL);
+			assert(memory);
+			PushTask(new (memory) TaskNodeImpl<F>(task));
+		}
+
+		// Runs |task| on this thread after |delay| milliseconds. Can be called
+		// on any thread, takes any callable like PostTask(). Use a Timer for a
+		// task that has to be cancelled.
+		template <typename F>
+		void PostDelayedTask(const F& task, DWORD delay)
+		{
+			void* memory = MessagePool::Allocate(sizeof(DelayedTaskImpl<F>), NULL);
+			assert(memory);
+			AddDelayedTask(new (memory) DelayedTaskImpl<F>(task), delay);
+		}
+
+		// A one-shot or repeating timer, owned by the caller and only used
+		// on the thread it runs on. Start() and Stop() are O(1) and do not
+		// allocate.
+		class Timer : private TimerEntry {
+		public:
+			Timer();
+			// Stops the timer.
+			~Timer();
+
+			// Runs |task| on |thread| after |delay| milliseconds, and then
+			// every |delay| milliseconds if |repeating|, until Stop(). A
+			// running timer starts over. Must be called on |thread|. The task
+			// may stop the timer, but not destroy it.
+			void Start(Thread* thread, DWORD delay, const Task& task,
+				bool repeating = false);
+			void Stop();
+			bool IsRunning() const { return is_queued(); }
+
+		private:
+			static void Fire(TimerEntry* entry, bool run);
+
+			Thread* thread_;
+			Task task_;
+			DWORD delay_;
+			bool repeating_;
+		};
+
+	private:
+		template <typename F>
+		struct DelayedTaskImpl : TimerEntry {
+			explicit DelayedTaskImpl(const F& f) : task(f) {
+				fire = &DelayedTaskImpl::Fire;
+			}
+
+			static void Fire(TimerEntry* entry, bool run) {
+				DelayedTaskImpl* self = static_cast<DelayedTaskImpl*>(entry);
+				if (run)
+					self->task();
+				self->~DelayedTaskImpl();
+				MessagePool::Free(self);
+			}
+
+			F task;
+		};
+
+		// Posted task, linked into |task_head_|.
+		struct TaskNode {
+			TaskNode* next;
+			// Runs the task, or only destroys it if |run| is false, and frees
+			// the node.
+			void (*finish)(TaskNode* node, bool run);
+		};
+
+		template <typename F>
+		struct TaskNodeImpl : TaskNode {
+			explicit TaskNodeImpl(const F& f) : task(f) {
+				finish = &TaskNodeImpl::Finish;
+			}
+
+			static void Finish(TaskNode* node, bool run) {
+				TaskNodeImpl* self = static_cast<TaskNodeImpl*>(node);
+				if (run)
+					self->task();
+				self->~TaskNodeImpl();
+				MessagePool::Free(self);
+			}
+
+			F task;
+		};
+
+		struct IOItem {
+			IOHandler* handler;
+			IOContext* context;
+			DWORD bytes_transfered;
+			DWORD error;
+
+			// In some cases |context| can be a non-pointer value casted to a pointer.
+			// |has_valid_io_context| is true if |context| is a valid IOContext
+			// pointer, and false otherwise.
+			bool has_valid_io_context;
+		};
+
+#if defined(OS_WIN)
+		static DWORD WINAPI IOThreadMain(LPVOID params);
+		// Converts an IOHandler pointer to a completion port key.
+		// |has_valid_io_context| specifies whether completion packets posted to
+		// |handler| will have valid OVERLAPPED pointers.
+		static ULONG_PTR HandlerToKey(IOHandler* handler, bool has_valid_io_context);
+		static IOHandler* KeyToHandler(ULONG_PTR key, bool* has_valid_io_context);
+#else
+		static void* IOThreadMain(void* params);
+
+		// A registered descriptor. The epoll data of |fd|, or the user data
+		// of its poll on io_uring, points here.
+		struct Watcher {
+			int fd;
+			// Cleared by UnregisterIOHandler(). On io_uring the watcher lives
+			// on until the completion that ends its poll.
+			bool registered;
+			IOContext read_context;
+			IOContext write_context;
+		};
+
+		// Maximum number of epoll events, or io_uring completions, collected
+		// at once.
+		static const int kMaxEvents = 64;
+
+		// Queues the read and write items |events| make ready on |watcher|.
+		void AddReadyIO(Watcher* watcher, uint32 events);
+
+		bool InitIoUring();
+		// Queues a multishot poll of the eventfd, and of |watcher|.
+		void ArmWakeup();
+		void ArmWatcher(Watcher* watcher);
+		bool GetIoUringItem(DWORD timeout, IOItem* item);
+		// Moves completions from the ring to |ready_io_|. Returns false if
+		// there were none to hand out.
+		bool ReapCompletions();
+#endif
+
+		void Run();
+		void PushTask(TaskNode* node);
+		// Takes the posted tasks, oldest first.
+		TaskNode* TakeTasks();
+		// Destroys the tasks and timers that never ran.
+		void DiscardTasks();
+		bool DoScheduledWork();
+		// Runs |running_tasks_| until it is empty.
+		void RunTaskList();
+
+		// Milliseconds, the tick of |timers_|.
+		static uint64 CurrentTick();
+		// Queues |entry| to fire in |delay| milliseconds.
+		void AddDelayedTask(TimerEntry* entry, DWORD delay);
+		void AddTimer(TimerEntry* entry);
+		// Runs the timers that are due.
+		bool DoDelayedWork();
+		bool DoResumedIO();
+		// Handles the completions deferred so far.
+		bool DoDeferredIO();
+		void ScheduleWork();
+		void WaitForWork();
+		// Polls for work for up to the spin window, or |timeout|
+		// milliseconds. Returns true if there is some.
+		bool SpinForWork(DWORD timeout);
+		// Adapts |spin_window_| to a wait that took |wait| microseconds.
+		void AdaptSpinWindow(uint64 wait);
+
+		// Queues |item| on its handler. A context already queued only has
+		// its error updated, readiness is reported once.
+		void DeferIOItem(const IOItem& item);
+		// Takes the oldest completion deferred for |handler|, returns false
+		// if there is none.
+		bool TakeDeferredIOItem(IOHandler* handler, IOItem* item);
+		// Forgets the deferred completion of |context|, if any.
+		void DropDeferredIOItem(IOContext* context);
+		void DispatchIOItem(const IOItem& item);
+		bool GetIOItem(DWORD timeout, IOItem* item);
+		bool ProcessInternalIOItem(const IOItem& item);
+		void WillProcessIOEvent();
+		void DidProcessIOEvent();
+
+#if defined(OS_WIN)
+		HANDLE thread_;
+#else
+		pthread_t thread_;
+		bool thread_running_;
+#endif
+		bool should_quit_;
+		// Set by DeleteSoon().
+		bool delete_on_quit_;
+
+#if defined(OS_WIN)
+		HANDLE io_port_;
+#else
+		Backend backend_;
+		int epoll_fd_;
+		// Set instead of |epoll_fd_| on io_uring.
+		IoUring* ring_;
+		// eventfd used by ScheduleWork to wake up epoll_wait.
+		int wakeup_fd_;
+		std::map<int, Watcher*> watchers_;
+		// Unregistered watchers whose poll is still being torn down.
+		std::vector<Watcher*> dying_watchers_;
+
+		// Readiness returned by the last epoll_wait that has not been handed out
+		// by GetIOItem yet. A single epoll event can produce a read and a write
+		// item.
+		IOItem ready_io_[kMaxEvents * 2];
+		int ready_io_count_;
+		int ready_io_index_;
+#endif
+		// Handlers with deferred completions, in the order they got their
+		// first one.
+		IOHandler* deferred_head_;
+		IOHandler* deferred_tail_;
+		size_t deferred_count_;
+
+		// Queued by ResumeIO(), in order.
+		std::list<IOItem> resumed_io_;
+
+		TimerWheel timers_;
+
+		// See SetBusyPolling(), |spinning_| is set while SpinForWork() runs
+		// and tasks can be pushed without a wakeup.
+		volatile LONG max_spin_;
+		volatile LONG spinning_;
+		uint32 spin_window_;
+		uint64 average_wait_;
+		PollingStats polling_stats_;
+
+		// Posted tasks, most recent first. Producers push with a compare and
+		// swap, the thread takes the whole list at once.
+		void* volatile task_head_;
+		// The tasks of the current batch that did not run yet, oldest first.
+		TaskNode* running_tasks_;
+	};
+}
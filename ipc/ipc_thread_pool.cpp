@@ -0,0 +1,58 @@
+#include "ipc_thread_pool.h"
+#include <cassert>
+
+namespace IPC
+{
+	ThreadPool::ThreadPool(size_t thread_count)
+	{
+		if (!thread_count)
+			thread_count = NumberOfProcessors();
+		threads_.resize(thread_count);
+		for (size_t i = 0; i < thread_count; ++i) {
+			threads_[i].thread = new Thread;
+			threads_[i].thread->Start();
+			threads_[i].users = 0;
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		for (size_t i = 0; i < threads_.size(); ++i) {
+			assert(!threads_[i].users);
+			Thread* thread = threads_[i].thread;
+			// The last user may let go of the pool from one of its tasks.
+			if (thread->BelongsToCurrentThread()) {
+				thread->DeleteSoon();
+				continue;
+			}
+			thread->Stop();
+			thread->Wait(2000);
+			delete thread;
+		}
+	}
+
+	Thread* ThreadPool::Acquire()
+	{
+		AutoLock lock(lock_);
+		size_t best = 0;
+		for (size_t i = 1; i < threads_.size(); ++i) {
+			if (threads_[i].users < threads_[best].users)
+				best = i;
+		}
+		threads_[best].users++;
+		return threads_[best].thread;
+	}
+
+	void ThreadPool::Release(Thread* thread)
+	{
+		AutoLock lock(lock_);
+		for (size_t i = 0; i < threads_.size(); ++i) {
+			if (threads_[i].thread == thread) {
+				assert(threads_[i].users);
+				threads_[i].users--;
+				return;
+			}
+		}
+		assert(0);
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "ipc/ipc_thread.h"
+
+#include <vector>
+
+namespace IPC
+{
+	// A fixed set of IO threads shared by endpoints and servers. A channel
+	// stays on the thread it was given, so its messages keep their order,
+	// and a new one goes to the thread with the fewest channels.
+	class ThreadPool
+	{
+	public:
+		// Starts |thread_count| threads, or one per processor if 0.
+		explicit ThreadPool(size_t thread_count = 0);
+
+		// Stops the threads. Every thread handed out must have been released.
+		// Can be called from a task of one of the threads.
+		~ThreadPool();
+
+		// Returns the least loaded thread and counts one more user of it.
+		Thread* Acquire();
+
+		// Drops a user counted by Acquire().
+		void Release(Thread* thread);
+
+		size_t thread_count() const { return threads_.size(); }
+		Thread* thread(size_t index) const { return threads_[index].thread; }
+
+	private:
+		struct PooledThread {
+			Thread* thread;
+			size_t users;
+		};
+
+		Lock lock_;
+		std::vector<PooledThread> threads_;
+	};
+}
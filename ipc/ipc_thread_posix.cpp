@@ -0,0 +1,464 @@
+#include "ipc_thread.h"
+#include "ipc_io_uring.h"
+#include <algorithm>
+#include <cassert>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+namespace IPC
+{
+	namespace
+	{
+		volatile LONG g_default_backend = Thread::BACKEND_EPOLL;
+
+		// Completions are told apart by the low bits of their user data,
+		// watchers and contexts are aligned well enough to leave them free.
+		const uint64 kPollTag = 0;
+		const uint64 kSendTag = 1;
+		const uint64 kIgnoreTag = 2;
+		const uint64 kWakeupTag = 3;
+		const uint64 kTagMask = 3;
+
+		// Room for the polls of the registered descriptors and a burst of
+		// sends, the ring submits early when it fills up anyway.
+		const unsigned kRingEntries = 256;
+	}
+
+	// static
+	void Thread::SetDefaultBackend(Backend backend)
+	{
+		if (backend == BACKEND_DEFAULT)
+			backend = BACKEND_EPOLL;
+		InterlockedExchange(&g_default_backend, backend);
+	}
+
+	Thread::Thread(Backend backend)
+		: thread_running_(false)
+		, should_quit_(false)
+		, delete_on_quit_(false)
+		, backend_(BACKEND_EPOLL)
+		, epoll_fd_(-1)
+		, ring_(NULL)
+		, ready_io_count_(0)
+		, ready_io_index_(0)
+		, deferred_head_(NULL)
+		, deferred_tail_(NULL)
+		, deferred_count_(0)
+		, timers_(CurrentTick())
+		, max_spin_(0)
+		, spinning_(0)
+		, spin_window_(kMinSpinWindow)
+		, average_wait_(0)
+		, task_head_(NULL)
+		, running_tasks_(NULL)
+	{
+		memset(&polling_stats_, 0, sizeof(polling_stats_));
+		polling_stats_.spin_window = spin_window_;
+		wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		assert(wakeup_fd_ >= 0);
+
+		if (backend == BACKEND_DEFAULT) {
+			backend = static_cast<Backend>(
+				InterlockedCompareExchange(&g_default_backend, 0, 0));
+		}
+		if (backend == BACKEND_IO_URING && InitIoUring()) {
+			backend_ = BACKEND_IO_URING;
+			return;
+		}
+
+		epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+		assert(epoll_fd_ >= 0);
+		epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = this;
+		int rv = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &event);
+		assert(rv == 0);
+		(void)rv;
+	}
+
+	Thread::~Thread()
+	{
+		DiscardTasks();
+		// Closing the ring ends the polls, nothing refers to the watchers
+		// after that.
+		delete ring_;
+		for (std::map<int, Watcher*>::iterator it = watchers_.begin();
+			it != watchers_.end(); ++it) {
+			delete it->second;
+		}
+		for (size_t i = 0; i < dying_watchers_.size(); ++i)
+			delete dying_watchers_[i];
+		close(wakeup_fd_);
+		if (epoll_fd_ != -1)
+			close(epoll_fd_);
+	}
+
+	bool Thread::InitIoUring()
+	{
+		ring_ = new IoUring;
+		if (!ring_->Init(kRingEntries)) {
+			delete ring_;
+			ring_ = NULL;
+			return false;
+		}
+		ArmWakeup();
+		return true;
+	}
+
+	void Thread::ArmWakeup()
+	{
+		// Also called while completions are reaped, so a full queue can not
+		// be made room in here.
+		io_uring_sqe* sqe = ring_->GetSqeOrDefer();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = wakeup_fd_;
+		sqe->poll32_events = POLLIN;
+		sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->user_data = kWakeupTag;
+	}
+
+	void Thread::ArmWatcher(Watcher* watcher)
+	{
+		io_uring_sqe* sqe = ring_->GetSqeOrDefer();
+		// Multishot polls are edge-triggered like the epoll backend.
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = watcher->fd;
+		sqe->poll32_events = POLLIN | POLLOUT | POLLRDHUP;
+		sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->user_data = reinterpret_cast<uint64>(watcher) | kPollTag;
+	}
+
+	void Thread::RegisterIOHandler(int fd, IOHandler* handler)
+	{
+		assert(watchers_.find(fd) == watchers_.end());
+		Watcher* watcher = new Watcher;
+		watcher->fd = fd;
+		watcher->registered = true;
+		watcher->read_context.handler = handler;
+		watcher->read_context.events = EPOLLIN;
+		watcher->write_context.handler = handler;
+		watcher->write_context.events = EPOLLOUT;
+
+		if (ring_) {
+			// Goes to the kernel with the next wait, before any readiness
+			// could be missed.
+			ArmWatcher(watcher);
+		} else {
+			epoll_event event;
+			memset(&event, 0, sizeof(event));
+			event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			event.data.ptr = watcher;
+			int rv = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+			assert(rv == 0);
+			(void)rv;
+		}
+		watchers_[fd] = watcher;
+	}
+
+	void Thread::UnregisterIOHandler(int fd)
+	{
+		std::map<int, Watcher*>::iterator it = watchers_.find(fd);
+		if (it == watchers_.end())
+			return;
+		Watcher* watcher = it->second;
+		watchers_.erase(it);
+		watcher->registered = false;
+
+		// Readiness for this descriptor may already have been collected. The
+		// handler is usually going away, so none of it must be delivered.
+		for (int i = ready_io_index_; i < ready_io_count_; ++i) {
+			IOContext* context = ready_io_[i].context;
+			if (context == &watcher->read_context ||
+				context == &watcher->write_context)
+				ready_io_[i].handler = NULL;
+		}
+		DropDeferredIOItem(&watcher->read_context);
+		DropDeferredIOItem(&watcher->write_context);
+
+		if (!ring_) {
+			epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+			delete watcher;
+			return;
+		}
+
+		// The poll holds on to the file until it is removed, so the removal
+		// is submitted right away. The watcher goes with the last completion
+		// of the poll.
+		io_uring_sqe* sqe = ring_->GetSqeOrDefer();
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = reinterpret_cast<uint64>(watcher) | kPollTag;
+		sqe->user_data = kIgnoreTag;
+		ring_->Submit(false, 0);
+		dying_watchers_.push_back(watcher);
+	}
+
+	bool Thread::SubmitSend(int fd, const struct msghdr* msg, IOContext* context)
+	{
+		assert(ring_);
+		io_uring_sqe* sqe = ring_->GetSqe();
+		if (!sqe)
+			return false;
+		// No MSG_DONTWAIT, the kernel waits for room in the socket itself.
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = fd;
+		sqe->addr = reinterpret_cast<uint64>(msg);
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = reinterpret_cast<uint64>(context) | kSendTag;
+		return true;
+	}
+
+	void Thread::CancelIO(IOContext* context)
+	{
+		assert(ring_);
+		// Close() waits for the send, the cancel must not get lost.
+		io_uring_sqe* sqe = ring_->GetSqeOrDefer();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = reinterpret_cast<uint64>(context) | kSendTag;
+		sqe->user_data = kIgnoreTag;
+		ring_->Submit(false, 0);
+	}
+
+	void Thread::Start()
+	{
+		if (!thread_running_)
+		{
+			should_quit_ = false;
+			thread_running_ =
+				pthread_create(&thread_, NULL, IOThreadMain, this) == 0;
+		}
+	}
+
+
+	void Thread::Stop()
+	{
+		should_quit_ = true;
+		ScheduleWork();
+
+		if (thread_running_)
+		{
+			pthread_join(thread_, NULL);
+			thread_running_ = false;
+		}
+	}
+
+
+	void Thread::Wait(DWORD timeout)
+	{
+		if (!thread_running_)
+			return;
+
+		if (timeout == INFINITE) {
+			thread_running_ = pthread_join(thread_, NULL) != 0;
+			return;
+		}
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		thread_running_ = pthread_timedjoin_np(thread_, NULL, &deadline) != 0;
+	}
+
+
+	void Thread::DeleteSoon()
+	{
+		assert(BelongsToCurrentThread());
+		should_quit_ = true;
+		delete_on_quit_ = true;
+		pthread_detach(thread_);
+		thread_running_ = false;
+	}
+
+
+	void* Thread::IOThreadMain(void* params)
+	{
+		reinterpret_cast<Thread*>(params)->Run();
+		return NULL;
+	}
+
+	bool Thread::GetIOItem(DWORD timeout, IOItem* item)
+	{
+		if (ring_)
+			return GetIoUringItem(timeout, item);
+
+		for (;;) {
+			while (ready_io_index_ < ready_io_count_) {
+				const IOItem& ready = ready_io_[ready_io_index_++];
+				// Items of unregistered descriptors have their handler cleared.
+				if (ready.handler) {
+					*item = ready;
+					return true;
+				}
+			}
+
+			epoll_event events[kMaxEvents];
+			int count;
+			do {
+				count = epoll_wait(epoll_fd_, events, kMaxEvents,
+					timeout == INFINITE ? -1 : static_cast<int>(timeout));
+			} while (count < 0 && errno == EINTR);
+			if (count <= 0)
+				return false;  // Nothing in the queue.
+
+			ready_io_index_ = 0;
+			ready_io_count_ = 0;
+			for (int i = 0; i < count; ++i) {
+				if (events[i].data.ptr == this) {
+					IOItem& ready = ready_io_[ready_io_count_++];
+					memset(&ready, 0, sizeof(ready));
+					ready.handler = reinterpret_cast<IOHandler*>(this);
+					ready.context = reinterpret_cast<IOContext*>(this);
+					continue;
+				}
+				AddReadyIO(static_cast<Watcher*>(events[i].data.ptr),
+					events[i].events);
+			}
+		}
+	}
+
+	bool Thread::GetIoUringItem(DWORD timeout, IOItem* item)
+	{
+		bool waited = false;
+		for (;;) {
+			while (ready_io_index_ < ready_io_count_) {
+				const IOItem& ready = ready_io_[ready_io_index_++];
+				if (ready.handler) {
+					*item = ready;
+					return true;
+				}
+			}
+			if (ReapCompletions())
+				continue;
+			if (waited && timeout != INFINITE)
+				return false;  // Nothing in the queue.
+
+			// Polling without anything to submit needs no system call, the
+			// completions show up in the ring by themselves.
+			bool overflowed = ring_->cq_overflowed();
+			if (!timeout && !ring_->pending() && !overflowed)
+				return false;
+			if (!ring_->Submit(timeout != 0 || overflowed, timeout))
+				return false;
+			waited = true;
+		}
+	}
+
+	bool Thread::ReapCompletions()
+	{
+		ready_io_index_ = 0;
+		ready_io_count_ = 0;
+		// Each completion makes at most two items.
+		while (ready_io_count_ + 2 <= kMaxEvents * 2) {
+			io_uring_cqe* cqe = ring_->PeekCqe();
+			if (!cqe)
+				break;
+			uint64 data = cqe->user_data;
+			int32 res = cqe->res;
+			bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+			ring_->PopCqe();
+
+			switch (data & kTagMask) {
+			case kWakeupTag: {
+				if (!more)
+					ArmWakeup();
+				IOItem& ready = ready_io_[ready_io_count_++];
+				memset(&ready, 0, sizeof(ready));
+				ready.handler = reinterpret_cast<IOHandler*>(this);
+				ready.context = reinterpret_cast<IOContext*>(this);
+				break;
+			}
+			case kSendTag: {
+				IOContext* context = reinterpret_cast<IOContext*>(data & ~kTagMask);
+				IOItem& ready = ready_io_[ready_io_count_++];
+				ready.handler = context->handler;
+				ready.context = context;
+				ready.bytes_transfered = res > 0 ? res : 0;
+				ready.error = res < 0 ? -res : 0;
+				ready.has_valid_io_context = true;
+				break;
+			}
+			case kPollTag: {
+				Watcher* watcher = reinterpret_cast<Watcher*>(data & ~kTagMask);
+				if (!watcher->registered) {
+					if (!more) {
+						dying_watchers_.erase(std::find(dying_watchers_.begin(),
+							dying_watchers_.end(), watcher));
+						delete watcher;
+					}
+					break;
+				}
+				// The kernel ends a multishot poll when it runs into trouble,
+				// the next one picks up whatever is ready by then.
+				if (!more)
+					ArmWatcher(watcher);
+				AddReadyIO(watcher, res < 0 ? EPOLLERR : static_cast<uint32>(res));
+				break;
+			}
+			default:
+				break;
+			}
+		}
+		return ready_io_count_ > 0;
+	}
+
+	void Thread::AddReadyIO(Watcher* watcher, uint32 events)
+	{
+		// poll() and epoll share the values of the event bits.
+		DWORD error = 0;
+		if (events & EPOLLERR) {
+			int socket_error = 0;
+			socklen_t len = sizeof(socket_error);
+			getsockopt(watcher->fd, SOL_SOCKET, SO_ERROR, &socket_error, &len);
+			error = socket_error ? socket_error : EPIPE;
+		}
+
+		// Hang-ups and errors are reported on the read side, where the
+		// handler finds out about them from read() anyway.
+		if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+			IOItem& ready = ready_io_[ready_io_count_++];
+			ready.handler = watcher->read_context.handler;
+			ready.context = &watcher->read_context;
+			ready.bytes_transfered = 0;
+			ready.error = error;
+			ready.has_valid_io_context = true;
+		}
+		if (events & (EPOLLOUT | EPOLLERR)) {
+			IOItem& ready = ready_io_[ready_io_count_++];
+			ready.handler = watcher->write_context.handler;
+			ready.context = &watcher->write_context;
+			ready.bytes_transfered = 0;
+			ready.error = error;
+			ready.has_valid_io_context = true;
+		}
+	}
+
+	bool Thread::ProcessInternalIOItem(const IOItem& item)
+	{
+		if (this == reinterpret_cast<Thread*>(item.context) &&
+			this == reinterpret_cast<Thread*>(item.handler)) {
+			// This is our internal wakeup, reset the eventfd counter.
+			uint64 value;
+			while (read(wakeup_fd_, &value, sizeof(value)) > 0) {}
+			return true;
+		}
+		return false;
+	}
+
+	void Thread::ScheduleWork()
+	{
+		uint64 value = 1;
+		ssize_t rv = write(wakeup_fd_, &value, sizeof(value));
+		(void)rv;
+	}
+
+}
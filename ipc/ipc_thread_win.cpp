@@ -0,0 +1,143 @@
+#include "ipc_thread.h"
+#include <cassert>
+
+namespace IPC
+{
+	Thread::Thread()
+		: thread_(NULL)
+		, should_quit_(false)
+		, delete_on_quit_(false)
+		, deferred_head_(NULL)
+		, deferred_tail_(NULL)
+		, deferred_count_(0)
+		, timers_(CurrentTick())
+		, max_spin_(0)
+		, spinning_(0)
+		, spin_window_(kMinSpinWindow)
+		, average_wait_(0)
+		, task_head_(NULL)
+		, running_tasks_(NULL)
+	{
+		memset(&polling_stats_, 0, sizeof(polling_stats_));
+		polling_stats_.spin_window = spin_window_;
+		io_port_ = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, NULL, 1);
+	}
+
+	Thread::~Thread()
+	{
+		DiscardTasks();
+		::CloseHandle(io_port_);
+	}
+
+	void Thread::RegisterIOHandler(HANDLE file, IOHandler* handler)
+	{
+		ULONG_PTR key = HandlerToKey(handler, true);
+		HANDLE port = CreateIoCompletionPort(file, io_port_, key, 1);
+		assert(port);
+	}
+
+	ULONG_PTR Thread::HandlerToKey(IOHandler* handler, bool has_valid_io_context)
+	{
+		ULONG_PTR key = reinterpret_cast<ULONG_PTR>(handler);
+
+		// |IOHandler| is at least pointer-size aligned, so the lowest two bits are
+		// always cleared. We use the lowest bit to distinguish completion keys with
+		// and without the associated |IOContext|.
+		assert((key & 1) == 0);
+
+		// Mark the completion key as context-less.
+		if (!has_valid_io_context)
+			key = key | 1;
+		return key;
+	}
+
+	Thread::IOHandler* Thread::KeyToHandler(ULONG_PTR key, bool* has_valid_io_context)
+	{
+		*has_valid_io_context = ((key & 1) == 0);
+		return reinterpret_cast<IOHandler*>(key & ~static_cast<ULONG_PTR>(1));
+	}
+
+	void Thread::Start()
+	{
+		if (thread_ == NULL)
+		{
+			should_quit_ = false;
+			thread_ = ::CreateThread(0, 0, IOThreadMain, this, 0, 0);
+		}
+	}
+
+
+	void Thread::Stop()
+	{
+		should_quit_ = true;
+		ScheduleWork();
+
+		if (thread_)
+		{
+			::WaitForSingleObject(thread_, 1000);
+			CloseHandle(thread_);
+			thread_ = NULL;
+		}
+	}
+
+
+	void Thread::Wait(DWORD timeout)
+	{
+		::WaitForSingleObject(thread_, timeout);
+	}
+
+
+	void Thread::DeleteSoon()
+	{
+		assert(BelongsToCurrentThread());
+		should_quit_ = true;
+		delete_on_quit_ = true;
+		CloseHandle(thread_);
+		thread_ = NULL;
+	}
+
+
+
+	DWORD WINAPI Thread::IOThreadMain(LPVOID params)
+	{
+		reinterpret_cast<Thread*>(params)->Run();
+		return 0;
+	}
+
+	bool Thread::GetIOItem(DWORD timeout, IOItem* item)
+	{
+		memset(item, 0, sizeof(*item));
+		ULONG_PTR key = NULL;
+		OVERLAPPED* overlapped = NULL;
+		if (!GetQueuedCompletionStatus(io_port_, &item->bytes_transfered, &key,
+			&overlapped, timeout)) {
+			if (!overlapped)
+				return false;  // Nothing in the queue.
+			item->error = GetLastError();
+			item->bytes_transfered = 0;
+		}
+
+		item->handler = KeyToHandler(key, &item->has_valid_io_context);
+		item->context = reinterpret_cast<IOContext*>(overlapped);
+		return true;
+	}
+
+	bool Thread::ProcessInternalIOItem(const IOItem& item)
+	{
+		if (this == reinterpret_cast<Thread*>(item.context) &&
+			this == reinterpret_cast<Thread*>(item.handler)) {
+			// This is our internal completion.
+			assert(!item.bytes_transfered);
+			return true;
+		}
+		return false;
+	}
+
+	void Thread::ScheduleWork()
+	{
+		PostQueuedCompletionStatus(io_port_, 0,
+			reinterpret_cast<ULONG_PTR>(this),
+			reinterpret_cast<OVERLAPPED*>(this));
+	}
+
+}
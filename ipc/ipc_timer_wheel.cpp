@@ -0,0 +1,217 @@
+#include "ipc_timer_wheel.h"
+#include <cassert>
+
+namespace IPC
+{
+	namespace
+	{
+		// Index of the lowest bit set in |mask|, which must not be 0.
+		int LowestBit(uint64 mask)
+		{
+			int index = 0;
+			while (!(mask & 1)) {
+				mask >>= 1;
+				++index;
+			}
+			return index;
+		}
+
+		// |mask| rotated right by |count| bits.
+		uint64 RotateRight(uint64 mask, int count)
+		{
+			if (!count)
+				return mask;
+			return (mask >> count) | (mask << (TimerWheel::kSlots - count));
+		}
+	}
+
+	TimerWheel::TimerWheel(uint64 now)
+		: current_(now)
+		, count_(0)
+	{
+		for (int level = 0; level < kLevels; ++level) {
+			for (int slot = 0; slot < kSlots; ++slot)
+				InitList(&slots_[level][slot]);
+			occupied_[level] = 0;
+		}
+		InitList(&expired_);
+	}
+
+	TimerWheel::~TimerWheel()
+	{
+		assert(!count_);
+	}
+
+	// static
+	void TimerWheel::InitList(TimerEntry* head)
+	{
+		head->prev = head;
+		head->next = head;
+	}
+
+	// static
+	void TimerWheel::Append(TimerEntry* head, TimerEntry* entry)
+	{
+		entry->prev = head->prev;
+		entry->next = head;
+		head->prev->next = entry;
+		head->prev = entry;
+	}
+
+	// static
+	void TimerWheel::Unlink(TimerEntry* entry)
+	{
+		entry->prev->next = entry->next;
+		entry->next->prev = entry->prev;
+		entry->prev = NULL;
+		entry->next = NULL;
+	}
+
+	void TimerWheel::Add(TimerEntry* entry)
+	{
+		assert(!entry->is_queued());
+		if (entry->deadline <= current_)
+			entry->deadline = current_ + 1;
+		Place(entry);
+		count_++;
+	}
+
+	void TimerWheel::Remove(TimerEntry* entry)
+	{
+		if (!entry->is_queued())
+			return;
+		TimerEntry* next = entry->next;
+		Unlink(entry);
+		// Clear the bit of a slot that became empty. Only the head of an
+		// empty list points at itself.
+		ptrdiff_t index = next - &slots_[0][0];
+		if (next->next == next && index >= 0 && index < kLevels * kSlots) {
+			occupied_[index / kSlots] &=
+				~(static_cast<uint64>(1) << (index % kSlots));
+		}
+		count_--;
+	}
+
+	void TimerWheel::Place(TimerEntry* entry)
+	{
+		uint64 delta = entry->deadline - current_;
+		int level = 0;
+		while (level < kLevels - 1 &&
+			delta >= (static_cast<uint64>(1) << ((level + 1) * kSlotBits)))
+			++level;
+
+		uint64 tick = entry->deadline;
+		uint64 reach = static_cast<uint64>(1) << (kLevels * kSlotBits);
+		if (delta >= reach)
+			tick = current_ + reach - 1;  // Comes back here when in reach.
+
+		int slot = static_cast<int>((tick >> (level * kSlotBits)) & (kSlots - 1));
+		Append(&slots_[level][slot], entry);
+		occupied_[level] |= static_cast<uint64>(1) << slot;
+	}
+
+	void TimerWheel::Cascade(int level, int slot)
+	{
+		TimerEntry* head = &slots_[level][slot];
+		occupied_[level] &= ~(static_cast<uint64>(1) << slot);
+		while (head->next != head) {
+			TimerEntry* entry = head->next;
+			Unlink(entry);
+			Place(entry);
+		}
+	}
+
+	void TimerWheel::Advance(uint64 now)
+	{
+		while (current_ < now) {
+			// Ticks without a slot to look at are skipped.
+			uint64 next = NextEventTick();
+			if (!next || next > now) {
+				current_ = now;
+				return;
+			}
+			current_ = next;
+
+			// Timers of the coarser levels whose block starts now move down,
+			// the coarsest first.
+			int levels = 1;
+			while (levels < kLevels &&
+				!(current_ & ((static_cast<uint64>(1) << (levels * kSlotBits)) - 1)))
+				++levels;
+			for (int level = levels - 1; level >= 1; --level) {
+				int slot = static_cast<int>(
+					(current_ >> (level * kSlotBits)) & (kSlots - 1));
+				if (occupied_[level] & (static_cast<uint64>(1) << slot))
+					Cascade(level, slot);
+			}
+
+			int slot = static_cast<int>(current_ & (kSlots - 1));
+			if (occupied_[0] & (static_cast<uint64>(1) << slot)) {
+				TimerEntry* head = &slots_[0][slot];
+				occupied_[0] &= ~(static_cast<uint64>(1) << slot);
+				while (head->next != head) {
+					TimerEntry* entry = head->next;
+					Unlink(entry);
+					Append(&expired_, entry);
+				}
+			}
+		}
+	}
+
+	TimerEntry* TimerWheel::PopExpired()
+	{
+		if (expired_.next == &expired_)
+			return NULL;
+		TimerEntry* entry = expired_.next;
+		Unlink(entry);
+		count_--;
+		return entry;
+	}
+
+	TimerEntry* TimerWheel::PopAny()
+	{
+		TimerEntry* entry = PopExpired();
+		if (entry)
+			return entry;
+		for (int level = 0; level < kLevels; ++level) {
+			if (occupied_[level]) {
+				entry = slots_[level][LowestBit(occupied_[level])].next;
+				Remove(entry);
+				return entry;
+			}
+		}
+		return NULL;
+	}
+
+	DWORD TimerWheel::NextTimeout(uint64 now) const
+	{
+		if (expired_.next != &expired_)
+			return 0;
+		uint64 next = NextEventTick();
+		if (!next)
+			return INFINITE;
+		if (next <= now)
+			return 0;
+		// Also keeps the value a valid epoll_wait() timeout.
+		uint64 timeout = next - now;
+		return timeout > 0x7FFFFFFF ? 0x7FFFFFFF : static_cast<DWORD>(timeout);
+	}
+
+	uint64 TimerWheel::NextEventTick() const
+	{
+		uint64 next = 0;
+		for (int level = 0; level < kLevels; ++level) {
+			if (!occupied_[level])
+				continue;
+			int shift = level * kSlotBits;
+			// The slot of the current block was done, the search starts
+			// with the next one and may wrap around to it.
+			int start = static_cast<int>(((current_ >> shift) + 1) & (kSlots - 1));
+			int ahead = LowestBit(RotateRight(occupied_[level], start));
+			uint64 tick = ((current_ >> shift) + 1 + ahead) << shift;
+			if (!next || tick < next)
+				next = tick;
+		}
+		return next;
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include "ipc/ipc_common.h"
+
+namespace IPC
+{
+	// Timer queued in a TimerWheel. Embedded in the object that owns the
+	// timer, so queueing it needs no allocation.
+	struct TimerEntry {
+		TimerEntry() : prev(NULL), next(NULL), deadline(0), fire(NULL) {}
+
+		bool is_queued() const { return prev != NULL; }
+
+		TimerEntry* prev;
+		TimerEntry* next;
+		// Tick the timer is due at.
+		uint64 deadline;
+		// Runs the timer, or only lets go of it if |run| is false. Called
+		// after the entry left the wheel.
+		void (*fire)(TimerEntry* entry, bool run);
+	};
+
+	// Hierarchical timer wheel with kLevels levels of kSlots slots. Level 0
+	// has one slot per tick, every further level kSlots times coarser. A
+	// timer sits at the finest level that reaches its deadline and moves
+	// down when the wheel gets close, so Add() and Remove() are O(1). The
+	// levels cover 2^24 ticks, timers further out wait at the last level
+	// until they are in reach.
+	class TimerWheel
+	{
+	public:
+		static const int kSlotBits = 6;
+		static const int kSlots = 1 << kSlotBits;
+		static const int kLevels = 4;
+
+		// |now| is the current tick.
+		explicit TimerWheel(uint64 now);
+		~TimerWheel();
+
+		// Queues |entry|, which must not be queued. A deadline that already
+		// passed is due with the next tick.
+		void Add(TimerEntry* entry);
+
+		// Unqueues |entry| if it is queued.
+		void Remove(TimerEntry* entry);
+
+		// Moves the wheel forward to |now| and marks the timers that became
+		// due, PopExpired() hands them out.
+		void Advance(uint64 now);
+
+		// Unqueues and returns the next timer marked by Advance(), NULL if
+		// there is none.
+		TimerEntry* PopExpired();
+
+		// Unqueues and returns any timer, NULL if the wheel is empty.
+		TimerEntry* PopAny();
+
+		// Ticks from |now| until the wheel has something to do, INFINITE if
+		// it is empty. Can be earlier than the next deadline when timers
+		// have to move down a level.
+		DWORD NextTimeout(uint64 now) const;
+
+		// Queued timers, including the ones waiting in PopExpired().
+		size_t size() const { return count_; }
+
+	private:
+		static void InitList(TimerEntry* head);
+		static void Append(TimerEntry* head, TimerEntry* entry);
+		static void Unlink(TimerEntry* entry);
+
+		// Puts |entry| into its slot relative to |current_|.
+		void Place(TimerEntry* entry);
+		// Empties |slot| of |level| and places its timers again.
+		void Cascade(int level, int slot);
+		// The next tick with a slot to expire or cascade, 0 if none.
+		uint64 NextEventTick() const;
+
+		TimerEntry slots_[kLevels][kSlots];
+		// Bit i is set while slot i of the level is not empty.
+		uint64 occupied_[kLevels];
+		TimerEntry expired_;
+		// The last tick processed.
+		uint64 current_;
+		size_t count_;
+	};
+}
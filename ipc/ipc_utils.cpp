@@ -1,87 +1,265 @@
-#include "ipc_utils.h"
-#include <cassert>
-#include <stdlib.h>
-
-Lock::Lock()
-{
-	::InitializeCriticalSectionAndSpinCount(&cs, 2000);
-}
-
-Lock::~Lock()
-{
-	::DeleteCriticalSection(&cs);
-}
-
-bool Lock::Try()
-{
-	if (::TryEnterCriticalSection(&cs) != FALSE) {
-		return true;
-	}
-	return false;
-}
-
-void Lock::Dolock()
-{
-	::EnterCriticalSection(&cs);
-}
-
-void Lock::Unlock()
-{
-	::LeaveCriticalSection(&cs);
-}
-
-AutoLock::AutoLock(Lock& m)
-	: m_(m)
-{
-	m_.Dolock();
-}
-
-AutoLock::~AutoLock()
-{
-	m_.Unlock();
-}
-
-uint32 RandUint32() {
-	uint32 number;
-	rand_s(&number);
-	return number;
-}
-
-uint64 RandUint64() {
-	uint32 first_half = RandUint32();
-	uint32 second_half = RandUint32();
-	return (static_cast<uint64>(first_half) << 32) + second_half;
-}
-
-int RandInt(int min, int max)
-{
-	assert(min < max);
-
-	uint64 range = static_cast<uint64>(max)-min + 1;
-	int result = min + static_cast<int>(RandGenerator(range));
-	return result;
-}
-
-uint64 RandGenerator(uint64 range)
-{
-	assert(range > 0u);
-	// We must discard random results above this number, as they would
-	// make the random generator non-uniform (consider e.g. if
-	// MAX_UINT64 was 7 and |range| was 5, then a result of 1 would be twice
-	// as likely as a result of 3 or 4).
-	uint64 max_acceptable_value =
-		((std::numeric_limits<uint64>::max)() / range) * range - 1;
-
-	uint64 value;
-	do {
-		value = RandUint64();
-	} while (value > max_acceptable_value);
-
-	return value % range;
-}
-
-std::wstring ASCIIToWide(const std::string& mb)
-{
+#include "ipc_utils.h"
+#include <cassert>
+#include <stdlib.h>
+#include <limits>
+
+#if defined(OS_POSIX)
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(OS_WIN)
+
+Lock::Lock()
+{
+	::InitializeCriticalSectionAndSpinCount(&cs, 2000);
+}
+
+Lock::~Lock()
+{
+	::DeleteCriticalSection(&cs);
+}
+
+bool Lock::Try()
+{
+	if (::TryEnterCriticalSection(&cs) != FALSE) {
+		return true;
+	}
+	return false;
+}
+
+void Lock::Dolock()
+{
+	::EnterCriticalSection(&cs);
+}
+
+void Lock::Unlock()
+{
+	::LeaveCriticalSection(&cs);
+}
+
+WaitableEvent::WaitableEvent(bool manual_reset, bool initially_signaled)
+	: event_(::CreateEvent(NULL, manual_reset, initially_signaled, NULL))
+{
+	assert(event_);
+}
+
+WaitableEvent::~WaitableEvent()
+{
+	::CloseHandle(event_);
+}
+
+void WaitableEvent::Signal()
+{
+	::SetEvent(event_);
+}
+
+void WaitableEvent::Reset()
+{
+	::ResetEvent(event_);
+}
+
+bool WaitableEvent::Wait(DWORD timeout)
+{
+	return ::WaitForSingleObject(event_, timeout) == WAIT_OBJECT_0;
+}
+
+#else
+
+Lock::Lock()
+{
+	pthread_mutex_init(&cs, NULL);
+}
+
+Lock::~Lock()
+{
+	pthread_mutex_destroy(&cs);
+}
+
+bool Lock::Try()
+{
+	return pthread_mutex_trylock(&cs) == 0;
+}
+
+void Lock::Dolock()
+{
+	pthread_mutex_lock(&cs);
+}
+
+void Lock::Unlock()
+{
+	pthread_mutex_unlock(&cs);
+}
+
+WaitableEvent::WaitableEvent(bool manual_reset, bool initially_signaled)
+	: manual_reset_(manual_reset)
+	, signaled_(initially_signaled)
+{
+	pthread_mutex_init(&mutex_, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond_, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+WaitableEvent::~WaitableEvent()
+{
+	pthread_cond_destroy(&cond_);
+	pthread_mutex_destroy(&mutex_);
+}
+
+void WaitableEvent::Signal()
+{
+	pthread_mutex_lock(&mutex_);
+	signaled_ = true;
+	if (manual_reset_)
+		pthread_cond_broadcast(&cond_);
+	else
+		pthread_cond_signal(&cond_);
+	pthread_mutex_unlock(&mutex_);
+}
+
+void WaitableEvent::Reset()
+{
+	pthread_mutex_lock(&mutex_);
+	signaled_ = false;
+	pthread_mutex_unlock(&mutex_);
+}
+
+bool WaitableEvent::Wait(DWORD timeout)
+{
+	struct timespec deadline;
+	if (timeout != INFINITE) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&mutex_);
+	while (!signaled_) {
+		if (timeout == INFINITE) {
+			pthread_cond_wait(&cond_, &mutex_);
+		} else if (pthread_cond_timedwait(&cond_, &mutex_, &deadline) ==
+			ETIMEDOUT) {
+			break;
+		}
+	}
+	bool signaled = signaled_;
+	if (signaled && !manual_reset_)
+		signaled_ = false;
+	pthread_mutex_unlock(&mutex_);
+	return signaled;
+}
+
+#endif
+
+AutoLock::AutoLock(Lock& m)
+	: m_(m)
+{
+	m_.Dolock();
+}
+
+AutoLock::~AutoLock()
+{
+	m_.Unlock();
+}
+
+int32 GetCurrentProcId()
+{
+#if defined(OS_WIN)
+	return static_cast<int32>(::GetCurrentProcessId());
+#else
+	return static_cast<int32>(getpid());
+#endif
+}
+
+uint32 RandUint32() {
+	uint32 number;
+#if defined(OS_WIN)
+	rand_s(&number);
+#else
+	static int urandom_fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	ssize_t n = read(urandom_fd, &number, sizeof(number));
+	assert(n == sizeof(number));
+	(void)n;
+#endif
+	return number;
+}
+
+uint64 RandUint64() {
+	uint32 first_half = RandUint32();
+	uint32 second_half = RandUint32();
+	return (static_cast<uint64>(first_half) << 32) + second_half;
+}
+
+uint64 MonotonicMicroseconds()
+{
+#if defined(OS_WIN)
+	static LARGE_INTEGER frequency;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	// Split up to keep the multiplication from overflowing.
+	uint64 seconds = now.QuadPart / frequency.QuadPart;
+	uint64 rest = now.QuadPart % frequency.QuadPart;
+	return seconds * 1000000 + rest * 1000000 / frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+size_t NumberOfProcessors()
+{
+#if defined(OS_WIN)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? static_cast<size_t>(count) : 1;
+#endif
+}
+
+int RandInt(int min, int max)
+{
+	assert(min < max);
+
+	uint64 range = static_cast<uint64>(max)-min + 1;
+	int result = min + static_cast<int>(RandGenerator(range));
+	return result;
+}
+
+uint64 RandGenerator(uint64 range)
+{
+	assert(range > 0u);
+	// We must discard random results above this number, as they would
+	// make the random generator non-uniform (consider e.g. if
+	// MAX_UINT64 was 7 and |range| was 5, then a result of 1 would be twice
+	// as likely as a result of 3 or 4).
+	uint64 max_acceptable_value =
+		((std::numeric_limits<uint64>::max)() / range) * range - 1;
+
+	uint64 value;
+	do {
+		value = RandUint64();
+	} while (value > max_acceptable_value);
+
+	return value % range;
+}
+
+#if defined(OS_WIN)
+std::wstring ASCIIToWide(const std::string& mb)
+{
 	if (mb.empty())
 		return std::wstring();
 
@@ -96,5 +274,6 @@ std::wstring ASCIIToWide(const std::string& mb)
 	wide.resize(charcount);
 	MultiByteToWideChar(CP_UTF8, 0, mb.data(), mb_length, &wide[0], charcount);
 
-	return wide;
-}
+	return wide;
+}
+#endif
@@ -1,93 +1,224 @@
-#pragma once
-#include "ipc/ipc_common.h"
-
-class Lock
-{
-public:
-	Lock();
-	~Lock();
-
-	bool Try();
-
-	// Take the lock, blocking until it is available if necessary.
-	void Dolock();
-
-	// Release the lock.  This must only be called by the lock's holder: after
-	// a successful call to Try, or a call to Lock.
-	void Unlock();
-
-private:
-	CRITICAL_SECTION cs;
-	DISALLOW_COPY_AND_ASSIGN(Lock);
-};
-
-class AutoLock
-{
-public:
-	explicit AutoLock(Lock& m);
-	~AutoLock();
-
-private:
-	Lock& m_;
-	DISALLOW_COPY_AND_ASSIGN(AutoLock);
-};
-
-class StaticAtomicSequenceNumber {
-public:
-	inline int GetNext() {
-		return static_cast<int>(
-			InterlockedExchangeAdd(reinterpret_cast<volatile LONG*>(&seq_),	1));
-	}
-
-private:
-	friend class AtomicSequenceNumber;
-
-	inline void Reset() {
-		seq_ = 0;
-	}
-
-	int32 seq_;
-};
-
-template <class T>
-class scoped_refptr
-{
-public:
-	scoped_refptr(T* t)
-	{
-		p_ = t;
-		if (p_)
-			p_->AddRef();
-	}
-	~scoped_refptr()
-	{
-		Clear();
-	}
+#pragma once
+#include "ipc/ipc_common.h"
+
+#if defined(OS_POSIX)
+#include <pthread.h>
+#endif
+
+class Lock
+{
+public:
+	Lock();
+	~Lock();
+
+	bool Try();
+
+	// Take the lock, blocking until it is available if necessary.
+	void Dolock();
+
+	// Release the lock.  This must only be called by the lock's holder: after
+	// a successful call to Try, or a call to Lock.
+	void Unlock();
+
+private:
+#if defined(OS_WIN)
+	CRITICAL_SECTION cs;
+#else
+	pthread_mutex_t cs;
+#endif
+	DISALLOW_COPY_AND_ASSIGN(Lock);
+};
+
+class AutoLock
+{
+public:
+	explicit AutoLock(Lock& m);
+	~AutoLock();
+
+private:
+	Lock& m_;
+	DISALLOW_COPY_AND_ASSIGN(AutoLock);
+};
+
+// A Win32-style event object. An auto-reset event releases a single waiter and
+// then resets itself; a manual-reset event stays signaled until Reset().
+class WaitableEvent
+{
+public:
+	WaitableEvent(bool manual_reset, bool initially_signaled);
+	~WaitableEvent();
+
+	void Signal();
+	void Reset();
+
+	// Returns true if the event was signaled before |timeout| milliseconds
+	// elapsed. INFINITE waits forever.
+	bool Wait(DWORD timeout);
+
+private:
+#if defined(OS_WIN)
+	HANDLE event_;
+#else
+	pthread_mutex_t mutex_;
+	pthread_cond_t cond_;
+	bool manual_reset_;
+	bool signaled_;
+#endif
+	DISALLOW_COPY_AND_ASSIGN(WaitableEvent);
+};
+
+// A pointer with a separate value on every thread, NULL until Set() is called
+// on that thread. On POSIX |on_thread_exit| runs for every thread that exits
+// with a non-NULL value. TlsAlloc slots have no such hook, so on Windows
+// threads have to clean up by themselves.
+template <typename T>
+class ThreadLocalPointer
+{
+public:
+	typedef void(*ExitCallback)(T* value);
+
+	explicit ThreadLocalPointer(ExitCallback on_thread_exit = NULL)
+	{
+#if defined(OS_WIN)
+		(void)on_thread_exit;
+		slot_ = ::TlsAlloc();
+#else
+		pthread_key_create(&slot_,
+			reinterpret_cast<void(*)(void*)>(on_thread_exit));
+#endif
+	}
+
+	~ThreadLocalPointer()
+	{
+#if defined(OS_WIN)
+		::TlsFree(slot_);
+#else
+		pthread_key_delete(slot_);
+#endif
+	}
+
+	T* Get() const
+	{
+#if defined(OS_WIN)
+		return static_cast<T*>(::TlsGetValue(slot_));
+#else
+		return static_cast<T*>(pthread_getspecific(slot_));
+#endif
+	}
+
+	void Set(T* value)
+	{
+#if defined(OS_WIN)
+		::TlsSetValue(slot_, value);
+#else
+		pthread_setspecific(slot_, value);
+#endif
+	}
+
+private:
+#if defined(OS_WIN)
+	DWORD slot_;
+#else
+	pthread_key_t slot_;
+#endif
+	DISALLOW_COPY_AND_ASSIGN(ThreadLocalPointer);
+};
+
+class StaticAtomicSequenceNumber {
+public:
+	inline int GetNext() {
+		return static_cast<int>(
+			InterlockedExchangeAdd(reinterpret_cast<volatile LONG*>(&seq_),	1));
+	}
+
+private:
+	friend class AtomicSequenceNumber;
+
+	inline void Reset() {
+		seq_ = 0;
+	}
+
+	int32 seq_;
+};
+
+template <class T>
+class scoped_refptr
+{
+public:
+	scoped_refptr() : p_(NULL)
+	{
+	}
+	scoped_refptr(T* t)
+	{
+		p_ = t;
+		if (p_)
+			p_->AddRef();
+	}
+	~scoped_refptr()
+	{
+		Clear();
+	}
 	scoped_refptr(const scoped_refptr<T>& r) : p_(r.p_) {
 		if (p_)
 			p_->AddRef();
-	}
-	void Clear()
-	{
-		if (p_)
-			p_->Release();
-	}
-	T* operator->() const
-	{
-		return p_;
-	}
-	T* get() const
-	{
-		return p_;
-	}
-
-
-private:
-	T* p_;
-};
-
-int RandInt(int min, int max);
-
-uint64 RandGenerator(uint64 range);
-
-std::wstring ASCIIToWide(const std::string& str);
\ No newline at end of file
+	}
+	scoped_refptr<T>& operator=(T* p)
+	{
+		// AddRef first in case |p| is what we hold already.
+		if (p)
+			p->AddRef();
+		Clear();
+		p_ = p;
+		return *this;
+	}
+	scoped_refptr<T>& operator=(const scoped_refptr<T>& r)
+	{
+		return *this = r.p_;
+	}
+	void Clear()
+	{
+		if (p_)
+			p_->Release();
+	}
+	T* operator->() const
+	{
+		return p_;
+	}
+	T* get() const
+	{
+		return p_;
+	}
+
+
+private:
+	T* p_;
+};
+
+int32 GetCurrentProcId();
+
+int RandInt(int min, int max);
+
+uint64 RandGenerator(uint64 range);
+
+// Microseconds since an arbitrary point, never goes backwards.
+uint64 MonotonicMicroseconds();
+
+// Processors available to the process, at least 1.
+size_t NumberOfProcessors();
+
+// Tells the processor the caller is spinning, which saves power and leaves
+// the execution units to the other hyper-thread of the core.
+inline void CpuRelax()
+{
+#if defined(OS_WIN)
+	YieldProcessor();
+#elif defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+#if defined(OS_WIN)
+std::wstring ASCIIToWide(const std::string& str);
+#endif
\ No newline at end of file
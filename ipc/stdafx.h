@@ -1,10 +1,10 @@
-#pragma once
-
-#define _CRT_RAND_S
-#define _CRT_SECURE_NO_WARNINGS
-
-#include <windows.h>
-#include <stdlib.h>
-
-
+#pragma once
+
+#define _CRT_RAND_S
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <windows.h>
+#include <stdlib.h>
+
+
 #include <vld.h>
\ No newline at end of file
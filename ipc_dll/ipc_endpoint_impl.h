@@ -1,29 +1,54 @@
-#pragma once
-#include "ipc/ipc_interface.h"
-#include "ipc/ipc_endpoint.h"
-#include <string>
-
-namespace IPC
-{
-	class EndpointImpl : public IEndpoint, public Listener
-	{
-	public:
-		EndpointImpl(const std::string& name, IListener* listener);
-		~EndpointImpl();
-		virtual void      AddRef() const override;
-		virtual void      Release() const override;
-		virtual ErrorCode Send(const char* message, size_t len) override;
-		virtual void      SetListener(IListener* listener) override;
-		virtual bool      HasListener() const override;
-	private:
-		virtual bool OnMessageReceived(Message* message) override;
-		virtual void OnChannelConnected(int32 peer_pid) override;
-		virtual void OnChannelError() override;
-	private:
-		Endpoint* endpoint_;
-		IListener* listener_;
-
-		mutable Lock lock_;
-		mutable LONG ref_count_;
-	};
+#pragma once
+#include "ipc/ipc_interface.h"
+#include "ipc/ipc_endpoint.h"
+#include "ipc/ipc_thread_pool.h"
+#include <string>
+
+namespace IPC
+{
+	// The thread pool of the endpoints the factory hands out. Every
+	// endpoint holds a reference, so the last one to go, which may outlive
+	// the factory, stops the threads.
+	class SharedThreadPool
+	{
+	public:
+		SharedThreadPool() : ref_count_(1) {}
+
+		void AddRef() { InterlockedIncrement(&ref_count_); }
+		void Release()
+		{
+			if (InterlockedDecrement(&ref_count_) == 0)
+				delete this;
+		}
+
+		ThreadPool* pool() { return &pool_; }
+
+	private:
+		ThreadPool pool_;
+		LONG ref_count_;
+	};
+
+	class EndpointImpl : public IEndpoint, public Listener
+	{
+	public:
+		EndpointImpl(const std::string& name, IListener* listener,
+			SharedThreadPool* thread_pool);
+		~EndpointImpl();
+		virtual void      AddRef() const override;
+		virtual void      Release() const override;
+		virtual ErrorCode Send(const char* message, size_t len) override;
+		virtual void      SetListener(IListener* listener) override;
+		virtual bool      HasListener() const override;
+	private:
+		virtual bool OnMessageReceived(Message* message) override;
+		virtual void OnChannelConnected(int32 peer_pid) override;
+		virtual void OnChannelError() override;
+	private:
+		SharedThreadPool* thread_pool_;
+		Endpoint* endpoint_;
+		IListener* listener_;
+
+		mutable Lock lock_;
+		mutable LONG ref_count_;
+	};
 }
\ No newline at end of file
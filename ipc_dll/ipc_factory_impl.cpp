@@ -1,33 +1,38 @@
-#include "stdafx.h"
-#include "ipc_factory_impl.h"
-
-namespace IPC
-{
-	FactoryImpl::FactoryImpl()
-	{
-
-	}
-
-	FactoryImpl::~FactoryImpl()
-	{
-		for (auto iter : endpoint_map_)
-		{
-			iter.second->Release();
-		}
-	}
-
-
-	IEndpoint* FactoryImpl::GetEndPoint(const char* name, IListener* listener)
-	{
-		if (name == NULL)
-			return NULL;
-		auto iter = endpoint_map_.find(name);
-		if (iter != endpoint_map_.end())
-			return iter->second;
-		EndpointImpl* p = new EndpointImpl(name, listener);
-		p->AddRef();
-		endpoint_map_[name] = p;
-		return p;
-	}
-
+#include "stdafx.h"
+#include "ipc_factory_impl.h"
+
+namespace IPC
+{
+	FactoryImpl::FactoryImpl()
+		: thread_pool_(NULL)
+	{
+
+	}
+
+	FactoryImpl::~FactoryImpl()
+	{
+		for (auto iter : endpoint_map_)
+		{
+			iter.second->Release();
+		}
+		if (thread_pool_)
+			thread_pool_->Release();
+	}
+
+
+	IEndpoint* FactoryImpl::GetEndPoint(const char* name, IListener* listener)
+	{
+		if (name == NULL)
+			return NULL;
+		auto iter = endpoint_map_.find(name);
+		if (iter != endpoint_map_.end())
+			return iter->second;
+		if (!thread_pool_)
+			thread_pool_ = new SharedThreadPool;
+		EndpointImpl* p = new EndpointImpl(name, listener, thread_pool_);
+		p->AddRef();
+		endpoint_map_[name] = p;
+		return p;
+	}
+
 }
\ No newline at end of file
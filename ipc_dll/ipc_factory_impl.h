@@ -1,17 +1,20 @@
-#pragma once
-#include "ipc/ipc_interface.h"
-#include "ipc_endpoint_impl.h"
-#include <unordered_map>
-
-namespace IPC
-{
-	class FactoryImpl
-	{
-	public:
-		FactoryImpl();
-		~FactoryImpl();
-		IEndpoint* GetEndPoint(const char* name, IListener* listener);
-	private:
-		std::unordered_map<std::string, EndpointImpl*> endpoint_map_;
-	};
+#pragma once
+#include "ipc/ipc_interface.h"
+#include "ipc_endpoint_impl.h"
+#include <unordered_map>
+
+namespace IPC
+{
+	class FactoryImpl
+	{
+	public:
+		FactoryImpl();
+		~FactoryImpl();
+		IEndpoint* GetEndPoint(const char* name, IListener* listener);
+	private:
+		// Shared by all endpoints instead of a thread per endpoint, created
+		// with the first one rather than in DllMain().
+		SharedThreadPool* thread_pool_;
+		std::unordered_map<std::string, EndpointImpl*> endpoint_map_;
+	};
 }
\ No newline at end of file
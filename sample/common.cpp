@@ -1,5 +1,5 @@
-#include "stdafx.h"
-#include "common.h"
-
-
+#include "stdafx.h"
+#include "common.h"
+
+
 const char kChannelName[] = "SampleServer";
\ No newline at end of file
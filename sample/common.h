@@ -1,3 +1,3 @@
-#pragma once
-
+#pragma once
+
 extern const char kChannelName[];
\ No newline at end of file